@@ -5,16 +5,701 @@
 #include <fstream>
 #include <string>
 #include <vector>
-#include <unordered_map>
 #include <memory>
 #include <stack>
 #include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <climits>
 #include <stdexcept>
 #include <exception>
 #include <utility>
+#include <new>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <functional>
+#include <csignal>
+#include <cerrno>
+#include <sstream>
+
+#if defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#define MYPYTHON_SIMD_WIDTH 32
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define MYPYTHON_SIMD_WIDTH 16
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define MYPYTHON_HAVE_TSC 1
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#define MYPYTHON_HAVE_MMAP 1
+#endif
+
+// --jit emits x86-64 code for the System V calling convention
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__) && !defined(MYPYTHON_NO_JIT)
+#include <sys/resource.h>
+#define MYPYTHON_JIT 1
+#endif
+
+/* ----------- TRACING ----------- */
+// Structured debug trace. TRACE() compiles to nothing unless built with -DMYPYTHON_TRACE;
+// when it is compiled in, events go into a fixed in-memory ring (never to stdout) for
+// the categories/levels picked with --trace, and --trace dumps the ring at exit.
+enum class TraceCategory : uint8_t { Lexer, Parser, Interpreter, Count };
+
+enum class TraceLevel : uint8_t { Off, Info, Debug, Verbose };
+
+enum class TraceEvent : uint8_t {
+    ScanToken,     // a = first character, b = line
+    BadCharacter,  // a = character, b = line
+    EnterRule,     // a = ParseRule, b = current TokenType
+    Advance,       // a = TokenType now current, b = line
+    Statement,     // a = ASTNodeType of a parsed top-level statement
+    BinaryOp,      // a = operator code, b = result
+    IfCondition,   // a = condition value
+    Branch,        // a = 1 then, 0 else, -1 no else branch
+    FunctionDef,   // a = parameter count
+    FunctionCall,  // a = argument count
+    Return,        // a = value
+    ParallelChunks // a = chunk count, b = threads used
+};
+
+// Grammar rules, for EnterRule events
+enum class ParseRule : uint8_t {
+    Statement, If, Block, Assign, Print, Return, Function, Call,
+    Expression, Prefix
+};
+
+struct TraceRecord {
+    uint64_t nanos;  // Since the tracer started
+    TraceCategory category;
+    TraceLevel level;
+    TraceEvent event;
+    int32_t a;
+    int32_t b;
+};
+
+class Tracer {
+    public:
+        static Tracer& instance() {
+            static Tracer tracer;
+            return tracer;
+        }
+
+        // spec: comma-separated category[:level], e.g. "parser:debug,interp", or "all"
+        void configure(const std::string& spec) {
+            size_t begin = 0;
+            while (begin <= spec.size()) {
+                size_t end = spec.find(',', begin);
+                if (end == std::string::npos) end = spec.size();
+                std::string item = spec.substr(begin, end - begin);
+                begin = end + 1;
+                if (item.empty()) continue;
+
+                std::string name = item, levelName = "verbose";
+                size_t colon = item.find(':');
+                if (colon != std::string::npos) {
+                    name = item.substr(0, colon);
+                    levelName = item.substr(colon + 1);
+                }
+
+                TraceLevel level = parseLevel(levelName);
+                if (name == "all") {
+                    for (auto& l : levels) l = level;
+                } else {
+                    levels[static_cast<size_t>(parseCategory(name))] = level;
+                }
+            }
+        }
+
+        bool wants(TraceCategory category, TraceLevel level) const {
+            return level <= levels[static_cast<size_t>(category)];
+        }
+
+        void record(TraceCategory category, TraceLevel level, TraceEvent event, int a, int b) {
+            if (!wants(category, level)) return;
+            TraceRecord& slot = ring[head++ & (CAPACITY - 1)];
+            slot.nanos = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count());
+            slot.category = category;
+            slot.level = level;
+            slot.event = event;
+            slot.a = a;
+            slot.b = b;
+        }
+
+        // Oldest surviving event first
+        void dump(std::ostream& out) const {
+            uint64_t first = head > CAPACITY ? head - CAPACITY : 0;
+            out << "--- trace: " << (head - first) << " of " << head << " events ---" << std::endl;
+            for (uint64_t i = first; i < head; ++i) {
+                const TraceRecord& r = ring[i & (CAPACITY - 1)];
+                out << r.nanos / 1000 << "us " << categoryName(r.category) << " " << eventName(r.event)
+                    << " " << r.a << " " << r.b << std::endl;
+            }
+        }
+
+    private:
+        static const uint64_t CAPACITY = 1 << 16;  // Power of two
+        TraceRecord ring[CAPACITY];
+        uint64_t head = 0;
+        TraceLevel levels[static_cast<size_t>(TraceCategory::Count)] = {TraceLevel::Off, TraceLevel::Off, TraceLevel::Off};
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+        static TraceCategory parseCategory(const std::string& name) {
+            if (name == "lexer") return TraceCategory::Lexer;
+            if (name == "parser") return TraceCategory::Parser;
+            if (name == "interp" || name == "interpreter") return TraceCategory::Interpreter;
+            throw std::runtime_error("Unknown trace category: " + name);
+        }
+
+        static TraceLevel parseLevel(const std::string& name) {
+            if (name == "off") return TraceLevel::Off;
+            if (name == "info") return TraceLevel::Info;
+            if (name == "debug") return TraceLevel::Debug;
+            if (name == "verbose") return TraceLevel::Verbose;
+            throw std::runtime_error("Unknown trace level: " + name);
+        }
+
+        static const char* categoryName(TraceCategory category) {
+            switch (category) {
+                case TraceCategory::Lexer: return "lexer";
+                case TraceCategory::Parser: return "parser";
+                case TraceCategory::Interpreter: return "interp";
+                default: return "?";
+            }
+        }
+
+        static const char* eventName(TraceEvent event) {
+            switch (event) {
+                case TraceEvent::ScanToken: return "ScanToken";
+                case TraceEvent::BadCharacter: return "BadCharacter";
+                case TraceEvent::EnterRule: return "EnterRule";
+                case TraceEvent::Advance: return "Advance";
+                case TraceEvent::Statement: return "Statement";
+                case TraceEvent::BinaryOp: return "BinaryOp";
+                case TraceEvent::IfCondition: return "IfCondition";
+                case TraceEvent::Branch: return "Branch";
+                case TraceEvent::FunctionDef: return "FunctionDef";
+                case TraceEvent::FunctionCall: return "FunctionCall";
+                case TraceEvent::Return: return "Return";
+                case TraceEvent::ParallelChunks: return "ParallelChunks";
+                default: return "?";
+            }
+        }
+};
+
+#ifdef MYPYTHON_TRACE
+#define TRACE(category, level, event, a, b) \
+    Tracer::instance().record(TraceCategory::category, TraceLevel::level, TraceEvent::event, static_cast<int>(a), static_cast<int>(b))
+#else
+#define TRACE(category, level, event, a, b) ((void)sizeof(a), (void)sizeof(b))  // Unevaluated
+#endif
+
+/* ----------- SOURCE ----------- */
+
+// Non-owning view of a run of characters (we build as C++14, so no std::string_view)
+class StringRef {
+    public:
+        const char* data;
+        size_t size;
+
+        StringRef() : data(""), size(0) {}
+        StringRef(const char* data, size_t size) : data(data), size(size) {}
+
+        std::string str() const {
+            return std::string(data, size);
+        }
+
+        char operator[](size_t i) const {
+            return data[i];
+        }
+
+        bool operator==(const char* other) const {
+            return std::strlen(other) == size && std::memcmp(data, other, size) == 0;
+        }
+
+        bool operator!=(const char* other) const {
+            return !(*this == other);
+        }
+};
+
+std::ostream& operator<<(std::ostream& out, StringRef ref) {
+    return out.write(ref.data, ref.size);
+}
+
+// Utility Function: Read file, turn into string
+std::string fileToString(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Could not open file: " + path);
+    }
+    return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+// The script's bytes. Mapped read-only where the platform allows it, so the lexer and
+// every token view straight into the file instead of into a copy of it.
+class SourceBuffer {
+    public:
+        explicit SourceBuffer(const std::string& path) {
+#ifdef MYPYTHON_HAVE_MMAP
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("Could not open file: " + path);
+            }
+
+            struct stat info;
+            if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+                void* mapping = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapping != MAP_FAILED) {
+                    madvise(mapping, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);  // Lexed front to back
+                    bytes = static_cast<const char*>(mapping);
+                    length = static_cast<size_t>(info.st_size);
+                    mapped = true;
+                }
+            }
+            close(fd);
+#endif
+            if (!mapped) { // Empty files, pipes, or no mmap: fall back to reading into memory
+                fallback = fileToString(path);
+                bytes = fallback.data();
+                length = fallback.size();
+            }
+
+            if (length > UINT32_MAX) {
+                throw std::runtime_error("Script too large: " + path);
+            }
+        }
+
+        ~SourceBuffer() {
+#ifdef MYPYTHON_HAVE_MMAP
+            if (mapped) munmap(const_cast<char*>(bytes), length);
+#endif
+        }
+
+        SourceBuffer(const SourceBuffer&) = delete;
+        SourceBuffer& operator=(const SourceBuffer&) = delete;
+
+        const char* data() const {
+            return bytes;
+        }
+
+        size_t size() const {
+            return length;
+        }
+
+    private:
+        const char* bytes = "";
+        size_t length = 0;
+        bool mapped = false;
+        std::string fallback;
+};
+
+/* ----------- OUTPUT ----------- */
+// Everything the script prints goes through one Output: a 64 KB buffer handed to the
+// OS a block at a time (write(2) where there is one), instead of a flush per line.
+// It is flushed when full, at exit, before anything goes to stderr, after every line
+// when stdout is a terminal, and from a SIGFPE handler, so a crash doesn't lose the
+// lines before it.
+class Output {
+    public:
+        static Output& instance() {
+            static Output output;
+            return output;
+        }
+
+        ~Output() {
+            flush();
+        }
+
+        void write(const char* text, size_t size) {
+            if (used + size > CAPACITY) {
+                writeSlow(text, size);
+                return;
+            }
+            std::memcpy(buffer + used, text, size);
+            used += size;
+        }
+
+        void write(StringRef text) {
+            write(text.data, text.size);
+        }
+
+        void write(const std::string& text) {
+            write(text.data(), text.size());
+        }
+
+        // print()'s separator between arguments
+        void space() {
+            if (used == CAPACITY) flush();
+            buffer[used++] = ' ';
+        }
+
+        // Two digits at a time from a table, right to left
+        void integer(int value) {
+            if (used + MAX_INT_CHARS > CAPACITY) flush();
+            char digits[MAX_INT_CHARS];
+            char* end = digits + MAX_INT_CHARS;
+            char* p = end;
+            unsigned magnitude = value < 0 ? 0u - static_cast<unsigned>(value) : static_cast<unsigned>(value);
+            while (magnitude >= 100) {
+                unsigned pair = (magnitude % 100) * 2;
+                magnitude /= 100;
+                *--p = DIGIT_PAIRS[pair + 1];
+                *--p = DIGIT_PAIRS[pair];
+            }
+            if (magnitude >= 10) {
+                *--p = DIGIT_PAIRS[magnitude * 2 + 1];
+                *--p = DIGIT_PAIRS[magnitude * 2];
+            } else {
+                *--p = static_cast<char>('0' + magnitude);
+            }
+            if (value < 0) *--p = '-';
+            size_t size = static_cast<size_t>(end - p);
+            std::memcpy(buffer + used, p, size);
+            used += size;
+        }
+
+        void endLine() {
+            if (used == CAPACITY) flush();
+            buffer[used++] = '\n';
+            if (interactive) flush();
+        }
+
+        void flush() {
+            if (!discarding) writeAll(buffer, used);
+            used = 0;
+        }
+
+        // Benchmarks: keep formatting, throw the bytes away
+        void setDiscarding(bool discard) {
+            flush();
+            discarding = discard;
+        }
+
+    private:
+        static const size_t CAPACITY = 64 * 1024;
+        static const size_t MAX_INT_CHARS = 11;  // "-2147483648"
+        static const char DIGIT_PAIRS[201];
+
+        char buffer[CAPACITY];
+        size_t used = 0;
+        bool interactive = false;
+        bool discarding = false;
+
+        Output() {
+#ifdef MYPYTHON_HAVE_MMAP
+            interactive = isatty(STDOUT_FILENO);
+            struct sigaction action = {};
+            action.sa_handler = flushAndCrash;
+            action.sa_flags = SA_RESETHAND;  // The default action once we're done
+            sigaction(SIGFPE, &action, nullptr);
+#endif
+        }
+
+        void writeSlow(const char* text, size_t size) {
+            flush();
+            if (size >= CAPACITY) {
+                if (!discarding) writeAll(text, size);
+                return;
+            }
+            std::memcpy(buffer, text, size);
+            used = size;
+        }
+
+        static void writeAll(const char* text, size_t size) {
+#ifdef MYPYTHON_HAVE_MMAP
+            while (size > 0) {
+                ssize_t written = ::write(STDOUT_FILENO, text, size);
+                if (written < 0 && errno == EINTR) continue;
+                if (written <= 0) return;
+                text += written;
+                size -= static_cast<size_t>(written);
+            }
+#else
+            std::fwrite(text, 1, size, stdout);
+            std::fflush(stdout);
+#endif
+        }
+
+#ifdef MYPYTHON_HAVE_MMAP
+        // Integer % 0 and INT_MIN / -1 trap. Nothing in Output is running then (the trap is
+        // in the arithmetic), so the buffer is whole; write() is safe in a handler.
+        static void flushAndCrash(int signal) {
+            Output& output = instance();
+            if (!output.discarding) writeAll(output.buffer, output.used);
+            output.used = 0;
+            raise(signal);
+        }
+#endif
+};
+
+const char Output::DIGIT_PAIRS[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* ----------- SYMBOLS ----------- */
+// Every identifier is interned once, by the lexer, into a dense id. Everything past the
+// lexer (AST, scopes, function table) names variables and functions by id.
+typedef uint32_t SymbolId;
+
+const SymbolId NO_SYMBOL = UINT32_MAX;
+
+// Open-addressing hash map keyed by SymbolId: flat arrays, linear probing, no per-entry
+// allocation. There is no erase; the interpreter never forgets a name.
+template <typename V>
+class SymbolMap {
+    public:
+        SymbolMap() : keys(INITIAL_CAPACITY, NO_SYMBOL), values(INITIAL_CAPACITY) {}
+
+        V* find(SymbolId key) {
+            size_t mask = keys.size() - 1;
+            for (size_t i = slotFor(key); ; i = (i + 1) & mask) {
+                if (keys[i] == key) return &values[i];
+                if (keys[i] == NO_SYMBOL) return nullptr;
+            }
+        }
+
+        const V* find(SymbolId key) const {
+            return const_cast<SymbolMap*>(this)->find(key);
+        }
+
+        void set(SymbolId key, const V& value) {
+            if ((count + 1) * 4 > keys.size() * 3) grow();  // Keep the load factor under 3/4
+            size_t mask = keys.size() - 1;
+            size_t i = slotFor(key);
+            while (keys[i] != NO_SYMBOL && keys[i] != key) i = (i + 1) & mask;
+            if (keys[i] == NO_SYMBOL) {
+                keys[i] = key;
+                count++;
+            }
+            values[i] = value;
+        }
+
+        size_t size() const {
+            return count;
+        }
+
+    private:
+        static const size_t INITIAL_CAPACITY = 8;  // Power of two
+        std::vector<SymbolId> keys;
+        std::vector<V> values;
+        size_t count = 0;
+
+        size_t slotFor(SymbolId key) const {
+            return (key * 2654435761u) & (keys.size() - 1);  // Ids are dense, so scramble them
+        }
+
+        void grow() {
+            std::vector<SymbolId> oldKeys(keys.size() * 2, NO_SYMBOL);
+            std::vector<V> oldValues(values.size() * 2);
+            oldKeys.swap(keys);
+            oldValues.swap(values);
+            count = 0;
+            for (size_t i = 0; i < oldKeys.size(); ++i) {
+                if (oldKeys[i] != NO_SYMBOL) set(oldKeys[i], oldValues[i]);
+            }
+        }
+};
+
+class SymbolTable {
+    public:
+        static SymbolTable& instance() {
+            static SymbolTable table;
+            return table;
+        }
+
+        // Lexers on the parallel front end intern concurrently, hence the lock
+        SymbolId intern(StringRef text) {
+            uint32_t hash = hashOf(text);
+            std::lock_guard<std::mutex> hold(lock);
+            size_t mask = slots.size() - 1;
+            size_t i = hash & mask;
+            while (slots[i] != NO_SYMBOL) {
+                SymbolId id = slots[i];
+                if (hashes[id] == hash && names[id].size() == text.size && std::memcmp(names[id].data(), text.data, text.size) == 0) {
+                    return id;
+                }
+                i = (i + 1) & mask;
+            }
+
+            SymbolId id = static_cast<SymbolId>(names.size());
+            names.push_back(text.str());
+            hashes.push_back(hash);
+            slots[i] = id;
+            if (names.size() * 2 > slots.size()) rehash();
+            return id;
+        }
+
+        SymbolId intern(const char* text) {
+            return intern(StringRef(text, std::strlen(text)));
+        }
+
+        const std::string& name(SymbolId id) const {
+            std::lock_guard<std::mutex> hold(lock);
+            return names[id];  // deque: the reference survives later interning
+        }
+
+        size_t size() const {
+            std::lock_guard<std::mutex> hold(lock);
+            return names.size();
+        }
+
+    private:
+        mutable std::mutex lock;
+        std::deque<std::string> names;   // Indexed by id
+        std::vector<uint32_t> hashes;    // Indexed by id
+        std::vector<SymbolId> slots = std::vector<SymbolId>(64, NO_SYMBOL);
+
+        static uint32_t hashOf(StringRef text) { // FNV-1a
+            uint32_t hash = 2166136261u;
+            for (size_t i = 0; i < text.size; ++i) {
+                hash = (hash ^ static_cast<unsigned char>(text[i])) * 16777619u;
+            }
+            return hash;
+        }
+
+        void rehash() {
+            std::vector<SymbolId> bigger(slots.size() * 2, NO_SYMBOL);
+            size_t mask = bigger.size() - 1;
+            for (SymbolId id = 0; id < names.size(); ++id) {
+                size_t i = hashes[id] & mask;
+                while (bigger[i] != NO_SYMBOL) i = (i + 1) & mask;
+                bigger[i] = id;
+            }
+            slots.swap(bigger);
+        }
+};
+
+inline const std::string& symbolName(SymbolId id) {
+    return SymbolTable::instance().name(id);
+}
+
+/* ----------- SCANNING KERNELS ----------- */
+// Find where a run of one character class ends. The lexer spends most of its time in
+// these loops (blanks, comments, identifiers, numbers, strings).
+enum class CharRun {
+    Blank,       // ' ', '\t', '\r' between tokens
+    Indent,      // ' ', '\t' at the start of a line
+    Identifier,  // [A-Za-z0-9_]
+    Digit        // [0-9]
+};
+
+// One byte at a time. Reference implementation, and what --bench-lex compares against.
+struct ScalarScan {
+    static bool inRun(CharRun run, char c) {
+        switch (run) {
+            case CharRun::Blank: return c == ' ' || c == '\t' || c == '\r';
+            case CharRun::Indent: return c == ' ' || c == '\t';
+            case CharRun::Identifier: return std::isalnum(static_cast<unsigned char>(c)) != 0 || c == '_';
+            case CharRun::Digit: return c >= '0' && c <= '9';
+        }
+        return false;
+    }
+
+    static const char* runEnd(CharRun run, const char* p, const char* end) {
+        while (p < end && inRun(run, *p)) p++;
+        return p;
+    }
+
+    static const char* find(char c, const char* p, const char* end) {
+        while (p < end && *p != c) p++;
+        return p;
+    }
+};
+
+#ifdef MYPYTHON_SIMD_WIDTH
+// Classifies a whole SSE2 (16 byte) or AVX2 (32 byte) block per step, then hands the
+// tail that doesn't fill a block to ScalarScan so we never read past the buffer.
+struct VectorScan {
+#if MYPYTHON_SIMD_WIDTH == 32
+    typedef __m256i Block;
+    static Block load(const char* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+    static Block splat(char c) { return _mm256_set1_epi8(c); }
+    static Block eq(Block a, Block b) { return _mm256_cmpeq_epi8(a, b); }
+    static Block either(Block a, Block b) { return _mm256_or_si256(a, b); }
+    static Block minUnsigned(Block a, Block b) { return _mm256_min_epu8(a, b); }
+    static Block sub(Block a, Block b) { return _mm256_sub_epi8(a, b); }
+    static uint32_t bits(Block b) { return static_cast<uint32_t>(_mm256_movemask_epi8(b)); }
+    static const uint32_t ALL = 0xFFFFFFFFu;
+#else
+    typedef __m128i Block;
+    static Block load(const char* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+    static Block splat(char c) { return _mm_set1_epi8(c); }
+    static Block eq(Block a, Block b) { return _mm_cmpeq_epi8(a, b); }
+    static Block either(Block a, Block b) { return _mm_or_si128(a, b); }
+    static Block minUnsigned(Block a, Block b) { return _mm_min_epu8(a, b); }
+    static Block sub(Block a, Block b) { return _mm_sub_epi8(a, b); }
+    static uint32_t bits(Block b) { return static_cast<uint32_t>(_mm_movemask_epi8(b)); }
+    static const uint32_t ALL = 0xFFFFu;
+#endif
+    static const size_t WIDTH = MYPYTHON_SIMD_WIDTH;
+
+    // lo <= c <= hi as one unsigned compare: (c - lo) <= (hi - lo)
+    static Block inRange(Block v, char lo, char hi) {
+        Block offset = sub(v, splat(lo));
+        return eq(minUnsigned(offset, splat(static_cast<char>(hi - lo))), offset);
+    }
+
+    static Block classify(CharRun run, Block v) {
+        switch (run) {
+            case CharRun::Blank:
+                return either(either(eq(v, splat(' ')), eq(v, splat('\t'))), eq(v, splat('\r')));
+            case CharRun::Indent:
+                return either(eq(v, splat(' ')), eq(v, splat('\t')));
+            case CharRun::Identifier: {
+                Block letter = inRange(either(v, splat(0x20)), 'a', 'z');  // 0x20 folds upper case to lower
+                return either(either(letter, inRange(v, '0', '9')), eq(v, splat('_')));
+            }
+            case CharRun::Digit:
+                return inRange(v, '0', '9');
+        }
+        return splat(0);
+    }
+
+    static const char* runEnd(CharRun run, const char* p, const char* end) {
+        while (static_cast<size_t>(end - p) >= WIDTH) {
+            uint32_t inside = bits(classify(run, load(p)));
+            if (inside != ALL) return p + __builtin_ctz(~inside);
+            p += WIDTH;
+        }
+        return ScalarScan::runEnd(run, p, end);
+    }
+
+    static const char* find(char c, const char* p, const char* end) {
+        Block target = splat(c);
+        while (static_cast<size_t>(end - p) >= WIDTH) {
+            uint32_t hits = bits(eq(load(p), target));
+            if (hits != 0) return p + __builtin_ctz(hits);
+            p += WIDTH;
+        }
+        return ScalarScan::find(c, p, end);
+    }
+};
+#else
+struct VectorScan : ScalarScan {};  // No SSE2/AVX2 on this target
+#endif
 
 /* ----------- LEXER ---------- */
-enum class TokenType {
+enum class TokenType : uint8_t {
     IDENTIFIER, 
     NUMBER, 
     ASSIGN, 
@@ -42,15 +727,33 @@ enum class TokenType {
 
     NEWLINE, END_OF_FILE, ERROR,
 
-    RETURN, MODULUS
+    RETURN, MODULUS,
+
+    WHILE, FOR, AND, OR, NOT,
+    NONE, TRUE, FALSE,
+
+    POWER, FLOOR_DIVIDE,  // ** and //
+
+    COUNT  // Number of token types, not a token
 };
 
+// Tokens don't own their text: offset/length locate the lexeme inside the source buffer
 class Token {
     public:
+        uint32_t offset;
+        uint32_t length;
+        uint32_t line;
+        SymbolId symbol;  // Interned name for IDENTIFIER tokens, NO_SYMBOL otherwise
         TokenType type;
-        std::string lexeme;
 
-        Token(TokenType type, const std::string& lexeme) : type(type), lexeme(lexeme) {}
+        Token() : offset(0), length(0), line(0), symbol(NO_SYMBOL), type(TokenType::END_OF_FILE) {}
+
+        Token(TokenType type, uint32_t offset, uint32_t length, uint32_t line, SymbolId symbol = NO_SYMBOL)
+            : offset(offset), length(length), line(line), symbol(symbol), type(type) {}
+
+        StringRef lexeme(const char* source) const {
+            return StringRef(source + offset, length);
+        }
 
         std::string tokenTypeToString() const {
             switch (type) {
@@ -83,117 +786,220 @@ class Token {
                 case TokenType::ERROR: return "ERROR";
                 case TokenType::RETURN: return "RETURN";
                 case TokenType::MODULUS: return "MODULUS";
+                case TokenType::WHILE: return "WHILE";
+                case TokenType::FOR: return "FOR";
+                case TokenType::AND: return "AND";
+                case TokenType::OR: return "OR";
+                case TokenType::NOT: return "NOT";
+                case TokenType::NONE: return "NONE";
+                case TokenType::TRUE: return "TRUE";
+                case TokenType::FALSE: return "FALSE";
+                case TokenType::POWER: return "POWER";
+                case TokenType::FLOOR_DIVIDE: return "FLOOR_DIVIDE";
                 default: return "UNKNOWN";
             }
         }
 
-        void print() const {
-            std::cout << "Token Type: " << tokenTypeToString() << ", Lexeme: '" << lexeme << "'" << std::endl;
+        void print(const char* source) const {
+            std::cout << "Token Type: " << tokenTypeToString() << ", Lexeme: '" << lexeme(source) << "'" << std::endl;
         }
 
 };
 
+static_assert(sizeof(Token) == 20, "Token should stay a small packed record");
+
+/* --- Keywords --- */
+// Recognised with a perfect hash built at compile time, straight off the identifier's
+// characters in the source buffer.
+struct Keyword {
+    const char* text;
+    TokenType type;
+};
+
+constexpr Keyword KEYWORDS[] = {
+    {"print", TokenType::PRINT},
+    {"if", TokenType::IF},
+    {"else", TokenType::ELSE},
+    {"def", TokenType::DEF},
+    {"return", TokenType::RETURN},
+    {"while", TokenType::WHILE},
+    {"for", TokenType::FOR},
+    {"and", TokenType::AND},
+    {"or", TokenType::OR},
+    {"not", TokenType::NOT},
+    {"None", TokenType::NONE},
+    {"True", TokenType::TRUE},
+    {"False", TokenType::FALSE},
+};
+
+constexpr size_t KEYWORD_COUNT = sizeof(KEYWORDS) / sizeof(KEYWORDS[0]);
+constexpr size_t KEYWORD_SLOTS = 32;  // Power of two
+
+constexpr size_t constLength(const char* text) {
+    size_t length = 0;
+    while (text[length] != '\0') length++;
+    return length;
+}
+
+// Length plus first and last character. If a new keyword collides, the static_assert
+// below fails and this (or KEYWORD_SLOTS) needs retuning.
+constexpr size_t keywordHash(const char* text, size_t length) {
+    return (length + static_cast<unsigned char>(text[0]) + static_cast<unsigned char>(text[length - 1])) & (KEYWORD_SLOTS - 1);
+}
+
+struct KeywordTable {
+    int8_t slots[KEYWORD_SLOTS];  // Index into KEYWORDS, -1 if empty, -2 if two keywords collide
+};
+
+constexpr KeywordTable buildKeywordTable() {
+    KeywordTable table{};
+    for (size_t i = 0; i < KEYWORD_SLOTS; ++i) {
+        table.slots[i] = -1;
+    }
+    for (size_t k = 0; k < KEYWORD_COUNT; ++k) {
+        size_t slot = keywordHash(KEYWORDS[k].text, constLength(KEYWORDS[k].text));
+        table.slots[slot] = table.slots[slot] == -1 ? static_cast<int8_t>(k) : -2;
+    }
+    return table;
+}
+
+constexpr bool isPerfect(const KeywordTable& table) {
+    for (size_t i = 0; i < KEYWORD_SLOTS; ++i) {
+        if (table.slots[i] == -2) return false;
+    }
+    return true;
+}
+
+constexpr KeywordTable KEYWORD_TABLE = buildKeywordTable();
+static_assert(isPerfect(KEYWORD_TABLE), "keywordHash has collisions, retune it");
+
+// IDENTIFIER unless text is exactly one of the keywords. No allocation, one compare at most.
+inline TokenType classifyWord(const char* text, size_t length) {
+    int8_t k = KEYWORD_TABLE.slots[keywordHash(text, length)];
+    if (k >= 0 && std::strncmp(KEYWORDS[k].text, text, length) == 0 && KEYWORDS[k].text[length] == '\0') {
+        return KEYWORDS[k].type;
+    }
+    return TokenType::IDENTIFIER;
+}
+
+// Tokens are produced on demand by next(); only what one scan step emits is buffered
 class Lexer {
     public:
-        Lexer(const std::string& source) : source(source) {
-            tokenize();
+        Lexer(const char* source, size_t length, bool vectorScan = true) : source(source), length(length), vectorScan(vectorScan) {
+            indentLevels.push(0);
+            // handleIndentation();
+        }
+
+        // Lexes only source[begin, end), which must start at column 0 of line firstLine.
+        // Offsets stay relative to source, so tokens are interchangeable with a whole-file lexer's.
+        Lexer(const char* source, size_t begin, size_t end, size_t firstLine) : Lexer(source, end) {
+            current = begin;
+            line = firstLine;
+        }
+
+        // Pull the next token. Once the input is exhausted this keeps returning END_OF_FILE.
+        Token next() {
+            while (pendingHead == pending.size()) {
+                pending.clear();
+                pendingHead = 0;
+
+                if (!isAtEnd()) {
+                    scanToken();
+                } else {
+                    start = current;
+                    addToken(TokenType::END_OF_FILE);
+                }
+            }
+            return pending[pendingHead++];
         }
 
-        const std::vector<Token>& getTokens() const {
+        // Whole-file token list, used for debugging dumps
+        std::vector<Token> tokenize() {
+            std::vector<Token> tokens;
+            tokens.reserve(length / 4 + 1); // Rough guess, avoids most regrowth on big scripts
+
+            do {
+                tokens.push_back(next());
+            } while (tokens.back().type != TokenType::END_OF_FILE);
+
             return tokens;
         }
 
+        const char* getSource() const {
+            return source;
+        }
+
     private:
-        std::string source;
-        std::vector<Token> tokens;
+        const char* source;
+        size_t length;
+        bool vectorScan;  // VectorScan kernels, or ScalarScan (benchmark baseline)
+        std::vector<Token> pending;  // Tokens from the last scan step not yet handed out
+        size_t pendingHead = 0;
         size_t start = 0;
         size_t current = 0;
         size_t line = 1;
         std::stack<int> indentLevels;
         bool isBlock = false;
 
-        void tokenize() {
-
-            isBlock = false;
-            indentLevels.push(0);
-            // handleIndentation();
-            
-            while (!isAtEnd()) {
-                scanToken();
-            }
-            addToken(TokenType::END_OF_FILE, "");
-        }
-
         void scanToken() {
 
+            start = current;
             char c = advance();
-            std::cout << "Scanning character: " << c << std::endl;  // debugging
+            TRACE(Lexer, Verbose, ScanToken, c, line);
 
 
             switch (c) {
                 case '#':
-                    while (peek() != '\n' && !isAtEnd()) advance();
+                    current = findChar('\n', current);
                     break; // Comments go until the end of the line
                 case '+':
-                    addToken(TokenType::PLUS, "+");
+                    addToken(TokenType::PLUS);
                     break;
                 case '*':
-                    addToken(TokenType::MULTIPLY, "*");
+                    addTwoCharToken('*', TokenType::POWER, TokenType::MULTIPLY);
                     break;
                 case '-':
-                    addToken(TokenType::MINUS, "-");
+                    addToken(TokenType::MINUS);
                     break;
                 case '/':
-                    addToken(TokenType::DIVIDE, "/");
+                    addTwoCharToken('/', TokenType::FLOOR_DIVIDE, TokenType::DIVIDE);
                     break;
                 case '(':
-                    addToken(TokenType::LEFT_PAREN, "(");
+                    addToken(TokenType::LEFT_PAREN);
                     break;
                 case ')':
-                    addToken(TokenType::RIGHT_PAREN, ")");
+                    addToken(TokenType::RIGHT_PAREN);
                     break;
                 case ',':
-                    addToken(TokenType::COMMA, ",");
+                    addToken(TokenType::COMMA);
                     break;
                 case ':':
-                    addToken(TokenType::COLON, ":");
+                    addToken(TokenType::COLON);
                     break;
                 case '!':
-                    addToken(peek() == '=' ? TokenType::BANG_EQUAL : TokenType::ERROR, peek() == '=' ? "N" : "!");
-                    if (peek() == '=') advance();
+                    addTwoCharToken('=', TokenType::BANG_EQUAL, TokenType::ERROR);
                     break;
                 case '=':
-                    addToken(peek() == '=' ? TokenType::EQUAL_EQUAL : TokenType::ASSIGN, peek() == '=' ? "E" : "=");
-                    if (peek() == '=') advance();
+                    addTwoCharToken('=', TokenType::EQUAL_EQUAL, TokenType::ASSIGN);
                     break;
                 case '<':
-                    addToken(peek() == '=' ? TokenType::LESS_EQUAL : TokenType::LESS, peek() == '=' ? "L" : "<");
-                    if (peek() == '=') advance();
+                    addTwoCharToken('=', TokenType::LESS_EQUAL, TokenType::LESS);
                     break;
                 case '>':
-                    addToken(peek() == '=' ? TokenType::GREATER_EQUAL : TokenType::GREATER, peek() == '=' ? "G" : ">");
-                    if (peek() == '=') advance();
+                    addTwoCharToken('=', TokenType::GREATER_EQUAL, TokenType::GREATER);
                     break;
                 case '%':
-                    addToken(TokenType::MODULUS, "%");
+                    addToken(TokenType::MODULUS);
                     break;
                 case '\n':
                     line++;
-                    addToken(TokenType::NEWLINE, "");
                     start = current;
+                    addToken(TokenType::NEWLINE);
                     handleIndentation();
                     break;
-                case 'r':
-                    if (checkReturnKeyword()) {
-                        std::cout << "Handling 'return' keyword\n"; // Debugging output
-                        addToken(TokenType::RETURN, "return");
-                        current += 5; // Advance past "eturn"
-            }       else {
-                        handleIdentifier();
-            }
-            break;
                 case ' ': case '\r': case '\t':
                     // Ignore whitespace
+                    current = runEnd(CharRun::Blank, current);
                     break;
                 case '"': case '\'':
                     handleString(c);
@@ -204,8 +1010,8 @@ class Lexer {
                     } else if (isalpha(c) || c == '_') {
                         handleIdentifier();
                     } else {
-                        std::cout << "Unexpected character: " << c << std::endl;
-                        addToken(TokenType::ERROR, std::string(1, c));
+                        TRACE(Lexer, Info, BadCharacter, c, line);
+                        addToken(TokenType::ERROR);
                     }
 
                     break;
@@ -214,24 +1020,8 @@ class Lexer {
 
         }
         
-        bool checkReturnKeyword() {
-            if (current - 1 + 6 > source.size() || source.substr(current - 1, 6) != "return") return false;
-            if (source.substr(current - 1, 6) == "return")
-                return false;
-            char nextChar = source[current + 5];
-            return nextChar == ' ' || nextChar == ';' || nextChar == '\n' || nextChar == '(' || nextChar == ')' || nextChar == '{' || isWhitespace(nextChar);
-}
-
-        bool isalnum(char c) {
-            return std::isalnum(c) != 0;
-        }
-
         bool isAtEnd() const {
-            return current >= source.size();
-        }
-
-        bool isWhitespace(char c) { 
-            return c == ' ' || c == '\t'; 
+            return current >= length;
         }
 
         char advance() {
@@ -239,63 +1029,73 @@ class Lexer {
         }
 
         char peek() const {
-            if (current >= source.size()) return '\0';
+            if (current >= length) return '\0';
             return source[current];
         }
 
-        void addToken(TokenType type, const std::string& lexeme) {
-            tokens.push_back(Token(type, lexeme));
+        // Index just past the run of `run` characters starting at `from`
+        size_t runEnd(CharRun run, size_t from) const {
+            const char* p = source + from;
+            const char* end = source + length;
+            return (vectorScan ? VectorScan::runEnd(run, p, end) : ScalarScan::runEnd(run, p, end)) - source;
         }
 
-        void handleString(char quoteType) {
-            start = current;
-            while (!isAtEnd() && peek() != quoteType) advance();
-            if (isAtEnd()) throw std::runtime_error("Unterminated string.");
-            advance(); // Skip the closing quote
-            addToken(TokenType::STRING, source.substr(start, current - start - 1));
+        // Index of the next `c` at or after `from`, or length if there is none
+        size_t findChar(char c, size_t from) const {
+            const char* p = source + from;
+            const char* end = source + length;
+            return (vectorScan ? VectorScan::find(c, p, end) : ScalarScan::find(c, p, end)) - source;
+        }
+
+        void addToken(TokenType type) {
+            addToken(type, start, current - start);
+        }
+
+        void addToken(TokenType type, size_t offset, size_t count) {
+            pending.push_back(Token(type, static_cast<uint32_t>(offset), static_cast<uint32_t>(count), static_cast<uint32_t>(line)));
+        }
+
+        // For '==', '**' etc.: the two-char token if `second` follows, otherwise the single-char one
+        void addTwoCharToken(char second, TokenType pair, TokenType single) {
+            if (peek() == second) {
+                advance();
+                addToken(pair);
+            } else {
+                addToken(single);
+            }
+        }
+
+        void handleString(char quoteType) {
+            start = current;
+            current = findChar(quoteType, current);
+            if (isAtEnd()) throw std::runtime_error("Unterminated string.");
+            advance(); // Skip the closing quote
+            addToken(TokenType::STRING, start, current - start - 1);
         }
 
         void handleNumber() {
             start = current - 1;
-            while (!isAtEnd() && isdigit(peek())) advance();
-            addToken(TokenType::NUMBER, source.substr(start, current - start));
+            current = runEnd(CharRun::Digit, current);
+            addToken(TokenType::NUMBER);
         }
 
         void handleIdentifier() {
             start = current - 1;
+            current = runEnd(CharRun::Identifier, current);
             
-            while (!isAtEnd() && (isalnum(peek()) || peek() == '_')) {
-                advance();
-            }
-            
-            std::string text = source.substr(start, current - start);
-            std::cout << "Handling identifier: " << text << std::endl; // Debug output
-            if (text == "print") {
-                addToken(TokenType::PRINT, text);
-            } else if (text == "if") {
-                addToken(TokenType::IF, text);
-            } else if (text == "else") {
-                addToken(TokenType::ELSE, text);
-            } else if (text == "def") {
-                addToken(TokenType::DEF, text);
-            } else if (text == "return") {
-                addToken(TokenType::RETURN, text);
+            StringRef text(source + start, current - start);
+            TokenType type = classifyWord(text.data, text.size);
+            if (type == TokenType::IDENTIFIER) {
+                pending.push_back(Token(type, static_cast<uint32_t>(start), static_cast<uint32_t>(text.size), static_cast<uint32_t>(line), SymbolTable::instance().intern(text)));
             } else {
-                addToken(TokenType::IDENTIFIER, text);
+                addToken(type);
             }
-
         }
 
         void handleIndentation() {
-            int indent = 0;
-
-            while (isWhitespace(peek())) {
-                indent++;
-                advance();
-    
-                //Debugging
-                //std::cout << indent << std::endl;
-            }
+            size_t indentEnd = runEnd(CharRun::Indent, current);
+            int indent = static_cast<int>(indentEnd - current);
+            current = indentEnd;
 
             if (peek() == '\n') {
                 // Only whitespaces
@@ -308,17 +1108,18 @@ class Lexer {
             } */
 
             int prevIndentLvl = indentLevels.top(); 
+            start = current;
 
             if(indent > prevIndentLvl) {
                 indentLevels.push(indent);
-                addToken(TokenType::INDENT, "");
+                addToken(TokenType::INDENT);
                 isBlock = true;
 
             } else if(indent < prevIndentLvl){
 
                 while(!indentLevels.empty() && indent < indentLevels.top()) {
                     indentLevels.pop();
-                    addToken(TokenType::DEDENT, "");
+                    addToken(TokenType::DEDENT);
                 }
 
                 if (indentLevels.empty() || indent != indentLevels.top()) {
@@ -338,6 +1139,33 @@ class Lexer {
 };
 
 
+// Lookahead window over a Lexer. The parser addresses tokens by absolute index but only
+// the last few live here, so token memory stays constant however long the script is.
+class TokenStream {
+    public:
+        explicit TokenStream(Lexer& lexer) : lexer(lexer) {}
+
+        // index may lag the furthest token pulled by at most WINDOW - 1 (enough for previous/peek/peekNext)
+        const Token& at(size_t index) {
+            while (filled <= index) {
+                window[filled & (WINDOW - 1)] = lexer.next();
+                filled++;
+            }
+            return window[index & (WINDOW - 1)];
+        }
+
+        const char* getSource() const {
+            return lexer.getSource();
+        }
+
+    private:
+        static const size_t WINDOW = 4;  // Power of two
+        Lexer& lexer;
+        Token window[WINDOW];
+        size_t filled = 0;  // Number of tokens pulled from the lexer so far
+};
+
+
 /* ----------- AST ----------- */
 
 enum class ASTNodeType {
@@ -352,7 +1180,8 @@ enum class ASTNodeType {
     Function,
     Return,
     FunctionCall,
-    Def
+    Def,
+    UnaryOp
 };
 
 /* --- Forward declarations --- */
@@ -369,6 +1198,7 @@ class FunctionNode;
 class ReturnNode;
 class NodeVisitor;
 class FunctionCallNode;
+class UnaryOpNode;
 
 
 
@@ -386,12 +1216,12 @@ class NodeVisitor {
         virtual void visit(FunctionNode* node) = 0;
         virtual void visit(ReturnNode* node) = 0;
         virtual void visit(FunctionCallNode* node) = 0;
+        virtual void visit(UnaryOpNode* node) = 0;
 
 };
 
-class ASTNode { // Base class for ASTNode sub-types
+class ASTNode { // Base class for ASTNode sub-types. Allocated in an AstArena, never deleted.
     public:
-        virtual ~ASTNode() {}
         virtual void accept(NodeVisitor* visitor) = 0;
         virtual ASTNodeType getType() const = 0;
 
@@ -408,16 +1238,107 @@ class ASTNode { // Base class for ASTNode sub-types
                 case ASTNodeType::Function: return "FunctionNode";
                 case ASTNodeType::Return: return "ReturnNode";
                 case ASTNodeType::FunctionCall: return "FunctionCallNode";
+                case ASTNodeType::UnaryOp: return "UnaryOpNode";
                 default: return "UnknownNode";
             }
         }
 };
 
+/* --- Arena --- */
+// All nodes of one parse, and their child arrays, are bump-allocated out of an AstArena
+// and freed together when it goes away. Nodes own nothing (children are plain pointers
+// into the same arena, names are symbol ids, string literals are copied into the arena),
+// so no node destructor ever has to run.
+template <typename T>
+class ArenaArray { // Fixed-size array living in an AstArena
+    public:
+        ArenaArray() : items(nullptr), count(0) {}
+        ArenaArray(T* items, uint32_t count) : items(items), count(count) {}
+
+        T* begin() const { return items; }
+        T* end() const { return items + count; }
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+        T& operator[](size_t i) const { return items[i]; }
+
+    private:
+        T* items;
+        uint32_t count;
+};
+
+class AstArena {
+    public:
+        AstArena() {}
+        AstArena(const AstArena&) = delete;
+        AstArena& operator=(const AstArena&) = delete;
+
+        ~AstArena() {
+            for (char* chunk : chunks) delete[] chunk;
+        }
+
+        template <typename T, typename... Args>
+        T* make(Args&&... args) {
+            return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        }
+
+        template <typename T>
+        ArenaArray<T> copyArray(const T* items, size_t count) {
+            if (count == 0) return ArenaArray<T>();
+            T* copy = static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+            std::memcpy(copy, items, sizeof(T) * count);
+            return ArenaArray<T>(copy, static_cast<uint32_t>(count));
+        }
+
+        StringRef copyString(StringRef text) {
+            char* copy = static_cast<char*>(allocate(text.size + 1, 1));
+            std::memcpy(copy, text.data, text.size);
+            copy[text.size] = '\0';
+            return StringRef(copy, text.size);
+        }
+
+        size_t bytesUsed() const {
+            return used;
+        }
+
+        // Takes over everything allocated in other (e.g. by a parser on another thread);
+        // other is left empty
+        void adopt(AstArena& other) {
+            chunks.insert(chunks.end(), other.chunks.begin(), other.chunks.end());
+            used += other.used;
+            other.chunks.clear();
+            other.cursor = other.limit = nullptr;
+            other.used = 0;
+        }
+
+    private:
+        static const size_t CHUNK_SIZE = 64 * 1024;
+        std::vector<char*> chunks;
+        char* cursor = nullptr;
+        char* limit = nullptr;
+        size_t used = 0;
+
+        void* allocate(size_t size, size_t alignment) {
+            uintptr_t aligned = (reinterpret_cast<uintptr_t>(cursor) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+            if (!cursor || aligned + size > reinterpret_cast<uintptr_t>(limit)) {
+                size_t chunkSize = size + alignment > CHUNK_SIZE ? size + alignment : CHUNK_SIZE;
+                chunks.push_back(new char[chunkSize]);
+                cursor = chunks.back();
+                limit = cursor + chunkSize;
+                aligned = (reinterpret_cast<uintptr_t>(cursor) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+            }
+            cursor = reinterpret_cast<char*>(aligned + size);
+            used += size;
+            return reinterpret_cast<void*>(aligned);
+        }
+};
+
+typedef ArenaArray<ASTNode*> NodeList;
+
 class ReturnNode : public ASTNode {
     private:
-        std::unique_ptr<ASTNode> value;
+        ASTNode* value;
     public:
-        ReturnNode(std::unique_ptr<ASTNode> val) : value(std::move(val)) {}
+        ReturnNode(ASTNode* val) : value(val) {}
 
         void accept(NodeVisitor* visitor) override {
             visitor->visit(this);
@@ -428,7 +1349,7 @@ class ReturnNode : public ASTNode {
         }
 
         ASTNode* getValue() const {
-            return value.get();
+            return value;
         }
 
 };
@@ -456,9 +1377,9 @@ class IntNode : public ASTNode {
 
 class StringNode : public ASTNode {
     private:
-        std::string value;
+        StringRef value;  // Characters live in the arena
     public:
-        StringNode(const std::string& val) : value(val) {}
+        StringNode(StringRef val) : value(val) {}
 
         void accept(NodeVisitor* visitor) override {
             visitor->visit(this);
@@ -468,17 +1389,17 @@ class StringNode : public ASTNode {
             return ASTNodeType::String;
         }
 
-        const std::string& getValue() const {
+        StringRef getValue() const {
             return value;
         }
 };
 
 class IdentifierNode : public ASTNode {
     private:
-        std::string identifier;
+        SymbolId identifier;
 
     public:
-        IdentifierNode(const std::string& id) : identifier(id) {}
+        IdentifierNode(SymbolId id) : identifier(id) {}
 
         void accept(NodeVisitor* visitor) override {
             visitor->visit(this);
@@ -488,18 +1409,18 @@ class IdentifierNode : public ASTNode {
             return ASTNodeType::Identifier;
         }
 
-        const std::string& getIdentifier() const {
+        SymbolId getIdentifier() const {
             return identifier;
         }
 };
 
 class AssignNode : public ASTNode {
     private:
-        std::string identifier;
-        std::unique_ptr<ASTNode> value;
+        SymbolId identifier;
+        ASTNode* value;
 
     public:
-        AssignNode(std::string id, std::unique_ptr<ASTNode> val): identifier(std::move(id)), value(std::move(val)) {}
+        AssignNode(SymbolId id, ASTNode* val): identifier(id), value(val) {}
 
         void accept(NodeVisitor* visitor) override {
             visitor->visit(this);
@@ -509,21 +1430,21 @@ class AssignNode : public ASTNode {
             return ASTNodeType::Assign;
         }
 
-        const std::string& getIdentifier() const {
+        SymbolId getIdentifier() const {
             return identifier;
         }
 
         ASTNode* getValue() const { 
-            return value.get(); 
+            return value; 
         }
 };
 
 class PrintNode : public ASTNode {
     private:
-        std::vector<std::unique_ptr<ASTNode>> expressions;
+        NodeList expressions;
 
     public:
-        PrintNode(std::vector<std::unique_ptr<ASTNode>> exprs): expressions(std::move(exprs)) {}
+        PrintNode(NodeList exprs): expressions(exprs) {}
 
         void accept(NodeVisitor* visitor) override {
             visitor->visit(this);
@@ -533,7 +1454,7 @@ class PrintNode : public ASTNode {
             return ASTNodeType::Print;
         }
 
-        const std::vector<std::unique_ptr<ASTNode>>& getExpressions() const { 
+        const NodeList& getExpressions() const { 
             return expressions; 
         }
 
@@ -541,12 +1462,12 @@ class PrintNode : public ASTNode {
 
 class BinaryOpNode : public ASTNode {
     private:
-        std::unique_ptr<ASTNode> left;
-        std::unique_ptr<ASTNode> right;
+        ASTNode* left;
         char op;
+        ASTNode* right;
 
     public:
-        BinaryOpNode(std::unique_ptr<ASTNode> left, char op, std::unique_ptr<ASTNode> right): left(std::move(left)), op(op), right(std::move(right)) {}
+        BinaryOpNode(ASTNode* left, char op, ASTNode* right): left(left), op(op), right(right) {}
 
         void accept(NodeVisitor* visitor) override { 
             visitor->visit(this); 
@@ -556,11 +1477,11 @@ class BinaryOpNode : public ASTNode {
             return ASTNodeType::BinaryOp; 
         }
         
-        const std::unique_ptr<ASTNode>& getLeft() const {
+        ASTNode* getLeft() const {
             return left;
         }
         
-        const std::unique_ptr<ASTNode>& getRight() const {
+        ASTNode* getRight() const {
             return right;
         }
         
@@ -570,14 +1491,39 @@ class BinaryOpNode : public ASTNode {
 
 };
 
+class UnaryOpNode : public ASTNode {
+    private:
+        char op;  // '-' negate, '!' not
+        ASTNode* operand;
+
+    public:
+        UnaryOpNode(char op, ASTNode* operand) : op(op), operand(operand) {}
+
+        void accept(NodeVisitor* visitor) override {
+            visitor->visit(this);
+        }
+
+        ASTNodeType getType() const override {
+            return ASTNodeType::UnaryOp;
+        }
+
+        ASTNode* getOperand() const {
+            return operand;
+        }
+
+        char getOp() const {
+            return op;
+        }
+};
+
 class IfNode : public ASTNode {
     private:
-        std::unique_ptr<ASTNode> condition;
-        std::unique_ptr<BlockNode> thenBranch;  // Changed from vector to BlockNode
-        std::unique_ptr<BlockNode> elseBranch;  // Added elseBranch
+        ASTNode* condition;
+        BlockNode* thenBranch;
+        BlockNode* elseBranch;  // nullptr without an else
     public:
-        IfNode(std::unique_ptr<ASTNode> condition, std::unique_ptr<BlockNode> thenBranch, std::unique_ptr<BlockNode> elseBranch = nullptr)
-            : condition(std::move(condition)), thenBranch(std::move(thenBranch)), elseBranch(std::move(elseBranch)) {}
+        IfNode(ASTNode* condition, BlockNode* thenBranch, BlockNode* elseBranch = nullptr)
+            : condition(condition), thenBranch(thenBranch), elseBranch(elseBranch) {}
 
         void accept(NodeVisitor* visitor) override { 
             visitor->visit(this); 
@@ -587,15 +1533,15 @@ class IfNode : public ASTNode {
             return ASTNodeType::If; 
         }
 
-        const std::unique_ptr<ASTNode>& getCondition() const {
+        ASTNode* getCondition() const {
             return condition;
         }
 
-        const std::unique_ptr<BlockNode>& getThenBranch() const {
+        BlockNode* getThenBranch() const {
             return thenBranch;
         }
 
-        const std::unique_ptr<BlockNode>& getElseBranch() const {
+        BlockNode* getElseBranch() const {
             return elseBranch;
         }
         
@@ -605,9 +1551,9 @@ class IfNode : public ASTNode {
 
 class BlockNode : public ASTNode {
     private:
-        std::vector<std::unique_ptr<ASTNode>> statements;
+        NodeList statements;
     public:
-        BlockNode(std::vector<std::unique_ptr<ASTNode>> stmts) : statements(std::move(stmts)) {}
+        BlockNode(NodeList stmts) : statements(stmts) {}
 
         void accept(NodeVisitor* visitor) override {
             visitor->visit(this);
@@ -617,20 +1563,20 @@ class BlockNode : public ASTNode {
             return ASTNodeType::Block;
         }
 
-        const std::vector<std::unique_ptr<ASTNode>>& getStatements() const {
+        const NodeList& getStatements() const {
             return statements;
         }
 };
 
 class FunctionNode : public ASTNode {
     private:
-        std::string name;
-        std::vector<std::string> parameters;
-        std::unique_ptr<BlockNode> body;
+        SymbolId name;
+        ArenaArray<SymbolId> parameters;
+        BlockNode* body;
 
     public:
-        FunctionNode(const std::string& name, const std::vector<std::string>& parameters, std::unique_ptr<BlockNode> body)
-            : name(name), parameters(parameters), body(std::move(body)) {}
+        FunctionNode(SymbolId name, ArenaArray<SymbolId> parameters, BlockNode* body)
+            : name(name), parameters(parameters), body(body) {}
 
         void accept(NodeVisitor* visitor) override {
             visitor->visit(this);
@@ -640,27 +1586,45 @@ class FunctionNode : public ASTNode {
             return ASTNodeType::Function;
         }
 
-        const std::string& getName() const {
+        SymbolId getName() const {
             return name;
         }
 
-        const std::vector<std::string>& getParameters() const {
+        const ArenaArray<SymbolId>& getParameters() const {
             return parameters;
         }
 
         BlockNode* getBody() const {
-            return body.get();
+            return body;
         }
 };
 
+/* --- Call-site caches --- */
+// Each engine keeps a definition epoch that moves on every executed def. A call site
+// remembers the function it last resolved to (arity already checked) and the epoch it
+// resolved in; while no def has run since, a call costs a compare instead of a probe.
+template <typename Target>
+struct CallSiteCache {
+    uint32_t epoch = 0;  // 0: never resolved
+    Target target = Target();
+};
+
+// Epochs from one process-wide counter, so an AST shared by several interpreters (as in
+// --bench-engines) never mistakes another interpreter's cache entry for its own
+uint32_t newDefinitionEpoch() {
+    static uint32_t last = 0;
+    return ++last;
+}
+
 class FunctionCallNode : public ASTNode {
     private:
-        std::string name;
-        std::vector<std::unique_ptr<ASTNode>> arguments;
+        SymbolId name;
+        NodeList arguments;
+        CallSiteCache<FunctionNode*> callCache;
 
     public:
-        FunctionCallNode(const std::string& name, std::vector<std::unique_ptr<ASTNode>> arguments)
-            : name(name), arguments(std::move(arguments)) {}
+        FunctionCallNode(SymbolId name, NodeList arguments)
+            : name(name), arguments(arguments) {}
 
         void accept(NodeVisitor* visitor) override {
             visitor->visit(this);
@@ -670,84 +1634,139 @@ class FunctionCallNode : public ASTNode {
             return ASTNodeType::FunctionCall;
         }
 
-        const std::string& getName() const {
+        SymbolId getName() const {
             return name;
         }
 
-        const std::vector<std::unique_ptr<ASTNode>>& getArguments() const {
+        const NodeList& getArguments() const {
             return arguments;
         }
+
+        CallSiteCache<FunctionNode*>& getCallCache() {
+            return callCache;
+        }
 };
 
 /* ----------- PARSER ----------- */
+/* --- Operator table --- */
+// Expressions are parsed by precedence climbing over this table. A new operator is one
+// entry here (plus its case in the interpreter), not another recursion level.
+struct OperatorRule {
+    TokenType token;
+    uint8_t leftPower;   // How tightly it binds to the operand on its left; 0 = not an operator
+    uint8_t rightPower;  // Minimum power for the operand on its right (< leftPower: right-associative)
+    char op;             // Code stored in BinaryOpNode / UnaryOpNode
+};
+
+constexpr OperatorRule INFIX_OPERATORS[] = {
+    {TokenType::OR, 10, 11, '|'},
+    {TokenType::AND, 20, 21, '&'},
+    {TokenType::EQUAL_EQUAL, 40, 41, 'E'},
+    {TokenType::BANG_EQUAL, 40, 41, 'N'},
+    {TokenType::LESS, 50, 51, '<'},
+    {TokenType::LESS_EQUAL, 50, 51, 'L'},
+    {TokenType::GREATER, 50, 51, '>'},
+    {TokenType::GREATER_EQUAL, 50, 51, 'G'},
+    {TokenType::PLUS, 60, 61, '+'},
+    {TokenType::MINUS, 60, 61, '-'},
+    {TokenType::MULTIPLY, 70, 71, '*'},
+    {TokenType::DIVIDE, 70, 71, '/'},
+    {TokenType::FLOOR_DIVIDE, 70, 71, 'F'},
+    {TokenType::MODULUS, 70, 71, '%'},
+    {TokenType::POWER, 90, 89, '^'},  // Right-associative, and binds tighter than unary minus on its left
+};
+
+constexpr OperatorRule PREFIX_OPERATORS[] = {
+    {TokenType::NOT, 0, 30, '!'},
+    {TokenType::MINUS, 0, 80, '-'},
+};
+
+struct OperatorTable {
+    OperatorRule rules[static_cast<size_t>(TokenType::COUNT)];
+
+    const OperatorRule& operator[](TokenType type) const {
+        return rules[static_cast<size_t>(type)];
+    }
+};
+
+template <size_t N>
+constexpr OperatorTable buildOperatorTable(const OperatorRule (&entries)[N]) {
+    OperatorTable table{};
+    for (size_t i = 0; i < static_cast<size_t>(TokenType::COUNT); ++i) {
+        table.rules[i] = OperatorRule{static_cast<TokenType>(i), 0, 0, 0};
+    }
+    for (size_t i = 0; i < N; ++i) {
+        table.rules[static_cast<size_t>(entries[i].token)] = entries[i];
+    }
+    return table;
+}
+
+constexpr OperatorTable INFIX_TABLE = buildOperatorTable(INFIX_OPERATORS);
+constexpr OperatorTable PREFIX_TABLE = buildOperatorTable(PREFIX_OPERATORS);
+
 class Parser {
-        std::vector<Token> tokens;
+        TokenStream tokens;
+        const char* source;  // Buffer the tokens point into
         size_t current = 0;  // Current token being processed
+        AstArena& arena;     // Every node we build lives here
+        std::vector<ASTNode*> scratch;    // Children of the lists being parsed, innermost list last
+        std::vector<SymbolId> paramScratch;
 
     public:
-        Parser(const std::vector<Token>& tokens) : tokens(tokens) {}
+        Parser(Lexer& lexer, AstArena& arena) : tokens(lexer), source(lexer.getSource()), arena(arena) {}
 
-        std::vector<std::unique_ptr<ASTNode>> parse() {
-            std::vector<std::unique_ptr<ASTNode>> statements;
+        NodeList parse() {
+            size_t mark = scratch.size();
 
             while (!isAtEnd()) {
                 if (match(TokenType::NEWLINE) || match(TokenType::DEDENT)) {  // Skip newlines and dedents
                     continue;
                 }
 
-                std::unique_ptr<ASTNode> stmt = parseStatement();
+                ASTNode* stmt = parseStatement();
                 if (stmt) {
-                    statements.push_back(std::move(stmt));
+                    scratch.push_back(stmt);
                 }
             }
 
-            return statements;
+            return finishList(mark);
         }
 
     private:
-        std::unique_ptr<ASTNode> parseStatement() { // Handles statements with identifiers
-            std::cout << "Entering parseStatement: Current Token = " << peek().tokenTypeToString() << ", Lexeme = '" << peek().lexeme << "'" << std::endl; //debugging
+        ASTNode* parseStatement() { // Handles statements with identifiers
+            TRACE(Parser, Debug, EnterRule, ParseRule::Statement, peek().type);
 
             if (match(TokenType::IF)) {
-                std::cout << "Parsing IF statement" << std::endl; //debugging
                 return parseIfStatement();
 
             } else if (match(TokenType::PRINT)) {
-                std::cout << "Parsing PRINT statement" << std::endl; //debugging
                 return parsePrintStatement();
 
             } else if (peek().type == TokenType::IDENTIFIER && peekNext().type == TokenType::ASSIGN) {
-                std::cout << "Parsing ASSIGNMENT statement" << std::endl; //debugging
                 return parseAssignStatement();
 
             } else if (match(TokenType::DEF)) {
-                std::cout << "Parsing FUNCTION DEFINITION" << std::endl; //debugging
                 return parseFunctionDefinition();
 
             } else if (peek().type == TokenType::RETURN) {
-                std::cout << "Ready to parse RETURN statement, current token: " << peek().tokenTypeToString() << std::endl; //debugging
-                std::cout << "Parsing RETURN statement" << std::endl; //debugging
                 return parseReturnStatement();
             }
-            
-            
-            throw std::runtime_error("Unexpected token in parseStatement(): " + peek().tokenTypeToString());
+
+            return parseExpressionStatement();
 
         }
   
-        std::unique_ptr<IfNode> parseIfStatement() {
-            std::cout << "Entering parseIfStatement: Current Token = " << peek().tokenTypeToString() << ", Lexeme = '" << peek().lexeme << "'" << std::endl; //debugging
+        IfNode* parseIfStatement() {
+            TRACE(Parser, Debug, EnterRule, ParseRule::If, peek().type);
             auto condition = parseExpression();  // Parse the condition
             consume(TokenType::COLON, "Expect ':' after if condition.");
             
             consume(TokenType::NEWLINE, "Expect newline after colon.");
-            std::cout << "Consuming Token: " << peek().tokenTypeToString() << ", Lexeme = '" << peek().lexeme << "'" << std::endl; //debugging
             consume(TokenType::INDENT, "Expected indent at the start of block");
-            std::cout << "Consuming Token: " << peek().tokenTypeToString() << ", Lexeme = '" << peek().lexeme << "'" << std::endl; //debugging
 
             auto thenBranch = parseBlock();
             
-            std::unique_ptr<BlockNode> elseBranch = nullptr; // Initialize elsebranch
+            BlockNode* elseBranch = nullptr; // Initialize elsebranch
             consume(TokenType::DEDENT, "Expect dedent after if block.");
 
             if (match(TokenType::ELSE)) {
@@ -759,42 +1778,44 @@ class Parser {
             }
 
 
-            return std::make_unique<IfNode>(std::move(condition), std::move(thenBranch), std::move(elseBranch));
+            return arena.make<IfNode>(condition, thenBranch, elseBranch);
         }
 
-        std::unique_ptr<BlockNode> parseBlock() {
-            std::cout << "Entering parseBlock: Current Token = " << peek().tokenTypeToString() << ", Lexeme = '" << peek().lexeme << "'" << std::endl; //debugging
-            std::vector<std::unique_ptr<ASTNode>> blockStatements;
+        BlockNode* parseBlock() {
+            TRACE(Parser, Debug, EnterRule, ParseRule::Block, peek().type);
+            size_t mark = scratch.size();
 
             while (!check(TokenType::DEDENT) && !isAtEnd()) {
                 if (match(TokenType::NEWLINE)) {  // Skip empty lines within the block
                     continue;
                 }
-                blockStatements.push_back(parseStatement());
+                ASTNode* stmt = parseStatement();
+                scratch.push_back(stmt);
             }
 
-            return std::make_unique<BlockNode>(std::move(blockStatements));
+            return arena.make<BlockNode>(finishList(mark));
         }
 
-        std::unique_ptr<ASTNode> parseAssignStatement() {
-            std::cout << "Entering parseAssignStatement: Current Token = " << peek().tokenTypeToString() << ", Lexeme = '" << peek().lexeme << "'" << std::endl; //debugging
-            std::string identifier = consume(TokenType::IDENTIFIER, "Expect identifier.").lexeme;
+        ASTNode* parseAssignStatement() {
+            TRACE(Parser, Debug, EnterRule, ParseRule::Assign, peek().type);
+            SymbolId identifier = consume(TokenType::IDENTIFIER, "Expect identifier.").symbol;
             consume(TokenType::ASSIGN, "Expect '=' after identifier.");
             auto value = parseExpression();
             consume(TokenType::NEWLINE, "parseAssign: Expect newline after expression."); 
-            return std::make_unique<AssignNode>(identifier, std::move(value));
+            return arena.make<AssignNode>(identifier, value);
         }
 
-        std::unique_ptr<ASTNode> parsePrintStatement() {
-            std::cout << "Entering parsePrintStatement: Current Token = " << peek().tokenTypeToString() << ", Lexeme = '" << peek().lexeme << "'" << std::endl; //debugging
+        ASTNode* parsePrintStatement() {
+            TRACE(Parser, Debug, EnterRule, ParseRule::Print, peek().type);
             consume(TokenType::LEFT_PAREN, "Expect '(' after 'print'.");
 
-            std::vector<std::unique_ptr<ASTNode>> expressions;
+            size_t mark = scratch.size();
 
             if (!check(TokenType::RIGHT_PAREN)) {
 
                 do {
-                    expressions.push_back(parseExpression());
+                    ASTNode* expr = parseExpression();
+                    scratch.push_back(expr);
                 } while (match(TokenType::COMMA));
 
             }
@@ -805,38 +1826,34 @@ class Parser {
                 consume(TokenType::NEWLINE, "Expect newline after print statement."); 
             }
             
-            return std::make_unique<PrintNode>(std::move(expressions));
+            return arena.make<PrintNode>(finishList(mark));
 
         }
 
-        std::unique_ptr<ASTNode> parseReturnStatement() {
-            std::cout << "Entering parseReturnStatement: Current Token = " << peek().tokenTypeToString() << ", Lexeme = '" << peek().lexeme << "'" << std::endl; //debugging
-            std::cout << "Current token before expecting 'return': " << peek().tokenTypeToString() << std::endl;
+        ASTNode* parseReturnStatement() {
+            TRACE(Parser, Debug, EnterRule, ParseRule::Return, peek().type);
             consume(TokenType::RETURN, "Expect 'return' keyword.");
-            std::cout << "Token after consuming 'return': " << peek().tokenTypeToString() << std::endl;
             auto value = parseExpression();
-            std::cout << "Parsed return expression, next Token should be: " << peek().tokenTypeToString() << std::endl; //debugging
             consume(TokenType::NEWLINE, "Expect newline after return statement.");
-            std::cout << "parseReturnStatement: Successfully parsed return statement" << std::endl; //debugging
-            return std::make_unique<ReturnNode>(std::move(value)); 
+            return arena.make<ReturnNode>(value); 
 }
 
 
-        std::unique_ptr<FunctionNode> parseFunctionDefinition() {
-            std::cout << "Entering parseFunctionDefinition: Current Token = " << peek().tokenTypeToString() << ", Lexeme = '" << peek().lexeme << "'" << std::endl; //debugging
+        FunctionNode* parseFunctionDefinition() {
+            TRACE(Parser, Debug, EnterRule, ParseRule::Function, peek().type);
             if (peek().type != TokenType::IDENTIFIER) {
                 throw std::runtime_error("Expect function name. Found: " + peek().tokenTypeToString());
 }
-            std::string functionName = consume(TokenType::IDENTIFIER, "Expect function name.").lexeme;
-            std::cout << "Function name: " << functionName << std::endl; // More detailed debugging
+            SymbolId functionName = consume(TokenType::IDENTIFIER, "Expect function name.").symbol;
             consume(TokenType::LEFT_PAREN, "Expect '(' after function name.");
 
-            std::vector<std::string> parameters;
+            paramScratch.clear();
 
             while (!check(TokenType::RIGHT_PAREN)) {
-                parameters.push_back(consume(TokenType::IDENTIFIER, "Expect parameter name.").lexeme);
+                paramScratch.push_back(consume(TokenType::IDENTIFIER, "Expect parameter name.").symbol);
                 if (!match(TokenType::COMMA)) break;
 }
+            ArenaArray<SymbolId> parameters = arena.copyArray(paramScratch.data(), paramScratch.size());
 
             consume(TokenType::RIGHT_PAREN, "Expect ')' after parameters.");
             consume(TokenType::COLON, "Expect ':' after function parameters.");
@@ -845,104 +1862,86 @@ class Parser {
             auto body = parseBlock();
             consume(TokenType::DEDENT, "Expect dedent after function body.");
 
-            std::cout << "Finished parsing function: " << functionName << std::endl; //debugging
-            return std::make_unique<FunctionNode>(functionName, parameters, std::move(body));
+            return arena.make<FunctionNode>(functionName, parameters, body);
 
         }
 
-        std::unique_ptr<ASTNode> parseFunctionCall() {
-            std::string funcName = previous().lexeme;
-            std::cout << "Parsing function call for function: " << funcName << std::endl; // Debugging
+        ASTNode* parseFunctionCall() {
+            SymbolId funcName = previous().symbol;
+            TRACE(Parser, Debug, EnterRule, ParseRule::Call, peek().type);
             consume(TokenType::LEFT_PAREN, "Expect '(' after function name.");
-            std::vector<std::unique_ptr<ASTNode>> arguments;
+            size_t mark = scratch.size();
             if (!check(TokenType::RIGHT_PAREN)) {
                 do {
-                    arguments.push_back(parseExpression());
+                    ASTNode* arg = parseExpression();
+                    scratch.push_back(arg);
                 } while (match(TokenType::COMMA));
             }
             consume(TokenType::RIGHT_PAREN, "Expect ')' after arguments.");
-            std::cout << "Finished parsing function call for function: " << funcName << std::endl; // Debugging
-            return std::make_unique<FunctionCallNode>(funcName, std::move(arguments));
-        }
-
-        std::unique_ptr<ASTNode> parseExpression() {
-            std::cout << "Entering parseExpression: Current Token = " << peek().tokenTypeToString() << ", Lexeme = '" << peek().lexeme << "'" << std::endl; //debugging
-            return parseEquality();
+            return arena.make<FunctionCallNode>(funcName, finishList(mark));
         }
 
-        std::unique_ptr<ASTNode> parseEquality() {
-            std::cout << "Entering parseEquality: Current Token = " << peek().tokenTypeToString() << ", Lexeme = '" << peek().lexeme << "'" << std::endl; //debugging
-            std::unique_ptr<ASTNode> expr = parseComparison();
-
-            while (match(TokenType::EQUAL_EQUAL) || match(TokenType::BANG_EQUAL) ) {
-                char op = previous().lexeme[0];  // Get operator from the token just consumed
-                std::unique_ptr<ASTNode> right = parseComparison();
-                expr = std::make_unique<BinaryOpNode>(std::move(expr), op, std::move(right));
+        // A bare expression used as a statement, e.g. a call whose result is discarded
+        ASTNode* parseExpressionStatement() {
+            if (!startsExpression(peek().type)) {
+                throw std::runtime_error("Unexpected token in parseStatement(): " + peek().tokenTypeToString());
             }
 
-            return expr;
-        }
-
-        std::unique_ptr<ASTNode> parseComparison() {
-            std::cout << "Entering parseComparison: Current Token = " << peek().tokenTypeToString() << ", Lexeme = '" << peek().lexeme << "'" << std::endl; //debugging
-            std::unique_ptr<ASTNode> expr = parseAddition();
-
-            while (match(TokenType::GREATER) || match(TokenType::LESS) ||match(TokenType::GREATER_EQUAL) || match(TokenType::LESS_EQUAL)) {
-                char op = previous().lexeme[0];
-                auto right = parseAddition();
-                expr = std::make_unique<BinaryOpNode>(std::move(expr), op, std::move(right));
+            auto expr = parseExpression();
+            if (!check(TokenType::DEDENT) && !isAtEnd()) {
+                consume(TokenType::NEWLINE, "Expect newline after expression.");
             }
-
             return expr;
         }
 
-        std::unique_ptr<ASTNode> parseAddition() { // For ADD & SUB
-            std::cout << "Entering parseAddition: Current Token = " << peek().tokenTypeToString() << ", Lexeme = '" << peek().lexeme << "'" << std::endl; //debugging
-            auto expr = parseMultiplication(); // Calls parseMultiplication first b/c MUL & DIV are higher precedence
-            std::cout << "Parsed expression, next Token should be: " << peekNext().tokenTypeToString() << std::endl; //debugging
+        // Precedence climbing: keep folding infix operators that bind tighter than minPower
+        ASTNode* parseExpression(uint8_t minPower = 0) {
+            TRACE(Parser, Debug, EnterRule, ParseRule::Expression, peek().type);
+            ASTNode* expr = parsePrefix();
 
-            while (match(TokenType::PLUS) || match(TokenType::MINUS)) {
-                char op = previous().lexeme[0];
-                auto right = parseMultiplication();
+            for (;;) {
+                const OperatorRule& rule = INFIX_TABLE[peek().type];
+                if (rule.leftPower <= minPower) break;  // Also stops at anything that isn't an operator
 
-                expr = std::make_unique<BinaryOpNode>(std::move(expr), op, std::move(right));
+                advance();
+                ASTNode* right = parseExpression(rule.rightPower);
+                expr = arena.make<BinaryOpNode>(expr, rule.op, right);
             }
 
             return expr;
         }
 
-        std::unique_ptr<ASTNode> parseMultiplication() { // For MUL & DIV
-            std::cout << "Entering parseMultiplication: Current Token = " << peek().tokenTypeToString() << ", Lexeme = '" << peek().lexeme << "'" << std::endl; //debugging
-            auto expr = parsePrimary();
-            std::cout << "Parsed expression, next Token should be: " << peekNext().tokenTypeToString() << std::endl; //debugging
+        ASTNode* parsePrefix() {
+            TRACE(Parser, Debug, EnterRule, ParseRule::Prefix, peek().type);
+            const OperatorRule& rule = PREFIX_TABLE[peek().type];
 
-            while (match(TokenType::MULTIPLY) || match(TokenType::DIVIDE) || match(TokenType::MODULUS)) {
-                char op = previous().lexeme[0];
-                auto right = parsePrimary();
-
-                expr = std::make_unique<BinaryOpNode>(std::move(expr), op, std::move(right));
-            }
-
-            return expr;
-        }
+            if (rule.rightPower != 0) {
+                advance();
+                return arena.make<UnaryOpNode>(rule.op, parseExpression(rule.rightPower));
 
-        std::unique_ptr<ASTNode> parsePrimary() {
-            std::cout << "Entering parsePrimary: Current Token = " << peek().tokenTypeToString() << ", Lexeme = '" << peek().lexeme << "'" << std::endl; //debugging
-            if (match(TokenType::NUMBER)) {
-                return std::make_unique<IntNode>(std::stoi(previous().lexeme));
+            } else if (match(TokenType::NUMBER)) {
+                return arena.make<IntNode>(parseInt(text(previous())));
 
             } else if (match(TokenType::IDENTIFIER)) {
                 if(check(TokenType::LEFT_PAREN)) {
                     return parseFunctionCall();
                 }
-                return std::make_unique<IdentifierNode>(previous().lexeme);
+                return arena.make<IdentifierNode>(previous().symbol);
 
             } else if (match(TokenType::STRING)) {
-                return std::make_unique<StringNode>(previous().lexeme);
+                return arena.make<StringNode>(arena.copyString(text(previous())));
+
+            } else if (match(TokenType::TRUE)) {
+                return arena.make<IntNode>(1);
+
+            } else if (match(TokenType::FALSE) || match(TokenType::NONE)) {
+                return arena.make<IntNode>(0);
+
+            } else if (match(TokenType::LEFT_PAREN)) {
+                auto expr = parseExpression();
+                consume(TokenType::RIGHT_PAREN, "Expect ')' after expression.");
+                return expr;
             }
-              else if (match(TokenType::RETURN)) {
-                return parseReturnStatement();
-              }
 
             throw std::runtime_error("Unexpected token in parsePrimary.");
         }
@@ -955,7 +1954,7 @@ class Parser {
             return false;
         }
 
-        Token consume(TokenType type, const std::string& message) {
+        const Token& consume(TokenType type, const std::string& message) {
             if (!check(type)) {
                 std::string error_message = message + " - Found: " + peek().tokenTypeToString();
             
@@ -970,9 +1969,10 @@ class Parser {
             return peek().type == type;
         }
 
-        Token advance() {
+        // The returned reference stays valid until a few more tokens are pulled (TokenStream window)
+        const Token& advance() {
             if (!isAtEnd()) current++;
-            std::cout << "Advancing to: " << peek().tokenTypeToString() << ", Lexeme = '" << peek().lexeme << "'" << std::endl; //debugging
+            TRACE(Parser, Verbose, Advance, peek().type, peek().line);
     
             return previous();
         }
@@ -981,545 +1981,6030 @@ class Parser {
             return peek().type == TokenType::END_OF_FILE;
         }
 
-        Token peek() {
-            return tokens[current];
+        const Token& peek() {
+            return tokens.at(current);
         }
 
-        Token peekNext() {
-            if (current + 1 >= tokens.size()) return tokens.back();
-            return tokens[current + 1];
+        const Token& peekNext() {
+            return tokens.at(current + 1);  // The lexer repeats END_OF_FILE past the end
         }
 
-        Token previous() {
-            return tokens[current - 1];
+        const Token& previous() {
+            return tokens.at(current - 1);
+        }
+
+        // Copy the children pushed since `mark` into the arena and pop them off the scratch stack
+        NodeList finishList(size_t mark) {
+            NodeList list = arena.copyArray(scratch.data() + mark, scratch.size() - mark);
+            scratch.resize(mark);
+            return list;
         }
-};
 
+        StringRef text(const Token& token) const {
+            return token.lexeme(source);
+        }
 
-/* ----------- SCOPE ----------- */
-class Scope {
-    private:
-        std::unordered_map<std::string, int> variables;
-        std::shared_ptr<Scope> parent;
-        int returnValue;
+        static bool startsExpression(TokenType type) {
+            switch (type) {
+                case TokenType::IDENTIFIER: case TokenType::NUMBER: case TokenType::STRING:
+                case TokenType::LEFT_PAREN: case TokenType::TRUE: case TokenType::FALSE: case TokenType::NONE:
+                    return true;
+                default:
+                    return PREFIX_TABLE[type].rightPower != 0;
+            }
+        }
+
+        static int parseInt(StringRef digits) {
+            long long value = 0;
+            for (size_t i = 0; i < digits.size; ++i) {
+                value = value * 10 + (digits[i] - '0');
+                if (value > INT_MAX) throw std::runtime_error("Integer literal out of range: " + digits.str());
+            }
+            return static_cast<int>(value);
+        }
+};
 
+
+/* --- Parallel front end --- */
+// A line that starts in column 0 resets the lexer to a known state: indent stack [0], no
+// open block. So the source can be cut at such lines and every piece lexed and parsed on
+// its own, on a worker thread, into its own arena. The pieces are concatenated in source
+// order afterwards, which gives the same statement list as one Parser over the whole file.
+class ParallelParser {
     public:
-        Scope(std::shared_ptr<Scope> parent = nullptr) : parent(parent) {}
+        static const size_t MIN_CHUNK = 64 * 1024;  // Below this a thread costs more than it saves
+
+        ParallelParser(const char* source, size_t length, AstArena& arena, unsigned jobs)
+            : source(source), length(length), arena(arena), jobs(jobs ? jobs : 1) {}
+
+        NodeList parse() {
+            std::vector<Chunk> chunks = split();
+            if (chunks.size() == 1) {
+                Lexer lexer(source, length);
+                return Parser(lexer, arena).parse();
+            }
+
+            std::vector<Result> results(chunks.size());
+            std::atomic<size_t> nextChunk(0);
+            auto worker = [&]() {
+                for (size_t i; (i = nextChunk++) < chunks.size(); ) {
+                    Result& result = results[i];
+                    try {
+                        Lexer lexer(source, chunks[i].begin, chunks[i].end, chunks[i].line);
+                        result.statements = Parser(lexer, result.arena).parse();
+                    } catch (...) {
+                        result.error = true;
+                    }
+                }
+            };
+
+            std::vector<std::thread> pool;
+            size_t threads = std::min<size_t>(jobs, chunks.size());
+            for (size_t t = 1; t < threads; ++t) pool.emplace_back(worker);
+            worker();  // This thread works too
+            for (std::thread& thread : pool) thread.join();
+
+            // Stitch the pieces together. From the first piece that failed on, parse serially
+            // instead: that throws exactly what a whole-file parse would, and it also covers
+            // a piece that only failed because it was cut off from what follows it.
+            std::vector<ASTNode*> program;
+            for (size_t i = 0; i < chunks.size(); ++i) {
+                if (results[i].error) {
+                    Lexer lexer(source, chunks[i].begin, length, chunks[i].line);
+                    NodeList rest = Parser(lexer, arena).parse();
+                    program.insert(program.end(), rest.begin(), rest.end());
+                    break;
+                }
+                program.insert(program.end(), results[i].statements.begin(), results[i].statements.end());
+                arena.adopt(results[i].arena);
+            }
+            TRACE(Parser, Info, ParallelChunks, chunks.size(), threads);
+            return arena.copyArray(program.data(), program.size());
+        }
 
-        void setReturnValue(int value) {
-            returnValue = value;
+    private:
+        struct Chunk {
+            size_t begin, end, line;
+        };
+
+        struct Result {
+            AstArena arena;
+            NodeList statements;
+            bool error = false;
+        };
+
+        const char* source;
+        size_t length;
+        AstArena& arena;
+        unsigned jobs;
+
+        // Cuts at column-0 lines about every length / (4 * jobs) bytes. Walks the text the way
+        // the lexer does (strings run to the matching quote, newlines inside them don't count
+        // as lines, comments run to the end of the line) so a cut never lands inside a token.
+        std::vector<Chunk> split() const {
+            std::vector<Chunk> chunks{Chunk{0, length, 1}};
+            if (jobs == 1 || length < 2 * MIN_CHUNK) return chunks;
+
+            size_t target = length / (4 * jobs);
+            if (target < MIN_CHUNK) target = MIN_CHUNK;
+            size_t line = 1;
+            for (size_t i = 0; i < length; ) {
+                char c = source[i];
+                if (c == '"' || c == '\'') {
+                    const char* close = static_cast<const char*>(std::memchr(source + i + 1, c, length - i - 1));
+                    if (!close) break;  // Unterminated: leave the rest to one parser, which reports it
+                    i = close - source + 1;
+                } else if (c == '#') {
+                    const char* newline = static_cast<const char*>(std::memchr(source + i, '\n', length - i));
+                    i = newline ? newline - source : length;
+                } else if (c == '\n') {
+                    line++;
+                    i++;
+                    if (i - chunks.back().begin >= target && startsTopLevelStatement(i)) {
+                        chunks.back().end = i;
+                        chunks.push_back(Chunk{i, length, line});
+                    }
+                } else {
+                    i++;
+                }
+            }
+            return chunks;
         }
-        int getReturnValue() const {
-            if (parent && returnValue == 0) {
-                return parent->getReturnValue();
+
+        // Something other than blank space, a comment or an `else` (which belongs to the if above it)
+        bool startsTopLevelStatement(size_t at) const {
+            if (at >= length) return false;
+            char c = source[at];
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '#') return false;
+            if (length - at >= 4 && std::memcmp(source + at, "else", 4) == 0) {
+                return at + 4 < length && (std::isalnum(static_cast<unsigned char>(source[at + 4])) || source[at + 4] == '_');
+            }
+            return true;
         }
-            return returnValue;
+};
+
+
+/* ----------- SCOPE ----------- */
+// Deepest call nesting before a RecursionError. The tree, flat and closure engines recurse
+// on the C++ stack for every Python call, so they stop well short of an 8 MB stack. The VM
+// keeps its frames on the heap instead and has no depth limit of its own, only a cap on
+// the memory its call stack may take (--max-stack); --max-depth still applies if given.
+const size_t DEFAULT_MAX_DEPTH = 10000;
+const size_t UNLIMITED_DEPTH = SIZE_MAX;
+const size_t DEFAULT_VM_STACK_MB = 512;
+
+void throwRecursionError(const std::string& detail = std::string()) {
+    throw std::runtime_error("RecursionError: maximum recursion depth exceeded" + detail);
+}
+
+// A call is in tail position when its caller has nothing left to do afterwards: it is the
+// value of a `return` inside a function, or an expression statement that is the last thing
+// its function runs (the body's last statement, or the last one of an `if` branch that is
+// itself last). Every engine runs those in the caller's frame instead of a new one, so
+// accumulator-style recursion needs constant stack and frame memory. A tail call made
+// as a statement still makes the caller return None, whatever the callee returns.
+
+// What --stats reports once the script has run
+struct CallStats {
+    uint64_t calls = 0;      // Python-level calls, tail calls included
+    uint64_t tailCalls = 0;  // Calls that reused their caller's frame
+    size_t maxDepth = 0;     // Most frames live at once
+    size_t stackBytes = 0;   // Call stack memory in use at maxDepth (VM only)
+
+    // True when this call is the deepest yet
+    bool enter(size_t depth) {
+        calls++;
+        if (depth <= maxDepth) return false;
+        maxDepth = depth;
+        return true;
     }
 
-        void setVariable(const std::string& name, int value) {
-            variables[name] = value;
-            //std::cout << "Variable Set - " << name << ": " << value << std::endl; //debugging
+    void print(std::ostream& out) const {
+        out << "calls: " << calls << ", tail calls: " << tailCalls << ", max depth: " << maxDepth;
+        if (stackBytes && maxDepth) {
+            out << ", stack at max depth: " << stackBytes << " bytes (" << stackBytes / maxDepth << " per frame)";
         }
+        out << std::endl;
+    }
+};
+
+// Variables of the tree and flat walkers. Each running call's variables are a frame: a run
+// of name/value pairs in one contiguous buffer that is pushed on call and popped on return.
+// The buffers are reused, so steady-state recursion never allocates. A name not in the
+// current frame is a global (Python's local/global rule); top-level code has no frame.
+class FrameStack {
+    public:
+        explicit FrameStack(size_t maxDepth = DEFAULT_MAX_DEPTH) : maxDepth(maxDepth) {}
 
-        int getVariable(const std::string& name) {
-            if (variables.find(name) != variables.end()) {
-             //   std::cout << "Variable Get - " << name << ": " << variables[name] << std::endl; //debugging
-                return variables[name];
-            } else if (parent != nullptr) {
-                return parent->getVariable(name);
+        void setVariable(SymbolId name, int value) {
+            if (frameStarts.empty()) {
+                globals.set(name, value);
+                return;
+            }
+            if (Binding* binding = findLocal(name)) {
+                binding->value = value;
             } else {
-                throw std::runtime_error("Variable not defined: " + name);
+                bindings.push_back(Binding{name, value});
             }
         }
 
-        std::shared_ptr<Scope> getParent() const {
-            return parent;
+        int getVariable(SymbolId name) {
+            if (!frameStarts.empty()) {
+                if (const Binding* binding = findLocal(name)) return binding->value;
+            }
+            if (const int* value = globals.find(name)) return *value;
+            throw std::runtime_error("Variable not defined: " + symbolName(name));
         }
 
-        bool isDefinedLocally(const std::string& name) {
-            return variables.find(name) != variables.end();
+        // Arguments are evaluated in the caller, before the callee's frame exists, so
+        // they wait here. Nested calls in an argument stage and take theirs above ours.
+        size_t argumentMark() const {
+            return staged.size();
         }
-};
 
-/* ----------- INTERPRETER ----------- */
+        void stageArgument(int value) {
+            staged.push_back(value);
+        }
 
-class Interpreter : public NodeVisitor {
-    private:
-        std::shared_ptr<Scope> currentScope;
-        std::unordered_map<std::string, FunctionNode*> functions;  // Holds function definitions
+        const int* stagedArguments(size_t mark) const {
+            return staged.data() + mark;
+        }
 
+        // Drops arguments staged for a call that won't happen after all (a memo hit)
+        void unstage(size_t mark) {
+            staged.resize(mark);
+        }
 
-    public:
-        Interpreter() : currentScope(std::make_shared<Scope>()) {}
+        // Opens a frame binding params[i] to the i-th argument staged since `mark`
+        void pushFrame(size_t mark, const SymbolId* params, size_t count) {
+            if (frameStarts.size() >= maxDepth) throwRecursionError();
+            frameStarts.push_back(bindings.size());
+            for (size_t i = 0; i < count; ++i) setVariable(params[i], staged[mark + i]);
+            staged.resize(mark);
+        }
 
-        void interpret(ASTNode* root) {
-            root->accept(this);  // Start interpretation from the root node
+        void popFrame() {
+            bindings.resize(frameStarts.back());
+            frameStarts.pop_back();
         }
 
-        void visit(IntNode* node) override {}
+        // Tail call: the current frame is done, so the callee's takes its place
+        void replaceFrame(size_t mark, const SymbolId* params, size_t count) {
+            bindings.resize(frameStarts.back());
+            for (size_t i = 0; i < count; ++i) setVariable(params[i], staged[mark + i]);
+            staged.resize(mark);
+        }
 
-        void visit(StringNode* node) override {}
+        size_t depth() const {
+            return frameStarts.size();
+        }
 
-        void visit(ReturnNode* node) override{
-            int result = evaluate(node->getValue());
-            currentScope->setReturnValue(result);
-            //std::cout << "Returning: " << result << std::endl;
+    private:
+        struct Binding {
+            SymbolId name;
+            int value;
+        };
+
+        std::vector<Binding> bindings;     // Every frame's variables, end to end
+        std::vector<size_t> frameStarts;   // Where each frame begins in bindings
+        std::vector<int> staged;
+        SymbolMap<int> globals;
+        size_t maxDepth;
+
+        // Frames hold a handful of names, so a scan beats hashing
+        Binding* findLocal(SymbolId name) {
+            for (size_t i = frameStarts.back(); i < bindings.size(); ++i) {
+                if (bindings[i].name == name) return &bindings[i];
+            }
+            return nullptr;
         }
-        
-        void visit(IdentifierNode* node) override {
-            try {
-                int value = currentScope->getVariable(node->getIdentifier());
+};
+
+/* --- Operators --- */
+// Integer semantics of every BinaryOpNode operator code, shared by all the evaluators
+int evaluateBinaryOperation(char op, int left, int right) {
+    switch (op) {
+        case '+': return left + right;
+        case '-': return left - right;
+        case '*': return left * right;
+        case '/': 
+            if (right == 0) throw std::runtime_error("Division by zero.");
+            return left / right;
+        case 'F': { // '//' rounds toward negative infinity
+            if (right == 0) throw std::runtime_error("Division by zero.");
+            int quotient = left / right;
+            return (left % right != 0 && ((left < 0) != (right < 0))) ? quotient - 1 : quotient;
+        }
+        case 'E':  // '=='
+            return left == right;
+        case 'N':  // '!='
+            return left != right;
+        case 'L':  // '<='
+            return left <= right;
+        case 'G':  // '>='
+            return left >= right;
+        case '<':
+            return left < right;
+        case '>':
+            return left > right;
+        case '%':
+            return left % right;
+        case '^': { // '**'
+            if (right < 0) throw std::runtime_error("Negative exponents are not supported for integers.");
+            // Unsigned, so overflow wraps instead of being UB (the last squaring always
+            // overflows for results past 2**15)
+            unsigned result = 1;
+            for (unsigned base = static_cast<unsigned>(left); right > 0; right >>= 1, base *= base) {
+                if (right & 1) result *= base;
+            }
+            return static_cast<int>(result);
+        }
+        case '&':
+            return left ? right : left;
+        case '|':
+            return left ? left : right;
+        case '~':
+            return ~left;
+        case '!':
+            return !left;
+        case 'A':
+            return left & right;
+        case 'O':
+            return left | right;
+        default:
+            throw std::runtime_error("Unsupported operator for binary operation.");
+    }     
+}
 
-                std::cout << node->getIdentifier() << " = " << std::endl;
+/* ----------- OPTIMIZER ----------- */
+// Rewrites of the pointer AST between parsing and running, so every engine (and the
+// program cache) gets the result. Nodes are never changed in place: a pass makes a new
+// node in the same arena when one of its children changed and shares every untouched
+// subtree. The passes feed each other (propagating `x = 2` lets `x * 3` fold, which can
+// decide an if), so the Optimizer repeats them until a round changes nothing.
 
-            } catch (const std::runtime_error& e) {
-                std::cerr << "Runtime Error: " << e.what() << std::endl;
+/* --- Rewriter --- */
+class AstRewriter {
+    public:
+        explicit AstRewriter(AstArena& arena) : arena(arena) {}
+        virtual ~AstRewriter() {}
+
+        NodeList rewriteStatements(const NodeList& statements) {
+            std::vector<ASTNode*> out;
+            out.reserve(statements.size());
+            for (ASTNode* statement : statements) rewriteStatement(statement, out);
+            return sameNodes(statements, out) ? statements : arena.copyArray(out.data(), out.size());
+        }
+
+    protected:
+        AstArena& arena;
+
+        // Appends whatever statement becomes (normally one node; none drops it)
+        virtual void rewriteStatement(ASTNode* statement, std::vector<ASTNode*>& out) {
+            out.push_back(rewrite(statement));
+        }
+
+        virtual ASTNode* rewrite(ASTNode* node) {
+            return rewriteChildren(node);
+        }
+
+        // The node itself, or a copy of it over the rewritten children if any changed
+        ASTNode* rewriteChildren(ASTNode* node) {
+            switch (node->getType()) {
+                case ASTNodeType::Assign: {
+                    AssignNode* assign = dynamic_cast<AssignNode*>(node);
+                    ASTNode* value = rewrite(assign->getValue());
+                    return value == assign->getValue() ? node : arena.make<AssignNode>(assign->getIdentifier(), value);
+                }
+                case ASTNodeType::Print: {
+                    PrintNode* print = dynamic_cast<PrintNode*>(node);
+                    NodeList expressions = rewriteExpressions(print->getExpressions());
+                    return expressions.begin() == print->getExpressions().begin() ? node : arena.make<PrintNode>(expressions);
+                }
+                case ASTNodeType::BinaryOp: {
+                    BinaryOpNode* binary = dynamic_cast<BinaryOpNode*>(node);
+                    ASTNode* left = rewrite(binary->getLeft());
+                    ASTNode* right = rewrite(binary->getRight());
+                    if (left == binary->getLeft() && right == binary->getRight()) return node;
+                    return arena.make<BinaryOpNode>(left, binary->getOp(), right);
+                }
+                case ASTNodeType::UnaryOp: {
+                    UnaryOpNode* unary = dynamic_cast<UnaryOpNode*>(node);
+                    ASTNode* operand = rewrite(unary->getOperand());
+                    return operand == unary->getOperand() ? node : arena.make<UnaryOpNode>(unary->getOp(), operand);
+                }
+                case ASTNodeType::If: {
+                    IfNode* ifNode = dynamic_cast<IfNode*>(node);
+                    ASTNode* condition = rewrite(ifNode->getCondition());
+                    BlockNode* thenBranch = rewriteBlock(ifNode->getThenBranch());
+                    BlockNode* elseBranch = ifNode->getElseBranch() ? rewriteBlock(ifNode->getElseBranch()) : nullptr;
+                    return rebuildIf(ifNode, condition, thenBranch, elseBranch);
+                }
+                case ASTNodeType::Block:
+                    return rewriteBlock(dynamic_cast<BlockNode*>(node));
+                case ASTNodeType::Function: {
+                    FunctionNode* function = dynamic_cast<FunctionNode*>(node);
+                    BlockNode* body = rewriteBlock(function->getBody());
+                    return body == function->getBody() ? node : arena.make<FunctionNode>(function->getName(), function->getParameters(), body);
+                }
+                case ASTNodeType::Return: {
+                    ReturnNode* returnNode = dynamic_cast<ReturnNode*>(node);
+                    ASTNode* value = rewrite(returnNode->getValue());
+                    return value == returnNode->getValue() ? node : arena.make<ReturnNode>(value);
+                }
+                case ASTNodeType::FunctionCall: {
+                    FunctionCallNode* call = dynamic_cast<FunctionCallNode*>(node);
+                    NodeList arguments = rewriteExpressions(call->getArguments());
+                    return arguments.begin() == call->getArguments().begin() ? node : arena.make<FunctionCallNode>(call->getName(), arguments);
+                }
+                default:  // Int, String, Identifier: no children
+                    return node;
             }
         }
 
-        void visit(AssignNode* node) override {
+        BlockNode* rewriteBlock(BlockNode* block) {
+            NodeList statements = rewriteStatements(block->getStatements());
+            return statements.begin() == block->getStatements().begin() ? block : arena.make<BlockNode>(statements);
+        }
 
-            // Evaluate the right-hand side and assign to the identifier in the current scope
-            int value = evaluate(node->getValue());
-            currentScope->setVariable(node->getIdentifier(), value);
+        NodeList rewriteExpressions(const NodeList& expressions) {
+            std::vector<ASTNode*> out;
+            out.reserve(expressions.size());
+            for (ASTNode* expression : expressions) out.push_back(rewrite(expression));
+            return sameNodes(expressions, out) ? expressions : arena.copyArray(out.data(), out.size());
+        }
 
-            // Debugging 
-            //std::cout << "Assigned " << node->getIdentifier() << " = " << value << std::endl;
+        ASTNode* rebuildIf(IfNode* node, ASTNode* condition, BlockNode* thenBranch, BlockNode* elseBranch) {
+            if (condition == node->getCondition() && thenBranch == node->getThenBranch() && elseBranch == node->getElseBranch()) return node;
+            return arena.make<IfNode>(condition, thenBranch, elseBranch);
         }
 
-        void visit(PrintNode* node) override {
-            
-            for (const auto& expr : node->getExpressions()) { // Determining the type of expr and handling it accordingly
+        static bool sameNodes(const NodeList& original, const std::vector<ASTNode*>& rewritten) {
+            return original.size() == rewritten.size() && std::equal(rewritten.begin(), rewritten.end(), original.begin());
+        }
+};
 
-                
-                if (expr->getType() == ASTNodeType::Identifier) {  
-                    IdentifierNode* idNode = dynamic_cast<IdentifierNode*>(expr.get());
+/* --- Passes --- */
+class OptimizationPass : public AstRewriter {
+    public:
+        explicit OptimizationPass(AstArena& arena) : AstRewriter(arena) {}
 
-                    if (idNode) {  // Always check the result of dynamic_cast
-                        int value = currentScope->getVariable(idNode->getIdentifier());
-                        std::cout << value << " ";
-                    }
+        virtual const char* name() const = 0;
 
-                } else if (expr->getType() == ASTNodeType::String) {
-                    StringNode* strNode = dynamic_cast<StringNode*>(expr.get());
+        virtual NodeList run(const NodeList& program) {
+            return rewriteStatements(program);
+        }
 
-                    if (strNode) {  // Always check the result of dynamic_cast
-                        std::cout << strNode->getValue() << " ";
-                    }
+        size_t getRewrites() const { return rewrites; }
+        double getSeconds() const { return seconds; }
+        void addSeconds(double spent) { seconds += spent; }
 
-                } 
+    protected:
+        size_t rewrites = 0;
+        double seconds = 0;
 
-            }
+        static bool isInt(ASTNode* node) {
+            return node->getType() == ASTNodeType::Int;
+        }
 
-            std::cout << std::endl;
+        static int intValue(ASTNode* node) {
+            return dynamic_cast<IntNode*>(node)->getValue();
         }
+};
 
+// Operators over literals become literals. Anything that would raise at run time
+// (dividing by zero, a negative exponent) is left alone so it still raises there, in order.
+class ConstantFolding : public OptimizationPass {
+    public:
+        using OptimizationPass::OptimizationPass;
+        const char* name() const override { return "constant folding"; }
 
-        void visit(BinaryOpNode* node) override {
+        ASTNode* fold(ASTNode* expression) {
+            return rewrite(expression);
+        }
 
-            // getLeft() and getRight() return std::unique_ptr<ASTNode>
-            ASTNode* left = node->getLeft().get();   // Using .get() to extract the raw pointer
-            ASTNode* right = node->getRight().get(); // Using .get() to extract the raw pointer
+    protected:
+        ASTNode* rewrite(ASTNode* node) override {
+            node = rewriteChildren(node);
+            if (node->getType() == ASTNodeType::UnaryOp) {
+                UnaryOpNode* unary = dynamic_cast<UnaryOpNode*>(node);
+                if (!isInt(unary->getOperand())) return node;
+                int operand = intValue(unary->getOperand());
+                if (unary->getOp() == '-' && operand == INT_MIN) return node;  // Overflows
+                rewrites++;
+                return arena.make<IntNode>(unary->getOp() == '-' ? -operand : !operand);
+            }
+            if (node->getType() != ASTNodeType::BinaryOp) return node;
 
-            // Now you can use `left` and `right` as raw pointers
-            char op = node->getOp();
-            int result = 0;
+            BinaryOpNode* binary = dynamic_cast<BinaryOpNode*>(node);
+            if (!isInt(binary->getLeft())) return node;
+            int left = intValue(binary->getLeft());
 
-            switch (op) {
-                case '+':
-                    result = evaluate(left) + evaluate(right);
-                    break;
-                case '-':
-                    result = evaluate(left) - evaluate(right);
-                    break;
-                case '*':
-                    result = evaluate(left) * evaluate(right);
-                    break;
-                case '/':
-                    if (evaluate(right) == 0) throw std::runtime_error("Division by zero.");
-                    result = evaluate(left) / evaluate(right);
+            // A literal left of 'and' / 'or' decides which operand is the value
+            if ((binary->getOp() == '&' || binary->getOp() == '|') && binary->getRight()->getType() != ASTNodeType::String) {
+                rewrites++;
+                return (binary->getOp() == '&') == (left != 0) ? binary->getRight() : binary->getLeft();
+            }
+
+            if (!isInt(binary->getRight())) return node;
+            int right = intValue(binary->getRight());
+            // These fail (or trap) at run time, not here
+            bool divides = binary->getOp() == '/' || binary->getOp() == 'F' || binary->getOp() == '%';
+            if (divides && (right == 0 || (left == INT_MIN && right == -1))) return node;
+            try {
+                int value = evaluateBinaryOperation(binary->getOp(), left, right);
+                rewrites++;
+                return arena.make<IntNode>(value);
+            } catch (const std::runtime_error&) {
+                return node;
+            }
+        }
+};
+
+// Reads of a variable become its value while the assignment that reaches them is
+// certainly `name = <literal>`. Straight-line code only: after an if, every name assigned
+// anywhere inside it is forgotten, and a def body starts knowing nothing (its names are
+// its own locals, or globals read at whatever time it's called). Calls can't change the
+// caller's variables, since functions only ever assign their own locals. Values are
+// folded as they're assigned, so a chain like `a = 2`, `b = a * 3`, `c = b + 1` settles
+// in one walk.
+class ConstantPropagation : public OptimizationPass {
+    public:
+        ConstantPropagation(AstArena& arena, ConstantFolding& folding) : OptimizationPass(arena), folding(folding) {}
+        const char* name() const override { return "constant propagation"; }
+
+        NodeList run(const NodeList& program) override {
+            known.clear();
+            return rewriteStatements(program);
+        }
+
+    protected:
+        void rewriteStatement(ASTNode* statement, std::vector<ASTNode*>& out) override {
+            // A bare name as a statement is only there to raise if it's undefined
+            out.push_back(statement->getType() == ASTNodeType::Identifier ? statement : rewrite(statement));
+        }
+
+        ASTNode* rewrite(ASTNode* node) override {
+            switch (node->getType()) {
+                case ASTNodeType::Identifier: {
+                    auto found = known.find(dynamic_cast<IdentifierNode*>(node)->getIdentifier());
+                    if (found == known.end()) return node;
+                    rewrites++;
+                    return arena.make<IntNode>(found->second);
+                }
+                case ASTNodeType::Assign: {
+                    AssignNode* assign = dynamic_cast<AssignNode*>(node);
+                    ASTNode* value = folding.fold(rewrite(assign->getValue()));
+                    if (isInt(value)) {
+                        known[assign->getIdentifier()] = intValue(value);
+                    } else {
+                        known.erase(assign->getIdentifier());
+                    }
+                    return value == assign->getValue() ? node : arena.make<AssignNode>(assign->getIdentifier(), value);
+                }
+                case ASTNodeType::If: {
+                    IfNode* ifNode = dynamic_cast<IfNode*>(node);
+                    ASTNode* condition = rewrite(ifNode->getCondition());
+                    std::unordered_map<SymbolId, int> before = known;
+                    BlockNode* thenBranch = rewriteBlock(ifNode->getThenBranch());
+                    BlockNode* elseBranch = nullptr;
+                    if (ifNode->getElseBranch()) {
+                        known = before;
+                        elseBranch = rewriteBlock(ifNode->getElseBranch());
+                    }
+                    known = std::move(before);
+                    forgetAssigned(ifNode->getThenBranch());
+                    if (ifNode->getElseBranch()) forgetAssigned(ifNode->getElseBranch());
+                    return rebuildIf(ifNode, condition, thenBranch, elseBranch);
+                }
+                // Only dead branch elimination leaves blocks in a statement list, for a
+                // top-level branch that returns: like a branch, it may stop partway
+                case ASTNodeType::Block: {
+                    BlockNode* block = dynamic_cast<BlockNode*>(node);
+                    std::unordered_map<SymbolId, int> before = known;
+                    BlockNode* rewritten = rewriteBlock(block);
+                    known = std::move(before);
+                    forgetAssigned(block);
+                    return rewritten;
+                }
+                case ASTNodeType::Function: {
+                    std::unordered_map<SymbolId, int> outside;
+                    outside.swap(known);
+                    ASTNode* function = rewriteChildren(node);
+                    known.swap(outside);
+                    return function;
+                }
+                default:
+                    return rewriteChildren(node);
+            }
+        }
+
+    private:
+        ConstantFolding& folding;
+        std::unordered_map<SymbolId, int> known;
+
+        void forgetAssigned(BlockNode* block) {
+            for (ASTNode* statement : block->getStatements()) {
+                if (statement->getType() == ASTNodeType::Assign) {
+                    known.erase(dynamic_cast<AssignNode*>(statement)->getIdentifier());
+                } else if (statement->getType() == ASTNodeType::If) {
+                    IfNode* ifNode = dynamic_cast<IfNode*>(statement);
+                    forgetAssigned(ifNode->getThenBranch());
+                    if (ifNode->getElseBranch()) forgetAssigned(ifNode->getElseBranch());
+                } else if (statement->getType() == ASTNodeType::Block) {
+                    forgetAssigned(dynamic_cast<BlockNode*>(statement));
+                }
+            }
+        }
+};
+
+// An if whose condition is a literal becomes the branch it always takes, or goes away.
+// The branch's statements are spliced into the enclosing block, except for a top-level
+// branch that returns: a top-level return only ends the statement it's in, so there the
+// branch stays a block of its own.
+class DeadBranchElimination : public OptimizationPass {
+    public:
+        using OptimizationPass::OptimizationPass;
+        const char* name() const override { return "dead branch elimination"; }
+
+    protected:
+        void rewriteStatement(ASTNode* statement, std::vector<ASTNode*>& out) override {
+            statement = rewrite(statement);
+            if (statement->getType() == ASTNodeType::If) {
+                IfNode* ifNode = dynamic_cast<IfNode*>(statement);
+                if (isInt(ifNode->getCondition())) {
+                    rewrites++;
+                    BlockNode* taken = intValue(ifNode->getCondition()) ? ifNode->getThenBranch() : ifNode->getElseBranch();
+                    if (!taken || taken->getStatements().empty()) return;
+                    if (!inFunction && returns(taken)) {
+                        out.push_back(taken);
+                    } else {
+                        out.insert(out.end(), taken->getStatements().begin(), taken->getStatements().end());
+                    }
+                    return;
+                }
+            }
+            out.push_back(statement);
+        }
+
+        ASTNode* rewrite(ASTNode* node) override {
+            if (node->getType() != ASTNodeType::Function) return rewriteChildren(node);
+            bool outer = inFunction;
+            inFunction = true;
+            node = rewriteChildren(node);
+            inFunction = outer;
+            return node;
+        }
+
+    private:
+        bool inFunction = false;
+
+        static bool returns(BlockNode* block) {
+            for (ASTNode* statement : block->getStatements()) {
+                switch (statement->getType()) {
+                    case ASTNodeType::Return:
+                        return true;
+                    case ASTNodeType::Block:
+                        if (returns(dynamic_cast<BlockNode*>(statement))) return true;
+                        break;
+                    case ASTNodeType::If: {
+                        IfNode* ifNode = dynamic_cast<IfNode*>(statement);
+                        if (returns(ifNode->getThenBranch())) return true;
+                        if (ifNode->getElseBranch() && returns(ifNode->getElseBranch())) return true;
+                        break;
+                    }
+                    default:
+                        break;
+                }
+            }
+            return false;
+        }
+};
+
+/* --- Inlining --- */
+// Calls f(child) for every child of node, in evaluation order
+template <typename F>
+void forEachChild(ASTNode* node, F f) {
+    switch (node->getType()) {
+        case ASTNodeType::Assign:
+            f(dynamic_cast<AssignNode*>(node)->getValue());
+            break;
+        case ASTNodeType::Print:
+            for (ASTNode* expression : dynamic_cast<PrintNode*>(node)->getExpressions()) f(expression);
+            break;
+        case ASTNodeType::BinaryOp:
+            f(dynamic_cast<BinaryOpNode*>(node)->getLeft());
+            f(dynamic_cast<BinaryOpNode*>(node)->getRight());
+            break;
+        case ASTNodeType::UnaryOp:
+            f(dynamic_cast<UnaryOpNode*>(node)->getOperand());
+            break;
+        case ASTNodeType::If: {
+            IfNode* ifNode = dynamic_cast<IfNode*>(node);
+            f(ifNode->getCondition());
+            f(ifNode->getThenBranch());
+            if (ifNode->getElseBranch()) f(ifNode->getElseBranch());
+            break;
+        }
+        case ASTNodeType::Block:
+            for (ASTNode* statement : dynamic_cast<BlockNode*>(node)->getStatements()) f(statement);
+            break;
+        case ASTNodeType::Function:
+            f(dynamic_cast<FunctionNode*>(node)->getBody());
+            break;
+        case ASTNodeType::Return:
+            f(dynamic_cast<ReturnNode*>(node)->getValue());
+            break;
+        case ASTNodeType::FunctionCall:
+            for (ASTNode* argument : dynamic_cast<FunctionCallNode*>(node)->getArguments()) f(argument);
+            break;
+        default:
+            break;
+    }
+}
+
+// Replaces a call to a small function with the function's body, its parameters and
+// locals renamed apart (`x` in `evaluate` becomes `evaluate.x.3`, which no script can
+// spell), so later passes fold straight through it. Functions are bound by name at run
+// time, so the body can only be substituted where the call certainly reaches it:
+//  - the callee has exactly one def in the program, as a top-level statement, and the
+//    call is in a later top-level statement or in a function whose single top-level def
+//    comes later (neither runs before the callee exists, and it's never redefined);
+//  - it can't reach itself through calls, has no defs of its own, and its only return is
+//    its last statement;
+//  - every local it reads has certainly been assigned by then (otherwise the read falls
+//    back to a global, which a renamed local can't), and none of the globals it reads is
+//    a local of the caller.
+// Only a call that runs first in its statement is hoisted: the whole value of an
+// assignment, return or expression statement, or a print's first argument (print writes
+// each argument as soon as it's evaluated, so a later one would reorder the output).
+class Inliner : public OptimizationPass {
+    public:
+        using OptimizationPass::OptimizationPass;
+        const char* name() const override { return "inlining"; }
+
+        NodeList run(const NodeList& program) override {
+            analyze(program);
+            std::vector<ASTNode*> out;
+            for (position = 0; position < program.size(); ++position) {
+                topStatement = program[position];
+                rewriteStatement(program[position], out);
+            }
+            return sameNodes(program, out) ? program : arena.copyArray(out.data(), out.size());
+        }
+
+    protected:
+        void rewriteStatement(ASTNode* statement, std::vector<ASTNode*>& out) override {
+            statement = rewrite(statement);
+            FunctionCallNode* call = hoistableCall(statement);
+            const Callee* callee = call ? inlinableAt(call) : nullptr;
+            if (!callee) {
+                out.push_back(statement);
+                return;
+            }
+
+            rewrites++;
+            ASTNode* result = expand(*callee, call, out);
+            switch (statement->getType()) {
+                case ASTNodeType::Assign:
+                    out.push_back(arena.make<AssignNode>(dynamic_cast<AssignNode*>(statement)->getIdentifier(), result));
+                    break;
+                case ASTNodeType::Return:
+                    out.push_back(arena.make<ReturnNode>(result));
+                    break;
+                case ASTNodeType::Print: {
+                    const NodeList& expressions = dynamic_cast<PrintNode*>(statement)->getExpressions();
+                    std::vector<ASTNode*> replaced(expressions.begin(), expressions.end());
+                    std::replace(replaced.begin(), replaced.end(), static_cast<ASTNode*>(call), result);
+                    out.push_back(arena.make<PrintNode>(arena.copyArray(replaced.data(), replaced.size())));
                     break;
-                case 'E':  // '=='
-                    result = evaluate(left) == evaluate(right);
+                }
+                default:  // The call was the statement; its value only matters if computing it can fail
+                    if (result->getType() != ASTNodeType::Int && result->getType() != ASTNodeType::String) out.push_back(result);
                     break;
-                case 'N':  // '!='
-                    result = evaluate(left) != evaluate(right);
+            }
+        }
+
+        ASTNode* rewrite(ASTNode* node) override {
+            if (node->getType() != ASTNodeType::Function) return rewriteChildren(node);
+
+            FunctionNode* function = dynamic_cast<FunctionNode*>(node);
+            Caller outer = caller;
+            caller = Caller();
+            caller.inFunction = true;
+            const uint32_t* defs = defCounts.find(function->getName());
+            caller.canInline = !outer.inFunction && node == topStatement && defs && *defs == 1;
+            if (caller.canInline) {
+                caller.locals.insert(function->getParameters().begin(), function->getParameters().end());
+                collectAssigned(function->getBody(), caller.locals);
+            }
+            node = rewriteChildren(node);
+            caller = std::move(outer);
+            return node;
+        }
+
+    private:
+        static const size_t INLINE_BUDGET = 64;  // Nodes in the callee's body
+
+        struct Callee {
+            FunctionNode* function;
+            size_t position;  // Of its def among the top-level statements
+            std::unordered_set<SymbolId> locals;  // Parameters and every name it assigns
+            std::unordered_set<SymbolId> globals;  // Names it reads that aren't locals
+        };
+
+        struct Caller {
+            bool inFunction = false;
+            bool canInline = true;  // Top level, or a function with one top-level def
+            std::unordered_set<SymbolId> locals;
+        };
+
+        std::unordered_map<SymbolId, Callee> callees;
+        SymbolMap<uint32_t> defCounts;
+        std::unordered_map<SymbolId, std::vector<SymbolId>> callGraph;  // Name -> names its defs call
+        Caller caller;
+        size_t position = 0;
+        ASTNode* topStatement = nullptr;
+        uint32_t expansions = 0;  // Numbers the renamed locals
+
+        void analyze(const NodeList& program) {
+            callees.clear();
+            defCounts = SymbolMap<uint32_t>();
+            callGraph.clear();
+            for (ASTNode* statement : program) collectDefs(statement, NO_SYMBOL);
+
+            for (size_t i = 0; i < program.size(); ++i) {
+                if (program[i]->getType() != ASTNodeType::Function) continue;
+                FunctionNode* function = dynamic_cast<FunctionNode*>(program[i]);
+                if (*defCounts.find(function->getName()) != 1) continue;
+                Callee callee;
+                callee.function = function;
+                callee.position = i;
+                if (suitable(callee)) callees.emplace(function->getName(), std::move(callee));
+            }
+        }
+
+        // Counts the defs of every name and records who calls whom
+        void collectDefs(ASTNode* node, SymbolId enclosing) {
+            if (node->getType() == ASTNodeType::Function) {
+                FunctionNode* function = dynamic_cast<FunctionNode*>(node);
+                const uint32_t* count = defCounts.find(function->getName());
+                defCounts.set(function->getName(), count ? *count + 1 : 1);
+                callGraph[function->getName()];
+                enclosing = function->getName();
+            } else if (node->getType() == ASTNodeType::FunctionCall && enclosing != NO_SYMBOL) {
+                callGraph[enclosing].push_back(dynamic_cast<FunctionCallNode*>(node)->getName());
+            }
+            forEachChild(node, [&](ASTNode* child) { collectDefs(child, enclosing); });
+        }
+
+        bool suitable(Callee& callee) {
+            FunctionNode* function = callee.function;
+            const NodeList& body = function->getBody()->getStatements();
+            if (body.empty() || body[body.size() - 1]->getType() != ASTNodeType::Return) return false;
+            if (countNodes(function->getBody()) > INLINE_BUDGET) return false;
+            if (reaches(function->getName(), function->getName())) return false;
+
+            callee.locals.insert(function->getParameters().begin(), function->getParameters().end());
+            collectAssigned(function->getBody(), callee.locals);
+            std::unordered_set<SymbolId> assigned(function->getParameters().begin(), function->getParameters().end());
+            for (size_t i = 0; i < body.size(); ++i) {
+                if (i + 1 < body.size() && returns(body[i])) return false;
+                if (!checkStatement(body[i], callee, assigned)) return false;
+            }
+            return true;
+        }
+
+        bool reaches(SymbolId from, SymbolId target) {
+            std::unordered_set<SymbolId> seen;
+            std::vector<SymbolId> work(1, from);
+            while (!work.empty()) {
+                auto edges = callGraph.find(work.back());
+                work.pop_back();
+                if (edges == callGraph.end()) continue;
+                for (SymbolId next : edges->second) {
+                    if (next == target) return true;
+                    if (seen.insert(next).second) work.push_back(next);
+                }
+            }
+            return false;
+        }
+
+        // Walks statements in order, tracking which locals are certainly assigned
+        bool checkStatement(ASTNode* node, Callee& callee, std::unordered_set<SymbolId>& assigned) {
+            switch (node->getType()) {
+                case ASTNodeType::Function:
+                    return false;
+                case ASTNodeType::Assign: {
+                    AssignNode* assign = dynamic_cast<AssignNode*>(node);
+                    if (!checkReads(assign->getValue(), callee, assigned)) return false;
+                    assigned.insert(assign->getIdentifier());
+                    return true;
+                }
+                case ASTNodeType::If: {
+                    IfNode* ifNode = dynamic_cast<IfNode*>(node);
+                    if (!checkReads(ifNode->getCondition(), callee, assigned)) return false;
+                    std::unordered_set<SymbolId> thenAssigned = assigned;
+                    if (!checkStatement(ifNode->getThenBranch(), callee, thenAssigned)) return false;
+                    if (!ifNode->getElseBranch()) return true;
+                    std::unordered_set<SymbolId> elseAssigned = assigned;
+                    if (!checkStatement(ifNode->getElseBranch(), callee, elseAssigned)) return false;
+                    for (SymbolId name : thenAssigned) {
+                        if (elseAssigned.count(name)) assigned.insert(name);
+                    }
+                    return true;
+                }
+                case ASTNodeType::Block:
+                    for (ASTNode* statement : dynamic_cast<BlockNode*>(node)->getStatements()) {
+                        if (!checkStatement(statement, callee, assigned)) return false;
+                    }
+                    return true;
+                default:
+                    return checkReads(node, callee, assigned);
+            }
+        }
+
+        bool checkReads(ASTNode* node, Callee& callee, const std::unordered_set<SymbolId>& assigned) {
+            if (node->getType() == ASTNodeType::Identifier) {
+                SymbolId name = dynamic_cast<IdentifierNode*>(node)->getIdentifier();
+                if (!callee.locals.count(name)) {
+                    callee.globals.insert(name);
+                } else if (!assigned.count(name)) {
+                    return false;
+                }
+                return true;
+            }
+            bool ok = true;
+            forEachChild(node, [&](ASTNode* child) { ok = ok && checkReads(child, callee, assigned); });
+            return ok;
+        }
+
+        const Callee* inlinableAt(FunctionCallNode* call) const {
+            auto found = callees.find(call->getName());
+            if (found == callees.end() || !caller.canInline || found->second.position >= position) return nullptr;
+            const Callee& callee = found->second;
+            if (callee.function->getParameters().size() != call->getArguments().size()) return nullptr;
+            for (SymbolId name : callee.globals) {
+                if (caller.locals.count(name)) return nullptr;
+            }
+            return &callee;
+        }
+
+        // Appends the callee's body, renamed, to out and returns its result expression
+        ASTNode* expand(const Callee& callee, FunctionCallNode* call, std::vector<ASTNode*>& out) {
+            FunctionNode* function = callee.function;
+            std::string prefix = symbolName(function->getName()) + ".";
+            std::string suffix = "." + std::to_string(++expansions);
+            SymbolMap<SymbolId> renames;
+            for (SymbolId name : callee.locals) {
+                renames.set(name, SymbolTable::instance().intern((prefix + symbolName(name) + suffix).c_str()));
+            }
+
+            const ArenaArray<SymbolId>& parameters = function->getParameters();
+            for (size_t i = 0; i < parameters.size(); ++i) {
+                out.push_back(arena.make<AssignNode>(*renames.find(parameters[i]), call->getArguments()[i]));
+            }
+            const NodeList& body = function->getBody()->getStatements();
+            for (size_t i = 0; i + 1 < body.size(); ++i) out.push_back(clone(body[i], renames));
+            return clone(dynamic_cast<ReturnNode*>(body[body.size() - 1])->getValue(), renames);
+        }
+
+        // A fresh copy of node with locals renamed (call sites get their own caches)
+        ASTNode* clone(ASTNode* node, const SymbolMap<SymbolId>& renames) {
+            switch (node->getType()) {
+                case ASTNodeType::Identifier: {
+                    SymbolId name = dynamic_cast<IdentifierNode*>(node)->getIdentifier();
+                    const SymbolId* renamed = renames.find(name);
+                    return arena.make<IdentifierNode>(renamed ? *renamed : name);
+                }
+                case ASTNodeType::Assign: {
+                    AssignNode* assign = dynamic_cast<AssignNode*>(node);
+                    return arena.make<AssignNode>(*renames.find(assign->getIdentifier()), clone(assign->getValue(), renames));
+                }
+                case ASTNodeType::Print:
+                    return arena.make<PrintNode>(cloneList(dynamic_cast<PrintNode*>(node)->getExpressions(), renames));
+                case ASTNodeType::BinaryOp: {
+                    BinaryOpNode* binary = dynamic_cast<BinaryOpNode*>(node);
+                    return arena.make<BinaryOpNode>(clone(binary->getLeft(), renames), binary->getOp(), clone(binary->getRight(), renames));
+                }
+                case ASTNodeType::UnaryOp: {
+                    UnaryOpNode* unary = dynamic_cast<UnaryOpNode*>(node);
+                    return arena.make<UnaryOpNode>(unary->getOp(), clone(unary->getOperand(), renames));
+                }
+                case ASTNodeType::If: {
+                    IfNode* ifNode = dynamic_cast<IfNode*>(node);
+                    BlockNode* elseBranch = ifNode->getElseBranch() ? cloneBlock(ifNode->getElseBranch(), renames) : nullptr;
+                    return arena.make<IfNode>(clone(ifNode->getCondition(), renames), cloneBlock(ifNode->getThenBranch(), renames), elseBranch);
+                }
+                case ASTNodeType::Block:
+                    return cloneBlock(dynamic_cast<BlockNode*>(node), renames);
+                case ASTNodeType::FunctionCall: {
+                    FunctionCallNode* call = dynamic_cast<FunctionCallNode*>(node);
+                    return arena.make<FunctionCallNode>(call->getName(), cloneList(call->getArguments(), renames));
+                }
+                default:  // Literals; defs and returns never get here
+                    return node;
+            }
+        }
+
+        BlockNode* cloneBlock(BlockNode* block, const SymbolMap<SymbolId>& renames) {
+            return arena.make<BlockNode>(cloneList(block->getStatements(), renames));
+        }
+
+        NodeList cloneList(const NodeList& nodes, const SymbolMap<SymbolId>& renames) {
+            std::vector<ASTNode*> copies;
+            for (ASTNode* node : nodes) copies.push_back(clone(node, renames));
+            return arena.copyArray(copies.data(), copies.size());
+        }
+
+        // The call the statement evaluates before anything else that could be observed
+        static FunctionCallNode* hoistableCall(ASTNode* statement) {
+            ASTNode* first = nullptr;
+            switch (statement->getType()) {
+                case ASTNodeType::Assign:
+                    first = dynamic_cast<AssignNode*>(statement)->getValue();
                     break;
-                case 'L':  // '<='
-                    result = evaluate(left) <= evaluate(right);
+                case ASTNodeType::Return:
+                    first = dynamic_cast<ReturnNode*>(statement)->getValue();
                     break;
-                case 'G':  // '>='
-                    result = evaluate(left) >= evaluate(right);
+                case ASTNodeType::FunctionCall:
+                    first = statement;
                     break;
-                case '<':
-                    result = evaluate(left) < evaluate(right);
+                case ASTNodeType::Print: {  // Arguments are written out as they're evaluated
+                    const NodeList& expressions = dynamic_cast<PrintNode*>(statement)->getExpressions();
+                    if (!expressions.empty()) first = expressions[0];
                     break;
-                case '>':
-                    result = evaluate(left) > evaluate(right);
+                }
+                default:
                     break;
-                case '%':
-                    result = evaluate(left) % evaluate(right);
+            }
+            return first && first->getType() == ASTNodeType::FunctionCall ? dynamic_cast<FunctionCallNode*>(first) : nullptr;
+        }
+
+        static bool returns(ASTNode* node) {
+            if (node->getType() == ASTNodeType::Return) return true;
+            bool found = false;
+            forEachChild(node, [&](ASTNode* child) { found = found || returns(child); });
+            return found;
+        }
+
+        static size_t countNodes(ASTNode* node) {
+            size_t count = 1;
+            forEachChild(node, [&](ASTNode* child) { count += countNodes(child); });
+            return count;
+        }
+
+        // Names assigned in node's statements, not counting nested defs' bodies
+        static void collectAssigned(ASTNode* node, std::unordered_set<SymbolId>& names) {
+            if (node->getType() == ASTNodeType::Function) return;
+            if (node->getType() == ASTNodeType::Assign) names.insert(dynamic_cast<AssignNode*>(node)->getIdentifier());
+            forEachChild(node, [&](ASTNode* child) { collectAssigned(child, names); });
+        }
+};
+
+/* --- Pipeline --- */
+class Optimizer {
+    public:
+        explicit Optimizer(AstArena& arena) {
+            ConstantFolding* folding = new ConstantFolding(arena);
+            passes.emplace_back(new Inliner(arena));
+            passes.emplace_back(folding);
+            passes.emplace_back(new ConstantPropagation(arena, *folding));
+            passes.emplace_back(new DeadBranchElimination(arena));
+        }
+
+        NodeList run(NodeList program) {
+            for (rounds = 0; rounds < MAX_ROUNDS; ) {
+                size_t before = totalRewrites();
+                for (auto& pass : passes) {
+                    auto start = std::chrono::steady_clock::now();
+                    program = pass->run(program);
+                    pass->addSeconds(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+                }
+                ++rounds;
+                if (totalRewrites() == before) break;
+            }
+            return program;
+        }
+
+        void printStats(std::ostream& out) const {
+            out << "optimizer: " << rounds << (rounds == 1 ? " round" : " rounds") << std::endl;
+            for (const auto& pass : passes) {
+                out << "  " << pass->name() << ": " << pass->getRewrites() << " rewrites, "
+                    << pass->getSeconds() * 1e3 << " ms" << std::endl;
+            }
+        }
+
+    private:
+        static const size_t MAX_ROUNDS = 8;  // Real scripts settle in two or three
+        std::vector<std::unique_ptr<OptimizationPass>> passes;
+        size_t rounds = 0;
+
+        size_t totalRewrites() const {
+            size_t total = 0;
+            for (const auto& pass : passes) total += pass->getRewrites();
+            return total;
+        }
+};
+
+/* --- Dump --- */
+// Prints an AST back as source, with every operation parenthesized so its shape shows
+class AstPrinter {
+    public:
+        explicit AstPrinter(std::ostream& out) : out(out) {}
+
+        void print(const NodeList& program) {
+            for (ASTNode* statement : program) printStatement(statement, 0);
+        }
+
+    private:
+        std::ostream& out;
+
+        void printStatement(ASTNode* node, int indent) {
+            switch (node->getType()) {
+                case ASTNodeType::If: {
+                    IfNode* ifNode = dynamic_cast<IfNode*>(node);
+                    line(indent) << "if " << expression(ifNode->getCondition()) << ":" << std::endl;
+                    printBlock(ifNode->getThenBranch(), indent + 1);
+                    if (ifNode->getElseBranch()) {
+                        line(indent) << "else:" << std::endl;
+                        printBlock(ifNode->getElseBranch(), indent + 1);
+                    }
                     break;
-                case '^':
-                    result = pow(evaluate(left), evaluate(right));
+                }
+                case ASTNodeType::Block:  // A pruned top-level branch that returns
+                    line(indent) << "if 1:" << std::endl;
+                    printBlock(dynamic_cast<BlockNode*>(node), indent + 1);
                     break;
-                case '&':
-                    result = evaluate(left) && evaluate(right);
+                case ASTNodeType::Function: {
+                    FunctionNode* function = dynamic_cast<FunctionNode*>(node);
+                    line(indent) << "def " << symbolName(function->getName()) << "(";
+                    const char* separator = "";
+                    for (SymbolId parameter : function->getParameters()) {
+                        out << separator << symbolName(parameter);
+                        separator = ", ";
+                    }
+                    out << "):" << std::endl;
+                    printBlock(function->getBody(), indent + 1);
                     break;
-                case '|':
-                    result = evaluate(left) || evaluate(right);
+                }
+                case ASTNodeType::Assign: {
+                    AssignNode* assign = dynamic_cast<AssignNode*>(node);
+                    line(indent) << symbolName(assign->getIdentifier()) << " = " << expression(assign->getValue()) << std::endl;
                     break;
-                case '!':
-                    result = !evaluate(right);
+                }
+                case ASTNodeType::Return:
+                    line(indent) << "return " << expression(dynamic_cast<ReturnNode*>(node)->getValue()) << std::endl;
                     break;
-                case '~':
-                    result = ~evaluate(right);
+                default:
+                    line(indent) << expression(node) << std::endl;
                     break;
+            }
+        }
+
+        void printBlock(BlockNode* block, int indent) {
+            if (block->getStatements().empty()) line(indent) << "pass" << std::endl;
+            for (ASTNode* statement : block->getStatements()) printStatement(statement, indent);
+        }
+
+        std::ostream& line(int indent) {
+            for (int i = 0; i < indent; ++i) out << "    ";
+            return out;
+        }
+
+        static std::string expression(ASTNode* node) {
+            switch (node->getType()) {
+                case ASTNodeType::Int:
+                    return std::to_string(dynamic_cast<IntNode*>(node)->getValue());
+                case ASTNodeType::String: {
+                    StringRef text = dynamic_cast<StringNode*>(node)->getValue();
+                    return "\"" + std::string(text.data, text.size) + "\"";
+                }
+                case ASTNodeType::Identifier:
+                    return symbolName(dynamic_cast<IdentifierNode*>(node)->getIdentifier());
+                case ASTNodeType::BinaryOp: {
+                    BinaryOpNode* binary = dynamic_cast<BinaryOpNode*>(node);
+                    return "(" + expression(binary->getLeft()) + " " + operatorText(binary->getOp()) + " " + expression(binary->getRight()) + ")";
+                }
+                case ASTNodeType::UnaryOp: {
+                    UnaryOpNode* unary = dynamic_cast<UnaryOpNode*>(node);
+                    return (unary->getOp() == '-' ? "(-" : "(not ") + expression(unary->getOperand()) + ")";
+                }
+                case ASTNodeType::FunctionCall: {
+                    FunctionCallNode* call = dynamic_cast<FunctionCallNode*>(node);
+                    return symbolName(call->getName()) + "(" + expressionList(call->getArguments()) + ")";
+                }
+                case ASTNodeType::Print:
+                    return "print(" + expressionList(dynamic_cast<PrintNode*>(node)->getExpressions()) + ")";
                 default:
-                    throw std::runtime_error("Unsupported operator: " + std::string(1, op));
+                    return "?";
             }
+        }
 
-            std::cout << "Result of " << op << " operation: " << result << std::endl;
-            
+        static std::string expressionList(const NodeList& expressions) {
+            std::string text;
+            for (ASTNode* expression : expressions) {
+                if (!text.empty()) text += ", ";
+                text += AstPrinter::expression(expression);
+            }
+            return text;
+        }
+
+        static const char* operatorText(char op) {
+            switch (op) {
+                case '|': return "or";
+                case '&': return "and";
+                case 'E': return "==";
+                case 'N': return "!=";
+                case 'L': return "<=";
+                case 'G': return ">=";
+                case 'F': return "//";
+                case '^': return "**";
+                case '+': return "+";
+                case '-': return "-";
+                case '*': return "*";
+                case '/': return "/";
+                case '%': return "%";
+                case '<': return "<";
+                case '>': return ">";
+                default: return "?";
+            }
+        }
+};
+
+/* ----------- PROFILER ----------- */
+// --profile: deterministic profiling of the tree engine. Every call and every top-level
+// statement is timed on entry and exit (TSC where there is one), so the counts are
+// exact; recursion is only counted once toward inclusive time.
+
+/* --- Allocation counting --- */
+// Every operator new on this thread, for the allocations-per-call column. Replacing the
+// global operator new costs one thread-local increment, profiling or not. Deletes are
+// replaced to match; they're kept out of line so GCC doesn't see free() meet new.
+thread_local uint64_t threadAllocations = 0;
+
+void* operator new(std::size_t size) {
+    ++threadAllocations;
+    if (size == 0) size = 1;
+    for (;;) {
+        if (void* memory = std::malloc(size)) return memory;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+#if defined(__GNUC__)
+#define MYPYTHON_NOINLINE __attribute__((noinline))
+#else
+#define MYPYTHON_NOINLINE
+#endif
+
+MYPYTHON_NOINLINE void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+MYPYTHON_NOINLINE void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+/* --- Profiler --- */
+class Profiler {
+    public:
+        Profiler() : startTicks(ticks()), startTime(std::chrono::steady_clock::now()) {}
+
+        void enterFunction(SymbolId name) {
+            uint32_t* entry = functionEntries.find(name);
+            if (!entry) {
+                functionEntries.set(name, addEntry(symbolName(name)));
+                entry = functionEntries.find(name);
+            }
+            callDepth++;
+            maxCallDepth = std::max(maxCallDepth, callDepth);
+            enter(*entry);
+        }
+
+        void exitFunction() {
+            exit();
+            callDepth--;
+        }
+
+        // The callee replaces the caller's frame, here as in the engine
+        void tailCall(SymbolId name) {
+            exitFunction();
+            enterFunction(name);
+        }
+
+        void enterStatement(size_t index) {
+            enter(addEntry("<statement " + std::to_string(index + 1) + ">"));
+        }
+
+        void exitStatement() {
+            exit();
+        }
+
+        // Closes whatever an error left open; the table then goes to out, and the
+        // collapsed stacks (one "a;b;c nanoseconds" line per call path, the input
+        // flamegraph.pl expects) to stacksPath unless it's empty. False, with an error line
+        // on out, if the stacks couldn't be written; it never throws, since it also runs
+        // from main's error handler.
+        bool report(std::ostream& out, const std::string& stacksPath) {
+            while (!stack.empty()) exit();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+            double tickSeconds = seconds > 0 && ticks() > startTicks ? seconds / (ticks() - startTicks) : 1e-9;
+
+            std::vector<const Entry*> rows;
+            uint64_t calls = 0;
+            for (const Entry& entry : entries) {
+                rows.push_back(&entry);
+                if (entry.name[0] != '<') calls += entry.calls;
+            }
+            std::sort(rows.begin(), rows.end(), [](const Entry* a, const Entry* b) { return a->self > b->self; });
+
+            char line[256];
+            out << "profile: " << calls << " calls, max depth " << maxCallDepth << ", " << seconds * 1000 << " ms" << std::endl;
+            std::snprintf(line, sizeof line, "%10s %10s %10s %12s %11s %8s  %s", "self ms", "incl ms", "calls",
+                          "self us/call", "allocs/call", "max rec", "function");
+            out << line << std::endl;
+            size_t shown = rows.size() < MAX_ROWS ? rows.size() : MAX_ROWS;
+            for (size_t i = 0; i < shown; ++i) {
+                const Entry& entry = *rows[i];
+                std::snprintf(line, sizeof line, "%10.3f %10.3f %10llu %12.3f %11.2f %8zu  %s",
+                              entry.self * tickSeconds * 1e3, entry.inclusive * tickSeconds * 1e3,
+                              static_cast<unsigned long long>(entry.calls),
+                              entry.self * tickSeconds * 1e6 / entry.calls,
+                              static_cast<double>(entry.allocations) / entry.calls,
+                              entry.maxActive, entry.name.c_str());
+                out << line << std::endl;
+            }
+            if (rows.size() > shown) out << "(" << rows.size() - shown << " more)" << std::endl;
+
+            if (stacksPath.empty() || writeStacks(stacksPath, tickSeconds)) return true;
+            out << "Error: Can't write " << stacksPath << std::endl;
+            return false;
+        }
+
+    private:
+        static const size_t MAX_ROWS = 40;
+
+        struct Entry {
+            std::string name;
+            uint64_t calls = 0;
+            uint64_t self = 0;       // Ticks
+            uint64_t inclusive = 0;  // Ticks, outermost activations only
+            uint64_t allocations = 0;  // Self
+            size_t active = 0;       // Activations running right now
+            size_t maxActive = 0;    // Deepest recursion
+        };
+
+        // One per distinct call path
+        struct PathNode {
+            uint32_t entry;
+            uint32_t parent;
+            uint64_t self = 0;
+        };
+
+        struct Frame {
+            uint32_t entry;
+            uint32_t path;
+            uint64_t start;
+            uint64_t children = 0;        // Ticks spent in callees
+            uint64_t allocationStart;
+            uint64_t childAllocations = 0;
+        };
+
+        static const uint32_t NO_PATH = UINT32_MAX;
+
+        std::vector<Entry> entries;
+        SymbolMap<uint32_t> functionEntries;
+        std::vector<PathNode> paths;
+        std::unordered_map<uint64_t, uint32_t> pathChildren;  // (parent << 32 | entry) -> path
+        std::vector<Frame> stack;
+        size_t callDepth = 0;
+        size_t maxCallDepth = 0;
+        uint64_t startTicks;
+        std::chrono::steady_clock::time_point startTime;
+
+        static uint64_t ticks() {
+#ifdef MYPYTHON_HAVE_TSC
+            return __rdtsc();
+#else
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
         }
 
-        void visit(IfNode* node) override {
-            // First, get a string representation of the condition for debugging purposes
-            std::string conditionStr = conditionToString(node->getCondition().get());
-            std::cout << "Evaluating IfNode condition: " << conditionStr << std::endl;
+        uint32_t addEntry(const std::string& name) {
+            entries.emplace_back();
+            entries.back().name = name;
+            return static_cast<uint32_t>(entries.size() - 1);
+        }
+
+        uint32_t pathFor(uint32_t entry) {
+            uint32_t parent = stack.empty() ? NO_PATH : stack.back().path;
+            uint64_t key = static_cast<uint64_t>(parent) << 32 | entry;
+            auto found = pathChildren.find(key);
+            if (found != pathChildren.end()) return found->second;
+            paths.push_back(PathNode{entry, parent});
+            return pathChildren[key] = static_cast<uint32_t>(paths.size() - 1);
+        }
+
+        void enter(uint32_t index) {
+            Entry& entry = entries[index];
+            entry.calls++;
+            entry.maxActive = std::max(entry.maxActive, ++entry.active);
+            uint32_t path = pathFor(index);
+            stack.push_back(Frame{index, path, ticks(), 0, threadAllocations, 0});
+        }
+
+        void exit() {
+            uint64_t now = ticks();
+            Frame frame = stack.back();
+            stack.pop_back();
+            uint64_t elapsed = now - frame.start;
+            uint64_t allocations = threadAllocations - frame.allocationStart;
+
+            Entry& entry = entries[frame.entry];
+            entry.self += elapsed - frame.children;
+            entry.allocations += allocations - frame.childAllocations;
+            if (--entry.active == 0) entry.inclusive += elapsed;
+            paths[frame.path].self += elapsed - frame.children;
+            if (!stack.empty()) {
+                stack.back().children += elapsed;
+                stack.back().childAllocations += allocations;
+            }
+        }
+
+        bool writeStacks(const std::string& path, double tickSeconds) {
+            std::ofstream out(path);
+            if (!out) return false;
+            std::vector<const std::string*> names;
+            for (const PathNode& node : paths) {
+                uint64_t nanos = static_cast<uint64_t>(node.self * tickSeconds * 1e9);
+                if (!nanos) continue;
+                names.clear();
+                for (uint32_t at = static_cast<uint32_t>(&node - paths.data()); at != NO_PATH; at = paths[at].parent) {
+                    names.push_back(&entries[paths[at].entry].name);
+                }
+                for (size_t i = names.size(); i-- > 0; ) out << *names[i] << (i ? ";" : " ");
+                out << nanos << "\n";
+            }
+            out.close();
+            return !out.fail();
+        }
+};
+
+/* ----------- INTERPRETER ----------- */
+
+class Interpreter : public NodeVisitor {
+    private:
+        FrameStack frames;
+        SymbolMap<FunctionNode*> functions;  // Holds function definitions
+        uint32_t epoch = newDefinitionEpoch();
+        bool returning = false;  // A return statement ran; unwind to the enclosing call
+        int returnValue = 0;
+
+        // A tail call waiting for the enclosing callFunction to run it in place; its
+        // arguments are already staged from tailMark
+        FunctionNode* tailCallee = nullptr;
+        size_t tailMark = 0;
+        bool tailDiscards = false;  // Made as a statement: the caller still returns None
+        CallStats stats;
+        Profiler* profiler = nullptr;
+
+
+    public:
+        explicit Interpreter(size_t maxDepth = DEFAULT_MAX_DEPTH) : frames(maxDepth) {}
+
+        void interpret(ASTNode* root) {
+            root->accept(this);  // Start interpretation from the root node
+            returning = false;   // A stray top-level return only ends its own statement
+        }
+
+        const CallStats& getStats() const {
+            return stats;
+        }
+
+        void setProfiler(Profiler* p) {
+            profiler = p;
+        }
+
+        void visit(IntNode* node) override {}
+
+        void visit(StringNode* node) override {}
+
+        void visit(ReturnNode* node) override{
+            if (frames.depth() > 0 && node->getValue()->getType() == ASTNodeType::FunctionCall) {
+                prepareTailCall(dynamic_cast<FunctionCallNode*>(node->getValue()), false);
+                return;
+            }
+            returnValue = evaluate(node->getValue());
+            returning = true;
+            TRACE(Interpreter, Debug, Return, returnValue, 0);
+        }
+        
+        void visit(IdentifierNode* node) override {
+            try {
+                frames.getVariable(node->getIdentifier());
+
+
+            } catch (const std::runtime_error& e) {
+                Output::instance().flush();  // Keep it after what was printed before
+                std::cerr << "Runtime Error: " << e.what() << std::endl;
+            }
+        }
+
+        void visit(AssignNode* node) override {
+
+            // Evaluate the right-hand side and assign to the identifier in the current scope
+            int value = evaluate(node->getValue());
+            frames.setVariable(node->getIdentifier(), value);
+
+            // Debugging 
+            //std::cout << "Assigned " << node->getIdentifier() << " = " << value << std::endl;
+        }
+
+        void visit(PrintNode* node) override {
+            printExpressions(node);
+        }
+
+
+        void visit(BinaryOpNode* node) override {
+            int result = evaluate(node);
+            TRACE(Interpreter, Verbose, BinaryOp, node->getOp(), result);
+        }
+
+        void visit(UnaryOpNode* node) override {
+            evaluate(node);
+        }
+
+        void visit(IfNode* node) override {
+            executeIf(node, false);
+        }
+
+        void visit(BlockNode* node) override {
+            executeBlock(node);
+        }
+        
+        void visit(FunctionNode* node) override {
+            TRACE(Interpreter, Debug, FunctionDef, node->getParameters().size(), 0);
+            functions.set(node->getName(), node);
+            epoch = newDefinitionEpoch();  // Call sites resolved before this def look again
+        }
+
+        void visit(FunctionCallNode* node) override {
+            callFunction(node);  // Result discarded
+        }
+
+        // Implement other visit methods...
+  
+    private:
+        // Runs statements until one of them (or a nested block) executes a return.
+        // `tail`: the block is the last thing its function runs.
+        void executeBlock(BlockNode* block, bool tail = false) {
+            const NodeList& statements = block->getStatements();
+            for (size_t i = 0; i < statements.size(); ++i) {
+                if (tail && i + 1 == statements.size()) {
+                    executeTail(statements[i]);
+                    return;
+                }
+                statements[i]->accept(this);
+                if (returning) return;
+            }
+        }
+
+        // The last statement of a function body: a call here can reuse the frame
+        void executeTail(ASTNode* stmt) {
+            switch (stmt->getType()) {
+                case ASTNodeType::FunctionCall:
+                    prepareTailCall(dynamic_cast<FunctionCallNode*>(stmt), true);
+                    break;
+                case ASTNodeType::If:
+                    executeIf(dynamic_cast<IfNode*>(stmt), true);
+                    break;
+                case ASTNodeType::Block:
+                    executeBlock(dynamic_cast<BlockNode*>(stmt), true);
+                    break;
+                default:
+                    stmt->accept(this);
+                    break;
+            }
+        }
+
+        void executeIf(IfNode* node, bool tail) {
+            int conditionResult = evaluate(node->getCondition()); // Are you a 0 or a 1?
+            TRACE(Interpreter, Debug, IfCondition, conditionResult, 0);
+
+            // If the condition is true, execute the thenBranch
+            if (conditionResult) {
+                TRACE(Interpreter, Debug, Branch, 1, 0);
+                executeBlock(node->getThenBranch(), tail);
+
+            } else if (node->getElseBranch()) {
+                TRACE(Interpreter, Debug, Branch, 0, 0);
+                executeBlock(node->getElseBranch(), tail);
+
+            } else {
+                TRACE(Interpreter, Debug, Branch, -1, 0);
+            }
+        }
+
+        // Evaluates a tail call's arguments and unwinds like a return; callFunction then
+        // swaps the callee in for the current frame instead of nesting another one
+        void prepareTailCall(FunctionCallNode* node, bool discard) {
+            TRACE(Interpreter, Debug, FunctionCall, node->getArguments().size(), 1);
+            FunctionNode* funcDef = resolveCall(node);
+
+            size_t mark = frames.argumentMark();
+            for (ASTNode* arg : node->getArguments()) {
+                frames.stageArgument(evaluate(arg));
+            }
+            tailCallee = funcDef;
+            tailMark = mark;
+            tailDiscards = discard;
+            returning = true;
+        }
+
+        int callFunction(FunctionCallNode* node) {
+            TRACE(Interpreter, Debug, FunctionCall, node->getArguments().size(), 0);
+            FunctionNode* funcDef = resolveCall(node);
+
+            // Evaluate the arguments in the caller, then open the callee's frame with them.
+            // The callee sees its own names and the globals, as in Python.
+            size_t mark = frames.argumentMark();
+            for (ASTNode* arg : node->getArguments()) {
+                frames.stageArgument(evaluate(arg));
+            }
+            frames.pushFrame(mark, funcDef->getParameters().begin(), funcDef->getParameters().size());
+            stats.enter(frames.depth());
+            if (profiler) profiler->enterFunction(funcDef->getName());
+
+            // Tail calls come back here and run in the same frame, one after another
+            bool discard = false;
+            for (;;) {
+                executeBlock(funcDef->getBody(), true);
+                if (!tailCallee) break;
+
+                funcDef = tailCallee;
+                tailCallee = nullptr;
+                discard = discard || tailDiscards;
+                returning = false;
+                frames.replaceFrame(tailMark, funcDef->getParameters().begin(), funcDef->getParameters().size());
+                stats.enter(frames.depth());
+                stats.tailCalls++;
+                if (profiler) profiler->tailCall(funcDef->getName());
+            }
+
+            // Falling off the end returns None, which is 0 here
+            int result = returning && !discard ? returnValue : 0;
+            returning = false;
+            frames.popFrame();
+            if (profiler) profiler->exitFunction();
+            return result;
+        }
+
+        // Retrieve the function definition, unless this call site already knows it
+        FunctionNode* resolveCall(FunctionCallNode* node) {
+            CallSiteCache<FunctionNode*>& cache = node->getCallCache();
+            if (cache.epoch != epoch) {
+                FunctionNode* const* found = functions.find(node->getName());
+                if (found == nullptr) {
+                    throw std::runtime_error("Function not defined: " + symbolName(node->getName()));
+                }
+
+                // Check if argument sizes match
+                if ((*found)->getParameters().size() != node->getArguments().size()) {
+                    throw std::runtime_error("Argument size mismatch");
+                }
+                cache.target = *found;
+                cache.epoch = epoch;
+            }
+            return cache.target;
+        }
+
+        // Arguments separated by single spaces, like Python's print
+        void printExpressions(PrintNode* node) {
+            Output& out = Output::instance();
+            bool separate = false;
+
+            for (const auto& expr : node->getExpressions()) { // Determining the type of expr and handling it accordingly
+
+                if (expr->getType() == ASTNodeType::String) {
+                    StringNode* strNode = dynamic_cast<StringNode*>(expr);
+                    if (separate) out.space();
+                    out.write(strNode->getValue());
+                } else {
+                    if (separate) out.space();
+                    out.integer(evaluate(expr));
+                }
+                separate = true;
+
+            }
+
+            out.endLine();
+        }
+
+        int evaluate(ASTNode* node) {
+            switch (node->getType()) {
+                case ASTNodeType::Int:
+                    return dynamic_cast<IntNode*>(node)->getValue();
+
+                case ASTNodeType::Identifier:
+                    return frames.getVariable(dynamic_cast<IdentifierNode*>(node)->getIdentifier());
+
+                case ASTNodeType::BinaryOp: {
+        
+                    BinaryOpNode* binNode = dynamic_cast<BinaryOpNode*>(node);
+                    
+                    int left = evaluate(binNode->getLeft());
+
+                    // 'and' / 'or' short-circuit and yield the deciding operand, like Python
+                    if (binNode->getOp() == '&' && !left) return left;
+                    if (binNode->getOp() == '|' && left) return left;
+
+                    int right = evaluate(binNode->getRight());
+
+                    return evaluateBinaryOperation(binNode->getOp(), left, right);
+                    
+                }
+                case ASTNodeType::UnaryOp: {
+                    UnaryOpNode* unaryNode = dynamic_cast<UnaryOpNode*>(node);
+                    int operand = evaluate(unaryNode->getOperand());
+                    return unaryNode->getOp() == '-' ? -operand : !operand;
+                }
+                case ASTNodeType::Return: {
+                    ReturnNode* returnNode = dynamic_cast<ReturnNode*>(node);
+                    return evaluate(returnNode->getValue());
+                }
+                case ASTNodeType::FunctionCall:
+                    return callFunction(dynamic_cast<FunctionCallNode*>(node));
+
+                case ASTNodeType::Print: {
+                    printExpressions(dynamic_cast<PrintNode*>(node));
+                    return 0;
+                }
+                case ASTNodeType::If: {
+                    visit(dynamic_cast<IfNode*>(node));
+                    return 0;
+                }
+                case ASTNodeType::Block: {
+                    executeBlock(dynamic_cast<BlockNode*>(node));
+                    return 0;
+                }
+                case ASTNodeType::Assign: {
+                    AssignNode* assignNode = dynamic_cast<AssignNode*>(node);
+                    int value = evaluate(assignNode->getValue());
+                    frames.setVariable(assignNode->getIdentifier(), value);
+                    return 0;
+                }
+                case ASTNodeType::Function: {
+                    FunctionNode* funcNode = dynamic_cast<FunctionNode*>(node);
+                    TRACE(Interpreter, Debug, FunctionDef, funcNode->getParameters().size(), 0);
+                    return 0;
+                }
+                case ASTNodeType::String:
+                    return 0;
+                
+
+                default:
+                    throw std::runtime_error("Evaluation error: Unknown node type or unsupported node type in evaluate.");
+            }
+
+            // This return should never be reached because all cases should be handled above.
+            throw std::runtime_error("Unexpected error in evaluate function.");
+        }
+
+
+
+};
+
+
+
+/* ----------- FLAT AST ----------- */
+// The same tree as the pointer AST, packed into parallel arrays: one kind, one op and two
+// 32-bit operands per node, with children addressed by index. Literals, symbol ids and
+// child lists live in side tables. No vtables and no pointers, so a walk stays inside a
+// few contiguous arrays and the whole thing can be written out as-is.
+//
+// What the operands mean depends on the kind:
+//   Int           first = index into ints
+//   String        first = offset into chars, second = length
+//   Identifier    first = symbol
+//   Assign        first = symbol, second = value node
+//   BinaryOp      first = left, second = right, op = operator code
+//   UnaryOp       first = operand, op = '-' or '!'
+//   Return        first = value node
+//   Print, Block  second = list in extra
+//   FunctionCall  first = symbol, second = argument list in extra
+//   If            first = condition, second = k: extra[k] = then block, extra[k+1] = else or NO_NODE
+//   Function      first = symbol, second = k: extra[k] = body, extra[k+1..] = parameter list
+// A list in extra is a count followed by that many entries.
+//
+// Nodes are appended children first, so any index is larger than those of its children
+// and a plain 0..size() loop is a bottom-up pass.
+
+typedef uint32_t FlatIndex;
+const FlatIndex NO_NODE = UINT32_MAX;
+
+// A run of indices (or symbol ids) inside FlatAst::extra
+struct FlatSpan {
+    const uint32_t* items;
+    uint32_t count;
+
+    const uint32_t* begin() const { return items; }
+    const uint32_t* end() const { return items + count; }
+    uint32_t size() const { return count; }
+    uint32_t operator[](size_t i) const { return items[i]; }
+};
+
+class FlatAst {
+    public:
+        FlatIndex root = NO_NODE;  // Block holding the top-level statements
+
+        size_t size() const {
+            return kinds.size();
+        }
+
+        ASTNodeType kind(FlatIndex node) const {
+            return static_cast<ASTNodeType>(kinds[node]);
+        }
+
+        char op(FlatIndex node) const {
+            return static_cast<char>(ops[node]);
+        }
+
+        FlatIndex first(FlatIndex node) const {
+            return firsts[node];
+        }
+
+        FlatIndex second(FlatIndex node) const {
+            return seconds[node];
+        }
+
+        /* --- Per-kind accessors --- */
+        int intValue(FlatIndex node) const {
+            return ints[firsts[node]];
+        }
+
+        StringRef stringValue(FlatIndex node) const {
+            return StringRef(chars.data() + firsts[node], seconds[node]);
+        }
+
+        SymbolId symbol(FlatIndex node) const {
+            return firsts[node];
+        }
+
+        // Statements of a Block, expressions of a Print, arguments of a FunctionCall
+        FlatSpan list(FlatIndex node) const {
+            return listAt(seconds[node]);
+        }
+
+        FlatIndex thenBranch(FlatIndex node) const {
+            return extra[seconds[node]];
+        }
+
+        FlatIndex elseBranch(FlatIndex node) const {
+            return extra[seconds[node] + 1];
+        }
+
+        FlatIndex body(FlatIndex node) const {
+            return extra[seconds[node]];
+        }
+
+        FlatSpan parameters(FlatIndex node) const {
+            return listAt(seconds[node] + 1);
+        }
+
+        // Calls f(child) for each child node, in evaluation order
+        template <typename F>
+        void forEachChild(FlatIndex node, F f) const {
+            switch (kind(node)) {
+                case ASTNodeType::Assign:
+                    f(seconds[node]);
+                    break;
+                case ASTNodeType::BinaryOp:
+                    f(firsts[node]);
+                    f(seconds[node]);
+                    break;
+                case ASTNodeType::UnaryOp:
+                case ASTNodeType::Return:
+                    f(firsts[node]);
+                    break;
+                case ASTNodeType::Print:
+                case ASTNodeType::Block:
+                case ASTNodeType::FunctionCall:
+                    for (FlatIndex child : list(node)) f(child);
+                    break;
+                case ASTNodeType::If:
+                    f(firsts[node]);
+                    f(thenBranch(node));
+                    if (elseBranch(node) != NO_NODE) f(elseBranch(node));
+                    break;
+                case ASTNodeType::Function:
+                    f(body(node));
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        /* --- Building --- */
+        FlatIndex add(ASTNodeType kind, char op, uint32_t first, uint32_t second) {
+            kinds.push_back(static_cast<uint8_t>(kind));
+            ops.push_back(static_cast<uint8_t>(op));
+            firsts.push_back(first);
+            seconds.push_back(second);
+            return static_cast<FlatIndex>(kinds.size() - 1);
+        }
+
+        uint32_t addInt(int value) {
+            ints.push_back(value);
+            return static_cast<uint32_t>(ints.size() - 1);
+        }
+
+        uint32_t addChars(StringRef text) {
+            uint32_t offset = static_cast<uint32_t>(chars.size());
+            chars.insert(chars.end(), text.data, text.data + text.size);
+            return offset;
+        }
+
+        // Appends raw words to extra and returns where they start
+        uint32_t addExtra(const uint32_t* words, size_t count) {
+            uint32_t offset = static_cast<uint32_t>(extra.size());
+            extra.insert(extra.end(), words, words + count);
+            return offset;
+        }
+
+        uint32_t addList(const std::vector<uint32_t>& items) {
+            uint32_t offset = static_cast<uint32_t>(extra.size());
+            extra.push_back(static_cast<uint32_t>(items.size()));
+            extra.insert(extra.end(), items.begin(), items.end());
+            return offset;
+        }
+
+        size_t bytesUsed() const {
+            return kinds.size() * (sizeof(uint8_t) * 2 + sizeof(uint32_t) * 2)
+                 + ints.size() * sizeof(int32_t) + chars.size() + extra.size() * sizeof(uint32_t);
+        }
+
+        /* --- Serialization --- */
+        // Every array is written as a length and its raw bytes, followed by the names of the
+        // symbols so ids can be re-interned on load (they are only stable within one run).
+        void serialize(std::string& out) const {
+            putWord(out, FORMAT_MAGIC);
+            putWord(out, root);
+            putArray(out, kinds);
+            putArray(out, ops);
+            putArray(out, firsts);
+            putArray(out, seconds);
+            putArray(out, ints);
+            putArray(out, chars);
+            putArray(out, extra);
+
+            SymbolTable& symbols = SymbolTable::instance();
+            putWord(out, static_cast<uint32_t>(symbols.size()));
+            for (SymbolId id = 0; id < symbols.size(); ++id) {
+                const std::string& name = symbols.name(id);
+                putWord(out, static_cast<uint32_t>(name.size()));
+                out.append(name);
+            }
+        }
+
+        static FlatAst deserialize(const char* data, size_t size) {
+            Reader in{data, data + size};
+            if (in.word() != FORMAT_MAGIC) throw std::runtime_error("Flat AST: bad header");
+
+            FlatAst ast;
+            ast.root = in.word();
+            in.array(ast.kinds);
+            in.array(ast.ops);
+            in.array(ast.firsts);
+            in.array(ast.seconds);
+            in.array(ast.ints);
+            in.array(ast.chars);
+            in.array(ast.extra);
+
+            std::vector<SymbolId> remap(in.word());
+            for (SymbolId& id : remap) {
+                uint32_t length = in.word();
+                id = SymbolTable::instance().intern(StringRef(in.bytes(length), length));
+            }
+            ast.validate(remap);
+            return ast;
+        }
+
+    private:
+        static const uint32_t FORMAT_MAGIC = 0x31415046;  // "FPA1"
+
+        std::vector<uint8_t> kinds;
+        std::vector<uint8_t> ops;
+        std::vector<uint32_t> firsts;
+        std::vector<uint32_t> seconds;
+        std::vector<int32_t> ints;
+        std::vector<char> chars;
+        std::vector<uint32_t> extra;
+
+        FlatSpan listAt(uint32_t offset) const {
+            return FlatSpan{extra.data() + offset + 1, extra[offset]};
+        }
+
+        template <typename T>
+        static void putArray(std::string& out, const std::vector<T>& items) {
+            putWord(out, static_cast<uint32_t>(items.size()));
+            out.append(reinterpret_cast<const char*>(items.data()), items.size() * sizeof(T));
+        }
+
+        static void putWord(std::string& out, uint32_t word) {
+            out.append(reinterpret_cast<const char*>(&word), sizeof(word));
+        }
+
+        struct Reader {
+            const char* cursor;
+            const char* limit;
+
+            const char* bytes(size_t count) {
+                if (static_cast<size_t>(limit - cursor) < count) throw std::runtime_error("Flat AST: truncated");
+                const char* start = cursor;
+                cursor += count;
+                return start;
+            }
+
+            uint32_t word() {
+                uint32_t value;
+                std::memcpy(&value, bytes(sizeof(value)), sizeof(value));
+                return value;
+            }
+
+            template <typename T>
+            void array(std::vector<T>& items) {
+                uint32_t count = word();
+                items.resize(count);
+                if (count) std::memcpy(items.data(), bytes(count * sizeof(T)), count * sizeof(T));
+            }
+        };
+
+        // Bounds-checks every index a walk could follow and translates stored symbol ids
+        // into this run's ids. A corrupt file throws here instead of crashing later.
+        void validate(const std::vector<SymbolId>& remap) {
+            size_t n = kinds.size();
+            auto check = [](bool ok) {
+                if (!ok) throw std::runtime_error("Flat AST: corrupt node data");
+            };
+            auto checkList = [&](uint32_t offset) {
+                check(offset < extra.size() && extra[offset] <= extra.size() - offset - 1);
+            };
+            auto translate = [&](uint32_t& id) {
+                check(id < remap.size());
+                id = remap[id];
+            };
+
+            check(ops.size() == n && firsts.size() == n && seconds.size() == n);
+            check(root < n && kind(root) == ASTNodeType::Block);
+            for (FlatIndex node = 0; node < n; ++node) {
+                switch (kind(node)) {
+                    case ASTNodeType::Int:
+                        check(firsts[node] < ints.size());
+                        break;
+                    case ASTNodeType::String:
+                        check(firsts[node] <= chars.size() && seconds[node] <= chars.size() - firsts[node]);
+                        break;
+                    case ASTNodeType::Identifier:
+                        translate(firsts[node]);
+                        break;
+                    case ASTNodeType::Assign:
+                        translate(firsts[node]);
+                        check(seconds[node] < node);
+                        break;
+                    case ASTNodeType::BinaryOp:
+                        check(firsts[node] < node && seconds[node] < node);
+                        break;
+                    case ASTNodeType::UnaryOp:
+                    case ASTNodeType::Return:
+                        check(firsts[node] < node);
+                        break;
+                    case ASTNodeType::FunctionCall:
+                        translate(firsts[node]);
+                        // Fall through
+                    case ASTNodeType::Print:
+                    case ASTNodeType::Block:
+                        checkList(seconds[node]);
+                        for (FlatIndex child : list(node)) check(child < node);
+                        break;
+                    case ASTNodeType::If:
+                        check(firsts[node] < node && seconds[node] + 1 < extra.size());
+                        check(thenBranch(node) < node && kind(thenBranch(node)) == ASTNodeType::Block);
+                        check(elseBranch(node) == NO_NODE || (elseBranch(node) < node && kind(elseBranch(node)) == ASTNodeType::Block));
+                        break;
+                    case ASTNodeType::Function: {
+                        translate(firsts[node]);
+                        check(seconds[node] < extra.size());
+                        check(body(node) < node && kind(body(node)) == ASTNodeType::Block);
+                        checkList(seconds[node] + 1);
+                        uint32_t* params = extra.data() + seconds[node] + 2;
+                        for (uint32_t i = 0; i < extra[seconds[node] + 1]; ++i) translate(params[i]);
+                        break;
+                    }
+                    default:
+                        check(false);
+                }
+            }
+        }
+};
+
+// Lowers the pointer AST into a FlatAst. Each visit leaves the new node's index in `result`.
+class FlatAstBuilder : public NodeVisitor {
+    public:
+        static FlatAst build(const NodeList& program) {
+            FlatAstBuilder builder;
+            std::vector<uint32_t> statements;
+            for (ASTNode* node : program) statements.push_back(builder.lower(node));
+            builder.ast.root = builder.ast.add(ASTNodeType::Block, 0, 0, builder.ast.addList(statements));
+            return std::move(builder.ast);
+        }
+
+        void visit(IntNode* node) override {
+            result = ast.add(ASTNodeType::Int, 0, ast.addInt(node->getValue()), 0);
+        }
+
+        void visit(StringNode* node) override {
+            StringRef text = node->getValue();
+            result = ast.add(ASTNodeType::String, 0, ast.addChars(text), static_cast<uint32_t>(text.size));
+        }
+
+        void visit(IdentifierNode* node) override {
+            result = ast.add(ASTNodeType::Identifier, 0, node->getIdentifier(), 0);
+        }
+
+        void visit(AssignNode* node) override {
+            FlatIndex value = lower(node->getValue());
+            result = ast.add(ASTNodeType::Assign, 0, node->getIdentifier(), value);
+        }
+
+        void visit(PrintNode* node) override {
+            result = ast.add(ASTNodeType::Print, 0, 0, lowerList(node->getExpressions()));
+        }
+
+        void visit(BinaryOpNode* node) override {
+            FlatIndex left = lower(node->getLeft());
+            FlatIndex right = lower(node->getRight());
+            result = ast.add(ASTNodeType::BinaryOp, node->getOp(), left, right);
+        }
+
+        void visit(UnaryOpNode* node) override {
+            FlatIndex operand = lower(node->getOperand());
+            result = ast.add(ASTNodeType::UnaryOp, node->getOp(), operand, 0);
+        }
+
+        void visit(IfNode* node) override {
+            FlatIndex condition = lower(node->getCondition());
+            uint32_t branches[2] = {lower(node->getThenBranch()), NO_NODE};
+            if (node->getElseBranch()) branches[1] = lower(node->getElseBranch());
+            result = ast.add(ASTNodeType::If, 0, condition, ast.addExtra(branches, 2));
+        }
+
+        void visit(BlockNode* node) override {
+            result = ast.add(ASTNodeType::Block, 0, 0, lowerList(node->getStatements()));
+        }
+
+        void visit(FunctionNode* node) override {
+            FlatIndex body = lower(node->getBody());
+            uint32_t offset = ast.addExtra(&body, 1);
+            const ArenaArray<SymbolId>& params = node->getParameters();
+            ast.addList(std::vector<uint32_t>(params.begin(), params.end()));
+            result = ast.add(ASTNodeType::Function, 0, node->getName(), offset);
+        }
+
+        void visit(ReturnNode* node) override {
+            FlatIndex value = lower(node->getValue());
+            result = ast.add(ASTNodeType::Return, 0, value, 0);
+        }
+
+        void visit(FunctionCallNode* node) override {
+            result = ast.add(ASTNodeType::FunctionCall, 0, node->getName(), lowerList(node->getArguments()));
+        }
+
+    private:
+        FlatAst ast;
+        FlatIndex result = NO_NODE;
+
+        FlatIndex lower(ASTNode* node) {
+            node->accept(this);
+            return result;
+        }
+
+        uint32_t lowerList(const NodeList& nodes) {
+            std::vector<uint32_t> items;  // Children first; the list itself goes in after them
+            for (ASTNode* node : nodes) items.push_back(lower(node));
+            return ast.addList(items);
+        }
+};
+
+/* ----------- RESOLVER ----------- */
+// Decides, once per program, where every name lives. Python's rule: inside a function a
+// name is local if the function assigns it anywhere in its body (or takes it as a
+// parameter), and global otherwise. Locals get fixed frame slots, parameters first, so
+// the engines read them with one indexed load; only globals go through a SymbolMap.
+// A local read before its first assignment falls back to the global of that name, the
+// same as a Scope miss falling through to the global scope.
+
+const uint32_t GLOBAL_NAME = UINT32_MAX;  // Slot of a name that isn't a local
+
+struct FrameLayout {
+    uint32_t params = 0;
+    std::vector<SymbolId> slotNames;  // Indexed by slot
+};
+
+class Resolution {
+    public:
+        // For Identifier and Assign nodes: the frame slot, or GLOBAL_NAME
+        uint32_t slot(FlatIndex node) const {
+            return slots[node];
+        }
+
+        // For Function nodes
+        const FrameLayout& layout(FlatIndex function) const {
+            return layouts[slots[function]];
+        }
+
+    private:
+        friend class Resolver;
+        std::vector<uint32_t> slots;  // Per node; for Function nodes, the index into layouts
+        std::vector<FrameLayout> layouts;
+};
+
+class Resolver {
+    public:
+        static Resolution resolve(const FlatAst& ast) {
+            Resolver resolver(ast);
+            resolver.result.slots.assign(ast.size(), GLOBAL_NAME);
+            resolver.visit(ast.root);
+            return std::move(resolver.result);
+        }
+
+    private:
+        const FlatAst& ast;
+        Resolution result;
+        const SymbolMap<uint32_t>* locals = nullptr;  // Of the function being resolved; nullptr at top level
+
+        explicit Resolver(const FlatAst& ast) : ast(ast) {}
+
+        void visit(FlatIndex node) {
+            switch (ast.kind(node)) {
+                case ASTNodeType::Identifier:
+                case ASTNodeType::Assign:
+                    if (locals) {
+                        if (const uint32_t* slot = locals->find(ast.symbol(node))) result.slots[node] = *slot;
+                    }
+                    break;
+                case ASTNodeType::Function:
+                    function(node);
+                    return;  // The body was resolved against the function's own locals
+                default:
+                    break;
+            }
+            ast.forEachChild(node, [this](FlatIndex child) { visit(child); });
+        }
+
+        void function(FlatIndex node) {
+            FrameLayout layout;
+            SymbolMap<uint32_t> slotOf;
+            for (SymbolId param : ast.parameters(node)) addSlot(layout, slotOf, param);
+            layout.params = static_cast<uint32_t>(layout.slotNames.size());
+            collectAssigned(layout, slotOf, ast.body(node));
+
+            result.slots[node] = static_cast<uint32_t>(result.layouts.size());
+            result.layouts.push_back(std::move(layout));
+
+            // A nested def sees only its own locals and the globals (no closures)
+            const SymbolMap<uint32_t>* outer = locals;
+            locals = &slotOf;
+            visit(ast.body(node));
+            locals = outer;
+        }
+
+        static void addSlot(FrameLayout& layout, SymbolMap<uint32_t>& slotOf, SymbolId name) {
+            if (slotOf.find(name)) return;
+            slotOf.set(name, static_cast<uint32_t>(layout.slotNames.size()));
+            layout.slotNames.push_back(name);
+        }
+
+        void collectAssigned(FrameLayout& layout, SymbolMap<uint32_t>& slotOf, FlatIndex node) {
+            if (ast.kind(node) == ASTNodeType::Function) return;  // Its body is another frame
+            if (ast.kind(node) == ASTNodeType::Assign) addSlot(layout, slotOf, ast.symbol(node));
+            ast.forEachChild(node, [&](FlatIndex child) { collectAssigned(layout, slotOf, child); });
+        }
+};
+
+/* ----------- PURITY ----------- */
+// --memoize: a function is pure when its result depends only on its arguments. The body
+// prints nothing, defines no functions, assigns only its own locals, reads only its
+// parameters and locals it has already assigned, and calls only pure functions. Calls to
+// a pure function are then looked up in a table of earlier results first.
+//
+// Functions are bound by name at run time, so purity is decided per name as well: a call
+// site can use the table only if every def of the name it calls is pure. Calling another
+// name reads its binding, though, and a table keyed by arguments alone would keep
+// answering for the old one after a new def of the callee, so other functions may only
+// be called if their name has exactly one def. Calls to a function's own name are fine
+// (nothing can rebind it while a pure body runs), and so is mutual recursion: everything
+// starts out pure and the analysis strikes functions until nothing changes.
+
+class Purity {
+    public:
+        bool pure(FlatIndex function) const {
+            return pureFunctions.count(function) != 0;
+        }
+
+        // Every def of `name` is pure, so a call through it can be memoized
+        bool pureName(SymbolId name) const {
+            const uint8_t* pure = pureNames.find(name);
+            return pure && *pure;
+        }
+
+    private:
+        friend class PurityAnalyzer;
+        std::unordered_set<FlatIndex> pureFunctions;
+        SymbolMap<uint8_t> pureNames;  // SymbolMap<bool> would sit on a vector<bool>
+};
+
+class PurityAnalyzer {
+    public:
+        static Purity analyze(const FlatAst& ast, const Resolution& names) {
+            return PurityAnalyzer(ast, names).run();
+        }
+
+    private:
+        const FlatAst& ast;
+        const Resolution& names;
+        std::vector<FlatIndex> functions;  // Every def, nested ones included
+        SymbolMap<uint32_t> defCounts;
+
+        PurityAnalyzer(const FlatAst& ast, const Resolution& names) : ast(ast), names(names) {}
+
+        Purity run() {
+            collectFunctions(ast.root);
+            for (FlatIndex function : functions) {
+                const uint32_t* count = defCounts.find(ast.symbol(function));
+                defCounts.set(ast.symbol(function), count ? *count + 1 : 1);
+            }
+
+            // Functions that pass on their own, with the names each of them calls
+            std::vector<FlatIndex> candidates;
+            std::vector<std::vector<SymbolId>> callees;
+            for (FlatIndex function : functions) {
+                std::vector<SymbolId> called;
+                if (!bodyIsPure(function, called)) continue;
+                candidates.push_back(function);
+                callees.push_back(std::move(called));
+            }
+
+            Purity result;
+            result.pureFunctions.insert(candidates.begin(), candidates.end());
+            for (bool changed = true; changed; ) {
+                nameFlags(result);
+                changed = false;
+                for (size_t i = 0; i < candidates.size(); ++i) {
+                    if (!result.pure(candidates[i])) continue;
+                    SymbolId self = ast.symbol(candidates[i]);
+                    for (SymbolId callee : callees[i]) {
+                        if (result.pureName(callee) && (callee == self || *defCounts.find(callee) == 1)) continue;
+                        result.pureFunctions.erase(candidates[i]);
+                        changed = true;
+                        break;
+                    }
+                }
+            }
+            return result;
+        }
+
+        void collectFunctions(FlatIndex node) {
+            if (ast.kind(node) == ASTNodeType::Function) functions.push_back(node);
+            ast.forEachChild(node, [this](FlatIndex child) { collectFunctions(child); });
+        }
+
+        // A name is pure while all its defs are
+        void nameFlags(Purity& result) const {
+            result.pureNames = SymbolMap<uint8_t>();
+            for (FlatIndex function : functions) {
+                const uint8_t* seen = result.pureNames.find(ast.symbol(function));
+                result.pureNames.set(ast.symbol(function), (!seen || *seen) && result.pure(function));
+            }
+        }
+
+        // The checks that don't depend on other functions. A local counts as assigned only
+        // after an assignment at the top level of the body: one inside an `if` may not
+        // have run, and the read would then see the global of that name.
+        bool bodyIsPure(FlatIndex function, std::vector<SymbolId>& called) const {
+            const FrameLayout& layout = names.layout(function);
+            std::vector<bool> assigned(layout.slotNames.size(), false);
+            std::fill(assigned.begin(), assigned.begin() + layout.params, true);
+
+            for (FlatIndex stmt : ast.list(ast.body(function))) {
+                if (!isPure(stmt, assigned, called)) return false;
+                if (ast.kind(stmt) == ASTNodeType::Assign) assigned[names.slot(stmt)] = true;
+            }
+            return true;
+        }
+
+        bool isPure(FlatIndex node, const std::vector<bool>& assigned, std::vector<SymbolId>& called) const {
+            switch (ast.kind(node)) {
+                case ASTNodeType::Print:
+                case ASTNodeType::Function:
+                    return false;
+                case ASTNodeType::Identifier:
+                    if (names.slot(node) == GLOBAL_NAME || !assigned[names.slot(node)]) return false;
+                    break;
+                case ASTNodeType::Assign:
+                    if (names.slot(node) == GLOBAL_NAME) return false;
+                    break;
+                case ASTNodeType::FunctionCall:
+                    called.push_back(ast.symbol(node));
+                    break;
+                default:
+                    break;
+            }
+            bool pure = true;
+            ast.forEachChild(node, [&](FlatIndex child) { pure = pure && isPure(child, assigned, called); });
+            return pure;
+        }
+};
+
+/* --- Memo tables --- */
+const uint32_t MEMO_MAX_ARITY = 8;               // Keys are kept inline; wider functions aren't memoized
+const size_t DEFAULT_MEMO_ENTRIES = 1 << 16;     // Per function
+
+// Earlier results of one pure function, keyed by its arguments. Direct-mapped: each
+// argument tuple has exactly one entry it can live in, and storing a result evicts
+// whatever was there, so a table never grows past its entry count. The entries are
+// allocated on the first store.
+class MemoTable {
+    public:
+        MemoTable(SymbolId name, uint32_t arity, size_t entries) : name(name), arityCount(arity) {
+            size_t capacity = 1;
+            while (capacity < entries) capacity <<= 1;
+            mask = capacity - 1;
+        }
+
+        uint32_t arity() const {
+            return arityCount;
+        }
+
+        // Arguments are ints, whatever the engine keeps them in
+        template <typename Value>
+        bool find(const Value* args, int& result) {
+            if (!cells.empty()) {
+                const int* cell = &cells[index(args) * stride()];
+                if (cell[0] && std::equal(args, args + arityCount, cell + 2)) {
+                    result = cell[1];
+                    hits++;
+                    return true;
+                }
+            }
+            misses++;
+            return false;
+        }
+
+        template <typename Value>
+        void store(const Value* args, int result) {
+            if (cells.empty()) cells.assign((mask + 1) * stride(), 0);
+            int* cell = &cells[index(args) * stride()];
+            cell[0] = 1;
+            cell[1] = result;
+            for (uint32_t i = 0; i < arityCount; ++i) cell[2 + i] = static_cast<int>(args[i]);
+        }
+
+        uint64_t lookups() const {
+            return hits + misses;
+        }
+
+        void print(std::ostream& out) const {
+            out << "memo " << symbolName(name) << ": " << hits << " hits, " << misses << " misses ("
+                << (100 * hits / lookups()) << "% hit rate)" << std::endl;
+        }
+
+    private:
+        SymbolId name;
+        uint32_t arityCount;
+        size_t mask = 0;
+        std::vector<int> cells;  // Per entry: used flag, result, then the arguments
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+
+        size_t stride() const {
+            return 2 + arityCount;
+        }
+
+        template <typename Value>
+        size_t index(const Value* args) const {
+            uint64_t hash = arityCount;
+            for (uint32_t i = 0; i < arityCount; ++i) {
+                hash = (hash ^ static_cast<uint32_t>(args[i])) * 0x9E3779B97F4A7C15ull;
+            }
+            return static_cast<size_t>(hash >> 32) & mask;
+        }
+};
+
+// The memo tables of one run, one per pure function, made when first asked for
+class MemoCache {
+    public:
+        MemoCache(const FlatAst& ast, Purity purity, size_t entries) : ast(ast), purity(std::move(purity)), entries(entries) {}
+
+        // Whether call sites naming `name` should look results up
+        bool memoizes(SymbolId name) const {
+            return purity.pureName(name);
+        }
+
+        // nullptr for a function that isn't pure or takes too many arguments
+        MemoTable* table(FlatIndex function) {
+            auto found = byFunction.find(function);
+            if (found != byFunction.end()) return found->second;
+
+            MemoTable* table = nullptr;
+            uint32_t arity = ast.parameters(function).size();
+            if (purity.pure(function) && arity <= MEMO_MAX_ARITY) {
+                tables.emplace_back(ast.symbol(function), arity, entries);
+                table = &tables.back();
+            }
+            byFunction[function] = table;
+            return table;
+        }
+
+        void print(std::ostream& out) const {
+            for (const MemoTable& table : tables) {
+                if (table.lookups()) table.print(out);
+            }
+        }
+
+    private:
+        const FlatAst& ast;
+        Purity purity;
+        size_t entries;
+        std::deque<MemoTable> tables;  // Handed out by pointer, so they must not move
+        std::unordered_map<FlatIndex, MemoTable*> byFunction;
+};
+
+/* ----------- FLAT INTERPRETER ----------- */
+// Runs a FlatAst with the same semantics as Interpreter, switching on the kind byte
+// instead of going through accept() and dynamic_cast.
+class FlatInterpreter {
+    public:
+        FlatInterpreter(const FlatAst& ast, size_t maxDepth = DEFAULT_MAX_DEPTH, MemoCache* memo = nullptr)
+            : ast(ast), frames(maxDepth), callCaches(ast.size()), memo(memo) {}
+
+        void run() {
+            for (FlatIndex stmt : ast.list(ast.root)) {
+                execute(stmt);
+                returning = false;  // A stray top-level return only ends its own statement
+            }
+        }
+
+        const CallStats& getStats() const {
+            return stats;
+        }
+
+    private:
+        const FlatAst& ast;
+        FrameStack frames;
+        SymbolMap<FlatIndex> functions;
+        std::vector<CallSiteCache<FlatIndex>> callCaches;  // Indexed by call node
+        MemoCache* memo;  // nullptr unless memoizing
+        uint32_t epoch = 1;
+        bool returning = false;
+        int returnValue = 0;
+        FlatIndex tailCallee = NO_NODE;  // As in Interpreter: a tail call for callFunction to run in place
+        size_t tailMark = 0;
+        bool tailDiscards = false;
+        CallStats stats;
+
+        void execute(FlatIndex node, bool tail = false) {
+            switch (ast.kind(node)) {
+                case ASTNodeType::Assign:
+                    frames.setVariable(ast.symbol(node), evaluate(ast.second(node)));
+                    break;
+
+                case ASTNodeType::Print: {
+                    Output& out = Output::instance();
+                    bool separate = false;
+                    for (FlatIndex expr : ast.list(node)) {
+                        if (ast.kind(expr) == ASTNodeType::String) {
+                            if (separate) out.space();
+                            out.write(ast.stringValue(expr));
+                        } else {
+                            if (separate) out.space();
+                            out.integer(evaluate(expr));
+                        }
+                        separate = true;
+                    }
+                    out.endLine();
+                    break;
+                }
+
+                case ASTNodeType::If:
+                    if (evaluate(ast.first(node))) {
+                        executeBlock(ast.thenBranch(node), tail);
+                    } else if (ast.elseBranch(node) != NO_NODE) {
+                        executeBlock(ast.elseBranch(node), tail);
+                    }
+                    break;
+
+                case ASTNodeType::Block:
+                    executeBlock(node, tail);
+                    break;
+
+                case ASTNodeType::Function:
+                    functions.set(ast.symbol(node), node);
+                    epoch++;
+                    break;
+
+                case ASTNodeType::Return:
+                    if (frames.depth() > 0 && ast.kind(ast.first(node)) == ASTNodeType::FunctionCall) {
+                        prepareTailCall(ast.first(node), false);
+                        break;
+                    }
+                    returnValue = evaluate(ast.first(node));
+                    returning = true;
+                    break;
+
+                case ASTNodeType::FunctionCall:
+                    if (tail) {
+                        prepareTailCall(node, true);
+                    } else {
+                        callFunction(node);
+                    }
+                    break;
+
+                case ASTNodeType::Identifier:
+                    // Same as Interpreter: an undefined name on its own is reported, not fatal
+                    try {
+                        frames.getVariable(ast.symbol(node));
+                    } catch (const std::runtime_error& e) {
+                        Output::instance().flush();  // Keep it after what was printed before
+                        std::cerr << "Runtime Error: " << e.what() << std::endl;
+                    }
+                    break;
+
+                default:
+                    evaluate(node);  // Expression statement
+                    break;
+            }
+        }
+
+        // `tail`: the block is the last thing its function runs (see Interpreter::executeBlock)
+        void executeBlock(FlatIndex block, bool tail = false) {
+            FlatSpan statements = ast.list(block);
+            for (size_t i = 0; i < statements.size(); ++i) {
+                execute(statements[i], tail && i + 1 == statements.size());
+                if (returning) return;
+            }
+        }
+
+        int evaluate(FlatIndex node) {
+            switch (ast.kind(node)) {
+                case ASTNodeType::Int:
+                    return ast.intValue(node);
+
+                case ASTNodeType::Identifier:
+                    return frames.getVariable(ast.symbol(node));
+
+                case ASTNodeType::BinaryOp: {
+                    char op = ast.op(node);
+                    int left = evaluate(ast.first(node));
+                    if (op == '&' && !left) return left;
+                    if (op == '|' && left) return left;
+                    return evaluateBinaryOperation(op, left, evaluate(ast.second(node)));
+                }
+
+                case ASTNodeType::UnaryOp: {
+                    int operand = evaluate(ast.first(node));
+                    return ast.op(node) == '-' ? -operand : !operand;
+                }
+
+                case ASTNodeType::FunctionCall:
+                    return callFunction(node);
+
+                case ASTNodeType::String:
+                    return 0;
+
+                default:
+                    execute(node);
+                    return 0;
+            }
+        }
+
+        int callFunction(FlatIndex node) {
+            FlatIndex callee = resolveCall(node);
+            size_t mark = frames.argumentMark();
+            for (FlatIndex arg : ast.list(node)) frames.stageArgument(evaluate(arg));
+
+            MemoTable* table = memo ? memo->table(callee) : nullptr;
+            if (!table) return invoke(callee, mark);
+            int result;
+            if (table->find(frames.stagedArguments(mark), result)) {
+                frames.unstage(mark);
+                return result;
+            }
+            int key[MEMO_MAX_ARITY];
+            std::copy(frames.stagedArguments(mark), frames.stagedArguments(mark) + table->arity(), key);
+            result = invoke(callee, mark);
+            table->store(key, result);
+            return result;
+        }
+
+        // Runs a call whose arguments are staged from `mark`
+        int invoke(FlatIndex callee, size_t mark) {
+            FlatSpan params = ast.parameters(callee);
+            frames.pushFrame(mark, params.begin(), params.size());
+            stats.enter(frames.depth());
+
+            bool discard = false;
+            for (;;) {
+                executeBlock(ast.body(callee), true);
+                if (tailCallee == NO_NODE) break;
+
+                callee = tailCallee;
+                tailCallee = NO_NODE;
+                discard = discard || tailDiscards;
+                returning = false;
+                params = ast.parameters(callee);
+                frames.replaceFrame(tailMark, params.begin(), params.size());
+                stats.enter(frames.depth());
+                stats.tailCalls++;
+            }
+
+            int result = returning && !discard ? returnValue : 0;
+            returning = false;
+            frames.popFrame();
+            return result;
+        }
+
+        void prepareTailCall(FlatIndex node, bool discard) {
+            FlatIndex callee = resolveCall(node);
+            size_t mark = frames.argumentMark();
+            for (FlatIndex arg : ast.list(node)) frames.stageArgument(evaluate(arg));
+            tailCallee = callee;
+            tailMark = mark;
+            tailDiscards = discard;
+            returning = true;
+        }
+
+        FlatIndex resolveCall(FlatIndex node) {
+            CallSiteCache<FlatIndex>& cache = callCaches[node];
+            if (cache.epoch != epoch) {
+                const FlatIndex* found = functions.find(ast.symbol(node));
+                if (!found) {
+                    throw std::runtime_error("Function not defined: " + symbolName(ast.symbol(node)));
+                }
+                if (ast.parameters(*found).size() != ast.list(node).size()) {
+                    throw std::runtime_error("Argument size mismatch");
+                }
+                cache.target = *found;
+                cache.epoch = epoch;
+            }
+            return cache.target;
+        }
+};
+
+/* ----------- BYTECODE ----------- */
+// The default engine. The compiler turns a resolved FlatAst into one code array per function, and
+// the VM runs those with an explicit value stack and frame stack, so a script's call depth
+// never touches the C++ stack. Interpreter (--engine=tree) stays as the reference.
+//
+// Instructions are 32-bit words: opcode in the low byte, a 24-bit argument above it
+// (constant index, slot, symbol id, jump target or argument count).
+
+#define MYPYTHON_OPCODES(X) \
+    X(Const)           /* push constants[arg] */ \
+    X(LoadLocal)       /* push slot arg of this frame (the global if not assigned yet) */ \
+    X(StoreLocal)      /* pop into slot arg */ \
+    X(LoadGlobal)      /* push global arg (symbol) */ \
+    X(StoreGlobal)     /* pop into global arg (symbol) */ \
+    X(CheckName)       /* report an undefined name on stderr, like a bare `x` statement */ \
+    X(Add) X(Subtract) X(Multiply) \
+    X(Less) X(LessEqual) X(Greater) X(GreaterEqual) X(Equal) X(NotEqual) \
+    X(Binary)          /* other operators: arg is the BinaryOpNode operator code */ \
+    X(Negate) X(Not) \
+    X(Jump)            /* pc = arg */ \
+    X(JumpIfFalse)     /* pop; jump if zero */ \
+    X(JumpIfFalseOrPop) /* `and`: jump keeping the value if zero, else pop */ \
+    X(JumpIfTrueOrPop)  /* `or` */ \
+    X(LoadFunction)    /* arg = call site; push the function it resolves to (cached) */ \
+    X(Call)            /* arg = argument count; callee index sits below the arguments */ \
+    X(TailCall)        /* Call in tail position, reusing this frame; arg = count << 1 | discard flag */ \
+    X(MemoCall)        /* Call to a pure function: try its memo table first (--memoize) */ \
+    X(Return)          /* pop the result and leave the frame */ \
+    X(ReturnNone)      /* leave the frame with 0 */ \
+    X(Pop) \
+    X(DefineFunction)  /* bind functions[arg] to its name */ \
+    X(PrintString)     /* arg = string index << 1 | separator flag */ \
+    X(PrintValue)      /* pop and print; arg = separator flag */ \
+    X(PrintEnd) \
+    X(Halt)
+
+enum class Op : uint8_t {
+#define MYPYTHON_OP_ENUM(name) name,
+    MYPYTHON_OPCODES(MYPYTHON_OP_ENUM)
+#undef MYPYTHON_OP_ENUM
+    Count
+};
+
+const char* opName(Op op) {
+    static const char* const names[] = {
+#define MYPYTHON_OP_NAME(name) #name,
+        MYPYTHON_OPCODES(MYPYTHON_OP_NAME)
+#undef MYPYTHON_OP_NAME
+    };
+    return op < Op::Count ? names[static_cast<size_t>(op)] : "?";
+}
+
+const uint32_t MAX_OPERAND = (1u << 24) - 1;
+const int64_t UNSET_SLOT = INT64_MIN;  // Frame slot of a local not assigned yet; no int is ever this
+
+inline uint32_t encode(Op op, uint32_t arg = 0) {
+    return static_cast<uint32_t>(op) | (arg << 8);
+}
+
+inline Op opOf(uint32_t word) {
+    return static_cast<Op>(word & 0xff);
+}
+
+inline uint32_t argOf(uint32_t word) {
+    return word >> 8;
+}
+
+struct BytecodeFunction {
+    SymbolId name = NO_SYMBOL;
+    FlatIndex node = NO_NODE;         // The def it was compiled from; NO_NODE for the top level
+    uint32_t params = 0;
+    std::vector<SymbolId> slotNames;  // From the Resolver's FrameLayout
+    uint32_t maxStack = 0;            // Deepest the operand stack gets above the slots
+    std::vector<uint32_t> code;
+};
+
+struct CallSite {
+    SymbolId name;
+    uint32_t argCount;
+};
+
+struct BytecodeProgram {
+    std::vector<BytecodeFunction> functions;  // functions[0] is the top-level code
+    std::vector<CallSite> callSites;
+    std::vector<int> constants;
+    std::vector<std::string> strings;         // print() string literals
+
+    void disassemble(std::ostream& out) const {
+        for (const BytecodeFunction& fn : functions) {
+            out << (fn.name == NO_SYMBOL ? std::string("<module>") : symbolName(fn.name))
+                << ": params " << fn.params << ", slots " << fn.slotNames.size() << ", stack " << fn.maxStack << "\n";
+            for (size_t pc = 0; pc < fn.code.size(); ++pc) {
+                uint32_t word = fn.code[pc];
+                out << "  " << pc << "\t" << opName(opOf(word));
+                switch (opOf(word)) {
+                    case Op::Const: out << " " << constants[argOf(word)]; break;
+                    case Op::LoadLocal: case Op::StoreLocal: out << " " << argOf(word) << " (" << symbolName(fn.slotNames[argOf(word)]) << ")"; break;
+                    case Op::LoadGlobal: case Op::StoreGlobal: case Op::CheckName: out << " " << symbolName(argOf(word)); break;
+                    case Op::LoadFunction: {
+                        const CallSite& site = callSites[argOf(word)];
+                        out << " " << symbolName(site.name) << " " << site.argCount;
+                        break;
+                    }
+                    case Op::Binary: out << " '" << static_cast<char>(argOf(word)) << "'"; break;
+                    case Op::PrintString: out << " \"" << strings[argOf(word) >> 1] << "\""; break;
+                    case Op::Jump: case Op::JumpIfFalse: case Op::JumpIfFalseOrPop: case Op::JumpIfTrueOrPop:
+                    case Op::Call: case Op::MemoCall: case Op::DefineFunction: case Op::PrintValue:
+                        out << " " << argOf(word); break;
+                    case Op::TailCall: out << " " << (argOf(word) >> 1) << ((argOf(word) & 1) ? " (discard)" : ""); break;
+                    default: break;
+                }
+                out << "\n";
+            }
+        }
+    }
+};
+
+class BytecodeCompiler {
+    public:
+        BytecodeCompiler(const FlatAst& ast, const Resolution& names, const MemoCache* memo = nullptr)
+            : ast(ast), names(names), memo(memo) {}
+
+        BytecodeProgram compile() {
+            // Functions are compiled into locals and moved into place when done, so
+            // `current` never points into the growing functions vector
+            BytecodeFunction module;
+            program.functions.emplace_back();
+            current = moduleCode = &module;
+            for (FlatIndex stmt : ast.list(ast.root)) {
+                statement(stmt, false);
+                // A top-level return only ends the statement it is in
+                for (size_t at : moduleReturns) patch(at);
+                moduleReturns.clear();
+            }
+            emit(Op::Halt);
+            program.functions[0] = std::move(module);
+            return std::move(program);
+        }
+
+    private:
+        const FlatAst& ast;
+        const Resolution& names;
+        const MemoCache* memo;  // nullptr unless memoizing
+        BytecodeProgram program;
+        BytecodeFunction* current = nullptr;     // Function being compiled
+        BytecodeFunction* moduleCode = nullptr;  // Top-level code
+        uint32_t depth = 0;                    // Operand stack depth at this point of the code
+        std::vector<size_t> moduleReturns;
+        std::unordered_map<int, uint32_t> constantIndex;
+
+        bool inFunction() const {
+            return current != moduleCode;
+        }
+
+        void emit(Op op, uint32_t arg = 0) {
+            if (arg > MAX_OPERAND) throw std::runtime_error("Program too large for bytecode operands");
+            current->code.push_back(encode(op, arg));
+            depth += stackEffect(op, arg);
+            if (depth > current->maxStack) current->maxStack = depth;
+        }
+
+        static int stackEffect(Op op, uint32_t arg) {
+            switch (op) {
+                case Op::Const: case Op::LoadLocal: case Op::LoadGlobal: case Op::LoadFunction:
+                    return 1;
+                case Op::StoreLocal: case Op::StoreGlobal: case Op::Pop: case Op::PrintValue: case Op::Return:
+                case Op::JumpIfFalse: case Op::JumpIfFalseOrPop: case Op::JumpIfTrueOrPop:  // Fallthrough path
+                case Op::Add: case Op::Subtract: case Op::Multiply: case Op::Binary:
+                case Op::Less: case Op::LessEqual: case Op::Greater: case Op::GreaterEqual: case Op::Equal: case Op::NotEqual:
+                    return -1;
+                case Op::Call: case Op::MemoCall:
+                    return -static_cast<int>(arg);  // Arguments and callee in, result out
+                case Op::TailCall:
+                    return -static_cast<int>(arg >> 1) - 1;  // Never falls through; counted like Call then Return
+                default:
+                    return 0;
+            }
+        }
+
+        // Emits a forward jump and returns its position for patch()
+        size_t emitJump(Op op) {
+            emit(op);
+            return current->code.size() - 1;
+        }
+
+        void patch(size_t at) {
+            current->code[at] = encode(opOf(current->code[at]), static_cast<uint32_t>(current->code.size()));
+        }
+
+        uint32_t constant(int value) {
+            auto found = constantIndex.find(value);
+            if (found != constantIndex.end()) return found->second;
+            program.constants.push_back(value);
+            return constantIndex[value] = static_cast<uint32_t>(program.constants.size() - 1);
+        }
+
+        // `tail`: the statement is the last thing its function runs, so a call there is a tail call
+        void statement(FlatIndex node, bool tail) {
+            switch (ast.kind(node)) {
+                case ASTNodeType::Assign:
+                    expression(ast.second(node));
+                    if (names.slot(node) != GLOBAL_NAME) {
+                        emit(Op::StoreLocal, names.slot(node));
+                    } else {
+                        emit(Op::StoreGlobal, ast.symbol(node));
+                    }
+                    break;
+
+                case ASTNodeType::Print: {
+                    uint32_t separator = 0;
+                    for (FlatIndex expr : ast.list(node)) {
+                        if (ast.kind(expr) == ASTNodeType::String) {
+                            program.strings.push_back(ast.stringValue(expr).str());
+                            emit(Op::PrintString, static_cast<uint32_t>(program.strings.size() - 1) << 1 | separator);
+                        } else {
+                            expression(expr);
+                            emit(Op::PrintValue, separator);
+                        }
+                        separator = 1;
+                    }
+                    emit(Op::PrintEnd);
+                    break;
+                }
+
+                case ASTNodeType::If: {
+                    expression(ast.first(node));
+                    size_t toElse = emitJump(Op::JumpIfFalse);
+                    statement(ast.thenBranch(node), tail);
+                    if (ast.elseBranch(node) != NO_NODE) {
+                        size_t toEnd = emitJump(Op::Jump);
+                        patch(toElse);
+                        statement(ast.elseBranch(node), tail);
+                        patch(toEnd);
+                    } else {
+                        patch(toElse);
+                    }
+                    break;
+                }
+
+                case ASTNodeType::Block: {
+                    FlatSpan statements = ast.list(node);
+                    for (size_t i = 0; i < statements.size(); ++i) statement(statements[i], tail && i + 1 == statements.size());
+                    break;
+                }
+
+                case ASTNodeType::Function:
+                    emit(Op::DefineFunction, function(node));
+                    break;
+
+                case ASTNodeType::Return:
+                    if (inFunction() && ast.kind(ast.first(node)) == ASTNodeType::FunctionCall) {
+                        call(ast.first(node), Op::TailCall);
+                        break;
+                    }
+                    expression(ast.first(node));
+                    if (inFunction()) {
+                        emit(Op::Return);
+                    } else {
+                        emit(Op::Pop);
+                        moduleReturns.push_back(emitJump(Op::Jump));
+                    }
+                    break;
+
+                case ASTNodeType::Identifier:
+                    emit(Op::CheckName, ast.symbol(node));
+                    break;
+
+                case ASTNodeType::Int:
+                case ASTNodeType::String:
+                    break;  // Nothing to do
+
+                case ASTNodeType::FunctionCall:
+                    if (tail && inFunction()) {
+                        call(node, Op::TailCall, 1);  // The caller returns None, not the callee's result
+                        break;
+                    }
+                    expression(node);
+                    emit(Op::Pop);
+                    break;
+
+                default:
+                    expression(node);  // Expression statement
+                    emit(Op::Pop);
+                    break;
+            }
+        }
+
+        void expression(FlatIndex node) {
+            switch (ast.kind(node)) {
+                case ASTNodeType::Int:
+                    emit(Op::Const, constant(ast.intValue(node)));
+                    break;
+
+                case ASTNodeType::String:
+                    emit(Op::Const, constant(0));  // Strings are only printable; as values they are 0
+                    break;
+
+                case ASTNodeType::Identifier:
+                    if (names.slot(node) != GLOBAL_NAME) {
+                        emit(Op::LoadLocal, names.slot(node));
+                    } else {
+                        emit(Op::LoadGlobal, ast.symbol(node));
+                    }
+                    break;
+
+                case ASTNodeType::BinaryOp: {
+                    char op = ast.op(node);
+                    expression(ast.first(node));
+                    if (op == '&' || op == '|') {
+                        size_t toEnd = emitJump(op == '&' ? Op::JumpIfFalseOrPop : Op::JumpIfTrueOrPop);
+                        expression(ast.second(node));
+                        patch(toEnd);
+                        break;
+                    }
+                    expression(ast.second(node));
+                    switch (op) {
+                        case '+': emit(Op::Add); break;
+                        case '-': emit(Op::Subtract); break;
+                        case '*': emit(Op::Multiply); break;
+                        case '<': emit(Op::Less); break;
+                        case 'L': emit(Op::LessEqual); break;
+                        case '>': emit(Op::Greater); break;
+                        case 'G': emit(Op::GreaterEqual); break;
+                        case 'E': emit(Op::Equal); break;
+                        case 'N': emit(Op::NotEqual); break;
+                        default: emit(Op::Binary, static_cast<uint8_t>(op)); break;
+                    }
+                    break;
+                }
+
+                case ASTNodeType::UnaryOp:
+                    expression(ast.first(node));
+                    emit(ast.op(node) == '-' ? Op::Negate : Op::Not);
+                    break;
+
+                case ASTNodeType::FunctionCall:
+                    call(node, memo && memo->memoizes(ast.symbol(node)) ? Op::MemoCall : Op::Call);
+                    break;
+
+                default:
+                    statement(node, false);  // Statements have no value
+                    emit(Op::Const, constant(0));
+                    break;
+            }
+        }
+
+        // Call and TailCall take the argument count; TailCall shifted left past the discard flag
+        void call(FlatIndex node, Op op, uint32_t discard = 0) {
+            FlatSpan args = ast.list(node);
+            program.callSites.push_back(CallSite{ast.symbol(node), args.size()});
+            emit(Op::LoadFunction, static_cast<uint32_t>(program.callSites.size() - 1));
+            for (FlatIndex arg : args) expression(arg);
+            emit(op, op == Op::TailCall ? args.size() << 1 | discard : args.size());
+        }
+
+        uint32_t function(FlatIndex node) {
+            uint32_t index = static_cast<uint32_t>(program.functions.size());
+            program.functions.emplace_back();
+
+            BytecodeFunction fn;
+            fn.name = ast.symbol(node);
+            fn.node = node;
+            fn.params = names.layout(node).params;
+            fn.slotNames = names.layout(node).slotNames;
+
+            // Compile the body with this function as the target, then put the outer one back
+            BytecodeFunction* outer = current;
+            uint32_t outerDepth = depth;
+            std::vector<size_t> outerReturns;
+            outerReturns.swap(moduleReturns);
+            current = &fn;
+            depth = 0;
+
+            statement(ast.body(node), true);
+            emit(Op::ReturnNone);
+
+            outerReturns.swap(moduleReturns);
+            depth = outerDepth;
+            current = outer;
+            program.functions[index] = std::move(fn);
+            return index;
+        }
+};
+
+/* --- Baseline JIT --- */
+// --jit: the VM counts calls per function, and once one has been called often enough it
+// compiles the function's bytecode to x86-64 and calls that from then on. The machine
+// code keeps the VM's frame layout (slots, then operands, on the VM value stack), so
+// compiled and interpreted functions call each other freely. Every operand's stack depth
+// is known at compile time, so an operand lives at a fixed offset from the frame and the
+// top one is kept in eax. A function using anything without a translation (defs, bare
+// names, memoized calls) stays interpreted.
+//
+// Generated code can't let C++ exceptions unwind through it, so the helpers it calls
+// catch them, park them in the VM and set `failed`; the code then returns straight up to
+// the VM, which rethrows. Compiled calls nest on the C stack: a call made with too little
+// of it left runs in the interpreter instead, which keeps deep recursion off the C stack.
+
+#ifdef MYPYTHON_JIT
+class VirtualMachine;
+struct JitState;
+typedef int64_t (*JitCode)(int64_t* locals, JitState* state);
+
+const uint32_t DEFAULT_JIT_THRESHOLD = 100;  // Calls before a function is compiled
+
+// What generated code reads and writes; plain data at fixed offsets
+struct JitState {
+    int64_t* stackBase;            // The VM value stack, updated whenever it moves
+    int64_t* stackEnd;
+    const char* cStackFloor;       // Compiled code doesn't run with the C stack below this
+    const CallSiteCache<uint32_t>* callCaches;
+    const uint32_t* epoch;
+    JitCode* code;                 // Per function; nullptr while interpreted
+    uint64_t depth;                // Compiled frames live
+    uint64_t frameDepth;           // Interpreter frames under them
+    uint64_t depthLimit;           // --max-depth
+    uint64_t maxDepth;
+    uint64_t calls;
+    uint64_t tailCalls;
+    uint8_t failed;                // An exception is waiting in the VM
+    VirtualMachine* vm;
+    // Helpers; the signatures match what the code generator puts in argument registers
+    int64_t (*call)(JitState* state, uint32_t site, int64_t* args);
+    int64_t (*enter)(int64_t* locals, JitState* state, uint32_t function);
+    int64_t (*global)(JitState* state, uint32_t symbol);
+    int64_t (*binary)(JitState* state, uint32_t op, int32_t left, int32_t right);
+    void (*print)(JitState* state, uint32_t op, uint32_t arg, int32_t value);
+    void (*tooDeep)(JitState* state);
+};
+
+// Just the encodings the JIT uses. Memory operands are always [base + disp32].
+class X86Assembler {
+    public:
+        enum Reg : uint8_t { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+        enum Cond : uint8_t { B = 0x2, E = 0x4, NE = 0x5, BE = 0x6, A = 0x7, L = 0xc, GE = 0xd, LE = 0xe, G = 0xf };
+
+        std::vector<uint8_t> bytes;
+
+        size_t size() const { return bytes.size(); }
+        void byte(uint8_t value) { bytes.push_back(value); }
+
+        void int32(int32_t value) {
+            uint8_t raw[4];
+            std::memcpy(raw, &value, 4);
+            bytes.insert(bytes.end(), raw, raw + 4);
+        }
+
+        // opcode with ModRM [base + disp]; `reg` is a register or an opcode extension
+        void memory(bool wide, std::initializer_list<uint8_t> opcode, int reg, Reg base, int32_t disp) {
+            rex(wide, reg, base);
+            bytes.insert(bytes.end(), opcode.begin(), opcode.end());
+            byte(0x80 | (reg & 7) << 3 | (base & 7));
+            if ((base & 7) == RSP) byte(0x24);  // rsp and r12 need a SIB byte
+            int32(disp);
+        }
+
+        // opcode with ModRM naming two registers
+        void registers(bool wide, std::initializer_list<uint8_t> opcode, int reg, int rm) {
+            rex(wide, reg, rm);
+            bytes.insert(bytes.end(), opcode.begin(), opcode.end());
+            byte(0xc0 | (reg & 7) << 3 | (rm & 7));
+        }
+
+        void movImm32(Reg reg, int32_t value) {
+            if (reg >= R8) byte(0x41);
+            byte(0xb8 + (reg & 7));
+            int32(value);
+        }
+
+        void movImm64(Reg reg, int64_t value) {
+            byte(reg >= R8 ? 0x49 : 0x48);
+            byte(0xb8 + (reg & 7));
+            uint8_t raw[8];
+            std::memcpy(raw, &value, 8);
+            bytes.insert(bytes.end(), raw, raw + 8);
+        }
+
+        void push(Reg reg) { if (reg >= R8) byte(0x41); byte(0x50 + (reg & 7)); }
+        void pop(Reg reg) { if (reg >= R8) byte(0x41); byte(0x58 + (reg & 7)); }
+
+        // Jumps with a 32-bit displacement, returning where it goes for bind()
+        size_t jump() { byte(0xe9); int32(0); return size() - 4; }
+        size_t jumpIf(Cond cond) { byte(0x0f); byte(0x80 | cond); int32(0); return size() - 4; }
+
+        void bind(size_t fixup, size_t target) {
+            int32_t relative = static_cast<int32_t>(target - (fixup + 4));
+            std::memcpy(&bytes[fixup], &relative, 4);
+        }
+
+        void setIf(Cond cond) {  // eax = cond ? 1 : 0
+            byte(0x0f); byte(0x90 | cond); byte(0xc0);  // setcc al
+            byte(0x0f); byte(0xb6); byte(0xc0);         // movzx eax, al
+        }
+
+    private:
+        void rex(bool wide, int reg, int rm) {
+            uint8_t prefix = 0x40 | (wide ? 8 : 0) | (reg >= R8 ? 4 : 0) | (rm >= R8 ? 1 : 0);
+            if (prefix != 0x40) byte(prefix);
+        }
+};
+
+// Translates one BytecodeFunction. Registers: rbx = this frame's slots (reloaded after
+// every call, since the value stack may move), r12 = the same as an offset into the value
+// stack, r13 = JitState. Values are ints held sign-extended in 64-bit stack cells.
+class JitCompiler {
+    public:
+        JitCompiler(const BytecodeProgram& program, uint32_t function, size_t stackSlack)
+            : program(program), fn(program.functions[function]), function(function),
+              slots(static_cast<uint32_t>(fn.slotNames.size())), frameValues(slots + fn.maxStack + stackSlack) {}
+
+        // Machine code for the function; empty if it uses something the JIT doesn't translate
+        std::vector<uint8_t> compile() {
+            for (uint32_t word : fn.code) {
+                switch (opOf(word)) {
+                    case Op::StoreGlobal: case Op::CheckName: case Op::MemoCall: case Op::DefineFunction: case Op::Halt:
+                        return std::vector<uint8_t>();
+                    case Op::Jump: case Op::JumpIfFalse: case Op::JumpIfFalseOrPop: case Op::JumpIfTrueOrPop:
+                        targets.insert(argOf(word));
+                        break;
+                    case Op::Return:
+                        returnsNone = false;
+                        break;
+                    case Op::TailCall:
+                        if (!(argOf(word) & 1)) returnsNone = false;
+                        break;
+                    default:
+                        break;
+                }
+            }
+
+            prologue();
+            bool reachable = true;
+            for (pc = 0; pc < fn.code.size(); ++pc) {
+                if (targets.count(pc)) {
+                    auto snapshot = snapshots.find(pc);
+                    if (reachable) {
+                        flush(0);  // Now the same shape as at the jumps here: all in memory
+                    } else if (snapshot != snapshots.end()) {
+                        stack = snapshot->second;
+                        reachable = true;
+                    }
+                    if (reachable) labels[pc] = as.size();
+                }
+                if (reachable) reachable = instruction(opOf(fn.code[pc]), argOf(fn.code[pc]));
+            }
+
+            for (const auto& fixup : fixups) as.bind(fixup.first, labels.at(fixup.second));
+            epilogue();
+            return std::move(as.bytes);
+        }
+
+    private:
+        typedef X86Assembler::Reg Reg;
+        typedef X86Assembler::Cond Cond;
+
+        // Where an operand is: a constant, a parameter's slot (parameters are never
+        // unassigned), its home in the frame, eax (one operand at most), or nowhere (the
+        // callee of a call, which the call site cache supplies)
+        enum class Kind : uint8_t { Const, Param, Memory, Eax, Ecx, Function };
+        struct Entry {
+            Kind kind;
+            int32_t value;   // Const: the value; Param: the slot; Function: the call site
+            uint32_t depth;  // Position on the operand stack, which fixes its home
+        };
+
+        const BytecodeProgram& program;
+        const BytecodeFunction& fn;
+        uint32_t function;
+        uint32_t slots;
+        size_t frameValues;  // Slots, operands and slack: what the frame needs on the value stack
+        X86Assembler as;
+        std::vector<Entry> stack;  // The operand stack at this point of the code
+        size_t pc = 0;
+        std::unordered_set<size_t> targets;
+        bool returnsNone = true;  // Whatever it does, it returns None: statement tail calls can loop too
+        std::unordered_map<size_t, std::vector<Entry>> snapshots;  // Operand stack at each jump target
+        std::unordered_map<size_t, size_t> labels;                 // Bytecode pc -> code offset
+        std::vector<std::pair<size_t, size_t>> fixups;             // Jump displacement -> bytecode pc
+        std::vector<size_t> toEpilogue, toSlowEntry, toTooDeep;
+        size_t bodyStart = 0;
+
+        static int32_t offset(size_t field) { return static_cast<int32_t>(field); }
+        static int32_t slot(size_t index) { return static_cast<int32_t>(index * sizeof(int64_t)); }
+        int32_t home(size_t depth) const { return slot(slots + depth); }
+
+        void prologue() {
+            as.push(Reg::RBX); as.push(Reg::R12); as.push(Reg::R13);  // Leaves rsp 16-byte aligned
+            as.registers(true, {0x89}, Reg::RSI, Reg::R13);           // mov r13, rsi
+            as.registers(true, {0x89}, Reg::RDI, Reg::RBX);           // mov rbx, rdi
+            // Too little C stack, or no room for the frame on the value stack: the enter
+            // helper grows the stack or runs the function in the interpreter
+            as.memory(true, {0x3b}, Reg::RSP, Reg::R13, offset(offsetof(JitState, cStackFloor)));  // cmp rsp, floor
+            toSlowEntry.push_back(as.jumpIf(Cond::B));                               // jb
+            as.memory(true, {0x8d}, Reg::RAX, Reg::RBX, slot(frameValues));                         // lea rax, [rbx + frame]
+            as.memory(true, {0x3b}, Reg::RAX, Reg::R13, offset(offsetof(JitState, stackEnd)));    // cmp rax, stackEnd
+            toSlowEntry.push_back(as.jumpIf(Cond::A));                               // ja
+            as.registers(true, {0x89}, Reg::RBX, Reg::R12);                                         // mov r12, rbx
+            as.memory(true, {0x2b}, Reg::R12, Reg::R13, offset(offsetof(JitState, stackBase)));   // sub r12, stackBase
+
+            // Depth: limit and high-water mark count the interpreter frames underneath too
+            as.memory(true, {0x8b}, Reg::RAX, Reg::R13, offset(offsetof(JitState, depth)));
+            as.registers(true, {0xff}, 0, Reg::RAX);                                                // inc rax
+            as.memory(true, {0x89}, Reg::RAX, Reg::R13, offset(offsetof(JitState, depth)));
+            as.memory(true, {0x03}, Reg::RAX, Reg::R13, offset(offsetof(JitState, frameDepth)));
+            as.memory(true, {0x3b}, Reg::RAX, Reg::R13, offset(offsetof(JitState, depthLimit)));
+            toTooDeep.push_back(as.jumpIf(Cond::A));                                 // ja
+            as.memory(true, {0x3b}, Reg::RAX, Reg::R13, offset(offsetof(JitState, maxDepth)));
+            size_t notDeeper = as.jumpIf(Cond::BE);                                   // jbe
+            as.memory(true, {0x89}, Reg::RAX, Reg::R13, offset(offsetof(JitState, maxDepth)));
+            as.bind(notDeeper, as.size());
+            as.memory(true, {0xff}, 0, Reg::R13, offset(offsetof(JitState, calls)));               // inc calls
+
+            clearLocals();
+            bodyStart = as.size();
+        }
+
+        // Locals other than parameters start unassigned
+        void clearLocals() {
+            if (fn.params == slots) return;
+            as.movImm64(Reg::RAX, UNSET_SLOT);
+            for (uint32_t i = fn.params; i < slots; ++i) as.memory(true, {0x89}, Reg::RAX, Reg::RBX, slot(i));
+        }
+
+        void epilogue() {
+            size_t epilogueAt = as.size();
+            for (size_t fixup : toEpilogue) as.bind(fixup, epilogueAt);
+            as.memory(true, {0xff}, 1, Reg::R13, offset(offsetof(JitState, depth)));  // dec depth
+            as.pop(Reg::R13); as.pop(Reg::R12); as.pop(Reg::RBX);
+            as.byte(0xc3);
+
+            // Before the frame was set up: rdi and rsi are still the arguments
+            for (size_t fixup : toSlowEntry) as.bind(fixup, as.size());
+            as.pop(Reg::R13); as.pop(Reg::R12); as.pop(Reg::RBX);
+            as.movImm32(Reg::RDX, static_cast<int32_t>(function));
+            as.memory(false, {0xff}, 4, Reg::RSI, offset(offsetof(JitState, enter)));  // jmp enter(locals, state, function)
+
+            for (size_t fixup : toTooDeep) as.bind(fixup, as.size());
+            as.registers(true, {0x89}, Reg::R13, Reg::RDI);                           // mov rdi, r13
+            as.memory(false, {0xff}, 2, Reg::R13, offset(offsetof(JitState, tooDeep)));
+            as.bind(as.jump(), epilogueAt);
+        }
+
+        // Translates one instruction; false when the next one can only be reached by a jump
+        bool instruction(Op op, uint32_t arg) {
+            switch (op) {
+                case Op::Const:
+                    push(Kind::Const, program.constants[arg]);
+                    return true;
+
+                case Op::LoadLocal: {
+                    if (arg < fn.params) {
+                        push(Kind::Param, static_cast<int32_t>(arg));
+                        return true;
+                    }
+                    spillEax();
+                    as.memory(false, {0x8b}, Reg::RAX, Reg::RBX, slot(arg));
+                    as.memory(false, {0x81}, 7, Reg::RBX, slot(arg) + 4);  // High half of UNSET_SLOT?
+                    as.int32(INT32_MIN);
+                    size_t assigned = as.jumpIf(Cond::NE);
+                    as.movImm32(Reg::RSI, static_cast<int32_t>(fn.slotNames[arg]));  // Not yet: read the global
+                    callHelper(offsetof(JitState, global));
+                    checkFailed();
+                    as.bind(assigned, as.size());
+                    push(Kind::Eax);
+                    return true;
+                }
+
+                case Op::StoreLocal: {
+                    Entry value = pop();
+                    for (size_t i = 0; i < stack.size(); ++i) {  // Operands that still read the old value
+                        if (stack[i].kind == Kind::Param && static_cast<uint32_t>(stack[i].value) == arg) store(i);
+                    }
+                    storeTo(value, slot(arg));
+                    return true;
+                }
+
+                case Op::LoadGlobal:
+                    spillEax();
+                    as.movImm32(Reg::RSI, static_cast<int32_t>(arg));
+                    callHelper(offsetof(JitState, global));
+                    checkFailed();
+                    push(Kind::Eax);
+                    return true;
+
+                case Op::Add: arithmetic({0x03}, 0); return true;
+                case Op::Subtract: arithmetic({0x2b}, 5); return true;
+                case Op::Multiply: arithmetic({0x0f, 0xaf}, -1); return true;
+                case Op::Less: compare(Cond::L, Cond::GE); return true;
+                case Op::LessEqual: compare(Cond::LE, Cond::G); return true;
+                case Op::Greater: compare(Cond::G, Cond::LE); return true;
+                case Op::GreaterEqual: compare(Cond::GE, Cond::L); return true;
+                case Op::Equal: compare(Cond::E, Cond::NE); return true;
+                case Op::NotEqual: compare(Cond::NE, Cond::E); return true;
+
+                case Op::Binary: {
+                    Entry right = pop();
+                    Entry left = pop();
+                    spillEax();
+                    if (arg == '%') {  // Inline; like the interpreter, `% 0` traps
+                        load(Reg::RCX, right);
+                        if (left.kind != Kind::Eax) load(Reg::RAX, left);
+                        as.byte(0x99);                                   // cdq
+                        as.registers(false, {0xf7}, 7, Reg::RCX);       // idiv ecx
+                        as.registers(false, {0x89}, Reg::RDX, Reg::RAX);  // mov eax, edx
+                    } else {
+                        if (right.kind == Kind::Eax) {
+                            load(Reg::RCX, right);
+                            load(Reg::RDX, left);
+                        } else {
+                            load(Reg::RDX, left);
+                            load(Reg::RCX, right);
+                        }
+                        as.movImm32(Reg::RSI, static_cast<int32_t>(arg));
+                        callHelper(offsetof(JitState, binary));
+                        checkFailed();
+                    }
+                    push(Kind::Eax);
+                    return true;
+                }
+
+                case Op::Negate:
+                case Op::Not: {
+                    Entry operand = pop();
+                    spillEax();
+                    load(Reg::RAX, operand);
+                    if (op == Op::Negate) {
+                        as.registers(false, {0xf7}, 3, Reg::RAX);  // neg eax
+                    } else {
+                        as.registers(false, {0x85}, Reg::RAX, Reg::RAX);
+                        as.setIf(Cond::E);
+                    }
+                    push(Kind::Eax);
+                    return true;
+                }
+
+                case Op::Jump:
+                    flush(0);
+                    jumpTo(arg, as.jump());
+                    return false;
+
+                case Op::JumpIfFalse: {
+                    Entry condition = pop();
+                    flush(0);
+                    if (condition.kind == Kind::Const) {
+                        if (condition.value != 0) return true;
+                        jumpTo(arg, as.jump());
+                        return false;
+                    }
+                    test(condition);
+                    jumpTo(arg, as.jumpIf(Cond::E));
+                    return true;
+                }
+
+                case Op::JumpIfFalseOrPop:
+                case Op::JumpIfTrueOrPop:
+                    flush(0);  // The value stays for the target, so it goes home
+                    test(stack.back());
+                    jumpTo(arg, as.jumpIf(op == Op::JumpIfFalseOrPop ? Cond::E : Cond::NE));
+                    pop();
+                    return true;
+
+                case Op::LoadFunction:
+                    push(Kind::Function, static_cast<int32_t>(arg));
+                    return true;
+
+                case Op::Call: {
+                    size_t callee = stack.size() - arg - 1;
+                    int32_t site = stack[callee].value;
+                    flush(callee + 1);  // Arguments go where the callee's slots will be
+                    spillEax();
+                    call(site, home(callee + 1));
+                    stack.resize(callee);
+                    push(Kind::Eax);
+                    return true;
+                }
+
+                case Op::TailCall: {
+                    uint32_t count = arg >> 1;
+                    size_t callee = stack.size() - count - 1;
+                    int32_t site = stack[callee].value;
+                    flush(callee + 1);
+                    spillEax();
+                    if (!(arg & 1) || returnsNone) {
+                        // Calling itself: a loop. Calling other compiled code: jump to it with
+                        // this frame's registers restored. Anything else is a call and return.
+                        size_t notSelf = checkCallSite(site);
+                        as.memory(false, {0x81}, 7, Reg::RAX, site * 8 + 4);  // cmp target, this function
+                        as.int32(static_cast<int32_t>(function));
+                        size_t other = as.jumpIf(Cond::NE);
+                        for (uint32_t i = 0; i < count; ++i) {
+                            as.memory(true, {0x8b}, Reg::RCX, Reg::RBX, home(callee + 1 + i));
+                            as.memory(true, {0x89}, Reg::RCX, Reg::RBX, slot(i));
+                        }
+                        clearLocals();
+                        as.memory(true, {0xff}, 0, Reg::R13, offset(offsetof(JitState, tailCalls)));
+                        as.memory(true, {0xff}, 0, Reg::R13, offset(offsetof(JitState, calls)));
+                        as.bind(as.jump(), bodyStart);
+
+                        as.bind(other, as.size());
+                        if (!(arg & 1)) jumpToCompiled(site, callee, count);
+                        as.bind(notSelf, as.size());
+                    }
+                    call(site, home(callee + 1));
+                    if (arg & 1) as.registers(false, {0x31}, Reg::RAX, Reg::RAX);  // A statement: return None
+                    toEpilogue.push_back(as.jump());
+                    return false;
+                }
+
+                case Op::Return:
+                    load(Reg::RAX, pop());
+                    toEpilogue.push_back(as.jump());
+                    return false;
+
+                case Op::ReturnNone:
+                    as.registers(false, {0x31}, Reg::RAX, Reg::RAX);
+                    toEpilogue.push_back(as.jump());
+                    return false;
+
+                case Op::Pop:
+                    pop();
+                    return true;
+
+                case Op::PrintString:
+                case Op::PrintValue:
+                case Op::PrintEnd: {
+                    if (op == Op::PrintValue) {
+                        Entry value = pop();
+                        spillEax();
+                        load(Reg::RCX, value);
+                    } else {
+                        spillEax();
+                    }
+                    as.movImm32(Reg::RDX, static_cast<int32_t>(arg));
+                    as.movImm32(Reg::RSI, static_cast<int32_t>(op));
+                    callHelper(offsetof(JitState, print));
+                    return true;
+                }
+
+                default:  // Rejected before translating
+                    throw std::runtime_error("JIT: unexpected opcode");
+            }
+        }
+
+        /* Operand stack */
+
+        void push(Kind kind, int32_t value = 0) {
+            stack.push_back(Entry{kind, value, static_cast<uint32_t>(stack.size())});
+        }
+
+        Entry pop() {
+            Entry entry = stack.back();
+            stack.pop_back();
+            return entry;
+        }
+
+        // Puts stack[index] in its home in the frame
+        void store(size_t index) {
+            Entry& entry = stack[index];
+            if (entry.kind == Kind::Memory || entry.kind == Kind::Function) return;
+            storeTo(entry, home(entry.depth));
+            entry.kind = Kind::Memory;
+        }
+
+        // Everything from `from` up goes home, as it must be at a jump or call
+        void flush(size_t from) {
+            for (size_t i = from; i < stack.size(); ++i) store(i);
+        }
+
+        void spillEax() {
+            for (size_t i = 0; i < stack.size(); ++i) {
+                if (stack[i].kind == Kind::Eax) store(i);
+            }
+        }
+
+        // Writes a value, sign-extended, to the frame cell at disp
+        void storeTo(const Entry& value, int32_t disp) {
+            switch (value.kind) {
+                case Kind::Const:
+                    as.memory(true, {0xc7}, 0, Reg::RBX, disp);
+                    as.int32(value.value);
+                    break;
+                case Kind::Param:
+                    as.memory(true, {0x63}, Reg::RCX, Reg::RBX, slot(value.value));  // movsxd rcx
+                    as.memory(true, {0x89}, Reg::RCX, Reg::RBX, disp);
+                    break;
+                case Kind::Memory:
+                    as.memory(true, {0x8b}, Reg::RCX, Reg::RBX, home(value.depth));
+                    as.memory(true, {0x89}, Reg::RCX, Reg::RBX, disp);
+                    break;
+                case Kind::Eax:
+                    as.byte(0x48); as.byte(0x98);  // cdqe
+                    as.memory(true, {0x89}, Reg::RAX, Reg::RBX, disp);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        void load(Reg reg, const Entry& value) {
+            switch (value.kind) {
+                case Kind::Const: as.movImm32(reg, value.value); break;
+                case Kind::Param: as.memory(false, {0x8b}, reg, Reg::RBX, slot(value.value)); break;
+                case Kind::Memory: as.memory(false, {0x8b}, reg, Reg::RBX, home(value.depth)); break;
+                case Kind::Eax: if (reg != Reg::RAX) as.registers(false, {0x89}, Reg::RAX, reg); break;
+                case Kind::Ecx: if (reg != Reg::RCX) as.registers(false, {0x89}, Reg::RCX, reg); break;
+                default: break;
+            }
+        }
+
+        // eax op= right, where op is the `op r32, r/m32` opcode; immExt is the 0x81 /ext
+        // form for a constant (-1: imul, which has its own)
+        void operate(std::initializer_list<uint8_t> opcode, int immExt, const Entry& right) {
+            switch (right.kind) {
+                case Kind::Const:
+                    if (immExt < 0) {
+                        as.registers(false, {0x69}, Reg::RAX, Reg::RAX);
+                    } else {
+                        as.registers(false, {0x81}, immExt, Reg::RAX);
+                    }
+                    as.int32(right.value);
+                    break;
+                case Kind::Param: as.memory(false, opcode, Reg::RAX, Reg::RBX, slot(right.value)); break;
+                case Kind::Memory: as.memory(false, opcode, Reg::RAX, Reg::RBX, home(right.depth)); break;
+                case Kind::Ecx: as.registers(false, opcode, Reg::RAX, Reg::RCX); break;
+                default: break;
+            }
+        }
+
+        // Pops both operands, leaving left in eax and right somewhere operate() can use
+        void operands(Entry& left, Entry& right, bool flushRest) {
+            right = pop();
+            left = pop();
+            if (flushRest) flush(0); else spillEax();
+            if (right.kind == Kind::Eax) {
+                as.registers(false, {0x89}, Reg::RAX, Reg::RCX);  // mov ecx, eax
+                right.kind = Kind::Ecx;
+            }
+            load(Reg::RAX, left);
+        }
+
+        void arithmetic(std::initializer_list<uint8_t> opcode, int immExt) {
+            Entry left, right;
+            operands(left, right, false);
+            operate(opcode, immExt, right);
+            push(Kind::Eax);
+        }
+
+        // A comparison feeding straight into JumpIfFalse becomes cmp + jcc
+        void compare(Cond cond, Cond inverse) {
+            bool fused = pc + 1 < fn.code.size() && opOf(fn.code[pc + 1]) == Op::JumpIfFalse && !targets.count(pc + 1);
+            Entry left, right;
+            operands(left, right, fused);
+            operate({0x3b}, 7, right);
+            if (fused) {
+                jumpTo(argOf(fn.code[++pc]), as.jumpIf(inverse));
+                return;
+            }
+            as.setIf(cond);
+            push(Kind::Eax);
+        }
+
+        void test(const Entry& value) {
+            if (value.kind == Kind::Eax) {
+                as.registers(false, {0x85}, Reg::RAX, Reg::RAX);
+            } else if (value.kind == Kind::Param || value.kind == Kind::Memory) {
+                as.memory(false, {0x81}, 7, Reg::RBX, value.kind == Kind::Param ? slot(value.value) : home(value.depth));
+                as.int32(0);
+            } else {
+                load(Reg::RAX, value);
+                as.registers(false, {0x85}, Reg::RAX, Reg::RAX);
+            }
+        }
+
+        // The operand stack must be flushed; the target takes it over
+        void jumpTo(size_t target, size_t fixup) {
+            fixups.emplace_back(fixup, target);
+            snapshots[target] = stack;
+        }
+
+        /* Calls */
+
+        void callHelper(size_t field) {
+            as.registers(true, {0x89}, Reg::R13, Reg::RDI);  // mov rdi, r13
+            as.memory(false, {0xff}, 2, Reg::R13, offset(field));
+        }
+
+        void checkFailed() {
+            as.memory(false, {0x80}, 7, Reg::R13, offset(offsetof(JitState, failed)));
+            as.byte(0);
+            toEpilogue.push_back(as.jumpIf(Cond::NE));
+        }
+
+        // Leaves rax = the call site caches; returns the jump taken when the site's entry
+        // is stale
+        size_t checkCallSite(int32_t site) {
+            as.memory(true, {0x8b}, Reg::RAX, Reg::R13, offset(offsetof(JitState, callCaches)));
+            as.memory(true, {0x8b}, Reg::RDX, Reg::R13, offset(offsetof(JitState, epoch)));
+            as.memory(false, {0x8b}, Reg::RDX, Reg::RDX, 0);
+            as.memory(false, {0x39}, Reg::RDX, Reg::RAX, site * 8);  // cmp cache.epoch, edx
+            return as.jumpIf(Cond::NE);
+        }
+
+        // Calls whatever the call site resolves to, with its arguments at [rbx + args];
+        // the result ends up in eax
+        void call(int32_t site, int32_t args) {
+            static_assert(sizeof(CallSiteCache<uint32_t>) == 8, "the code below indexes call site caches by 8");
+            size_t stale = checkCallSite(site);
+            as.memory(false, {0x8b}, Reg::RAX, Reg::RAX, site * 8 + 4);  // eax = target
+            as.memory(true, {0x8b}, Reg::RCX, Reg::R13, offset(offsetof(JitState, code)));
+            as.byte(0x48); as.byte(0x8b); as.byte(0x0c); as.byte(0xc1);  // mov rcx, [rcx + rax*8]
+            as.registers(true, {0x85}, Reg::RCX, Reg::RCX);
+            size_t notCompiled = as.jumpIf(Cond::E);
+            as.memory(true, {0x8d}, Reg::RDI, Reg::RBX, args);
+            as.registers(true, {0x89}, Reg::R13, Reg::RSI);
+            as.registers(false, {0xff}, 2, Reg::RCX);  // call rcx
+            size_t done = as.jump();
+
+            // Resolving, interpreting and growing the stack are the helper's business
+            as.bind(stale, as.size());
+            as.bind(notCompiled, as.size());
+            as.movImm32(Reg::RSI, site);
+            as.memory(true, {0x8d}, Reg::RDX, Reg::RBX, args);
+            callHelper(offsetof(JitState, call));
+
+            as.bind(done, as.size());
+            checkFailed();
+            as.memory(true, {0x8b}, Reg::RBX, Reg::R13, offset(offsetof(JitState, stackBase)));  // The stack may have moved
+            as.registers(true, {0x03}, Reg::RBX, Reg::R12);
+        }
+
+        // A tail call to another function: with rax = the call site caches (known fresh),
+        // when the target has code, move the arguments down and jump to it with this
+        // frame's registers restored. Falls through when it doesn't.
+        void jumpToCompiled(int32_t site, size_t callee, uint32_t count) {
+            as.memory(false, {0x8b}, Reg::RAX, Reg::RAX, site * 8 + 4);  // eax = target
+            as.memory(true, {0x8b}, Reg::RCX, Reg::R13, offset(offsetof(JitState, code)));
+            as.byte(0x48); as.byte(0x8b); as.byte(0x0c); as.byte(0xc1);  // mov rcx, [rcx + rax*8]
+            as.registers(true, {0x85}, Reg::RCX, Reg::RCX);
+            size_t notCompiled = as.jumpIf(Cond::E);
+            for (uint32_t i = 0; i < count; ++i) {
+                as.memory(true, {0x8b}, Reg::RDX, Reg::RBX, home(callee + 1 + i));
+                as.memory(true, {0x89}, Reg::RDX, Reg::RBX, slot(i));
+            }
+            as.memory(true, {0xff}, 0, Reg::R13, offset(offsetof(JitState, tailCalls)));
+            as.memory(true, {0xff}, 1, Reg::R13, offset(offsetof(JitState, depth)));  // The callee counts itself again
+            as.registers(true, {0x89}, Reg::RBX, Reg::RDI);
+            as.registers(true, {0x89}, Reg::R13, Reg::RSI);
+            as.pop(Reg::R13); as.pop(Reg::R12); as.pop(Reg::RBX);
+            as.registers(false, {0xff}, 4, Reg::RCX);  // jmp rcx
+            as.bind(notCompiled, as.size());
+        }
+};
+
+// Executable pages for compiled functions: written while writable, then made
+// read+execute, never both at once
+class JitMemory {
+    public:
+        JitMemory() {}
+        JitMemory(const JitMemory&) = delete;
+        JitMemory& operator=(const JitMemory&) = delete;
+
+        ~JitMemory() {
+            for (const auto& region : regions) munmap(region.first, region.second);
+        }
+
+        void* install(const std::vector<uint8_t>& code) {
+            size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            size_t size = (code.size() + page - 1) / page * page;
+            void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) return nullptr;
+            std::memcpy(memory, code.data(), code.size());
+            if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+                munmap(memory, size);
+                return nullptr;
+            }
+            regions.emplace_back(memory, size);
+            bytes += code.size();
+            return memory;
+        }
+
+        size_t functions() const { return regions.size(); }
+        size_t codeBytes() const { return bytes; }
+
+    private:
+        std::vector<std::pair<void*, size_t>> regions;
+        size_t bytes = 0;
+};
+#endif
+
+/* --- Virtual machine --- */
+#if defined(__GNUC__) && !defined(MYPYTHON_NO_COMPUTED_GOTO)
+#define MYPYTHON_COMPUTED_GOTO 1  // Labels-as-values: one indirect jump per instruction
+#endif
+
+// The value stack and the frame stack are plain vectors, grown by doubling. Their combined
+// size is capped at stackLimit bytes: hitting the cap is a RecursionError, so the depth a
+// script can reach depends on how big its frames are. A frame costs sizeof(Frame) plus one
+// value for the callee, one per slot and the operands pending in the caller; a one-argument
+// recursive function like fib needs about 40 bytes, or ten million frames in 400 MB.
+class VirtualMachine {
+    public:
+        VirtualMachine(const BytecodeProgram& program, size_t maxDepth = UNLIMITED_DEPTH, size_t stackLimit = DEFAULT_VM_STACK_MB << 20,
+                       MemoCache* memo = nullptr)
+            : program(program), maxDepth(maxDepth), stackLimit(stackLimit) {
+            memoTables.assign(program.functions.size(), nullptr);
+            if (memo) {
+                for (size_t i = 1; i < program.functions.size(); ++i) memoTables[i] = memo->table(program.functions[i].node);
+            }
+        }
+
+        const CallStats& getStats() const {
+            return stats;
+        }
+
+#ifdef MYPYTHON_JIT
+        // Compile functions to machine code once they've been called `threshold` times
+        void enableJit(uint32_t threshold) {
+            jitThreshold = threshold;
+        }
+
+        void printJitStats(std::ostream& out) const {
+            out << "jit: " << jitMemory.functions() << " of " << program.functions.size() - 1 << " functions compiled, "
+                << jitMemory.codeBytes() << " bytes of machine code" << std::endl;
+        }
+#endif
+
+        void run() {
+            const BytecodeFunction* fn = &program.functions[0];
+            stack.assign(fn->maxStack + STACK_SLACK, 0);
+            frames.clear();
+            frames.push_back(Frame{0, 0, 0, 0});
+            frameLimit = frames.size();  // The first call takes the slow path and reserves room
+            callCaches.assign(program.callSites.size(), CallSiteCache<uint32_t>());
+#ifdef MYPYTHON_JIT
+            if (jitThreshold) startJit();
+#endif
+
+            execute(fn, fn->code.data(), stack.data(), stack.data());
+#ifdef MYPYTHON_JIT
+            stats.calls += jit.calls;
+            stats.tailCalls += jit.tailCalls;
+            stats.maxDepth = std::max<size_t>(stats.maxDepth, jit.maxDepth);
+#endif
+        }
+
+    private:
+        // Runs fn from pc until Halt, or until a frame entered from compiled code returns
+        int64_t execute(const BytecodeFunction* fn, const uint32_t* pc, int64_t* locals, int64_t* sp) {
+            const int* constants = program.constants.data();
+            uint32_t word;
+            uint8_t callFlags = 0;  // For the frame the next Call pushes
+
+#ifdef MYPYTHON_COMPUTED_GOTO
+            static const void* const labels[] = {
+#define MYPYTHON_OP_LABEL(name) &&op_##name,
+                MYPYTHON_OPCODES(MYPYTHON_OP_LABEL)
+#undef MYPYTHON_OP_LABEL
+            };
+#define VM_CASE(name) op_##name:
+#define VM_NEXT() do { word = *pc++; goto *labels[word & 0xff]; } while (0)
+            VM_NEXT();
+#else
+#define VM_CASE(name) case Op::name:
+#define VM_NEXT() continue
+            for (;;) {
+                word = *pc++;
+                switch (opOf(word)) {
+#endif
+#define VM_ARG (word >> 8)
+#define VM_BINARY(name, expr) VM_CASE(name) { int right = static_cast<int>(*--sp); int left = static_cast<int>(sp[-1]); sp[-1] = (expr); VM_NEXT(); }
+
+            VM_CASE(Const) *sp++ = constants[VM_ARG]; VM_NEXT();
+
+            VM_CASE(LoadLocal) {
+                int64_t value = locals[VM_ARG];
+                if (value == UNSET_SLOT) value = global(fn->slotNames[VM_ARG]);  // Not assigned in this call yet
+                *sp++ = value;
+                VM_NEXT();
+            }
+            VM_CASE(StoreLocal) locals[VM_ARG] = *--sp; VM_NEXT();
+            VM_CASE(LoadGlobal) *sp++ = global(VM_ARG); VM_NEXT();
+            VM_CASE(StoreGlobal) globals.set(VM_ARG, static_cast<int>(*--sp)); VM_NEXT();
+            VM_CASE(CheckName) {
+                try {
+                    // Rare enough (a bare `x` statement) to find the slot by searching
+                    auto slot = std::find(fn->slotNames.begin(), fn->slotNames.end(), VM_ARG);
+                    if (slot == fn->slotNames.end() || locals[slot - fn->slotNames.begin()] == UNSET_SLOT) global(VM_ARG);
+                } catch (const std::runtime_error& e) {
+                    Output::instance().flush();  // Keep it after what was printed before
+                    std::cerr << "Runtime Error: " << e.what() << std::endl;
+                }
+                VM_NEXT();
+            }
+
+            VM_BINARY(Add, left + right)
+            VM_BINARY(Subtract, left - right)
+            VM_BINARY(Multiply, left * right)
+            VM_BINARY(Less, left < right)
+            VM_BINARY(LessEqual, left <= right)
+            VM_BINARY(Greater, left > right)
+            VM_BINARY(GreaterEqual, left >= right)
+            VM_BINARY(Equal, left == right)
+            VM_BINARY(NotEqual, left != right)
+            VM_BINARY(Binary, evaluateBinaryOperation(static_cast<char>(VM_ARG), left, right))
+
+            VM_CASE(Negate) sp[-1] = -static_cast<int>(sp[-1]); VM_NEXT();
+            VM_CASE(Not) sp[-1] = !sp[-1]; VM_NEXT();
+
+            VM_CASE(Jump) pc = fn->code.data() + VM_ARG; VM_NEXT();
+            VM_CASE(JumpIfFalse) if (!*--sp) pc = fn->code.data() + VM_ARG; VM_NEXT();
+            VM_CASE(JumpIfFalseOrPop) if (!sp[-1]) pc = fn->code.data() + VM_ARG; else --sp; VM_NEXT();
+            VM_CASE(JumpIfTrueOrPop) if (sp[-1]) pc = fn->code.data() + VM_ARG; else --sp; VM_NEXT();
+
+            VM_CASE(LoadFunction) {
+                CallSiteCache<uint32_t>& cache = callCaches[VM_ARG];
+                if (cache.epoch != epoch) resolve(VM_ARG);
+                *sp++ = cache.target;
+                VM_NEXT();
+            }
+            VM_CASE(MemoCall) {
+                int64_t* args = sp - VM_ARG;
+                MemoTable* table = memoTables[static_cast<uint32_t>(args[-1])];
+                if (table) {
+                    int result;
+                    if (table->find(args, result)) {
+                        sp = args - 1;  // The whole call, callee index included, becomes its result
+                        *sp++ = result;
+                        VM_NEXT();
+                    }
+                    // Keep the key: the body may reassign its parameters. Return stores the result.
+                    memoKeys.insert(memoKeys.end(), args, args + VM_ARG);
+                    memoKeys.push_back(args[-1]);
+                    callFlags = MEMOIZED;
+                }
+            }
+            // Fallthrough: a miss is an ordinary call
+            VM_CASE(Call) {
+                int64_t* args = sp - VM_ARG;
+                uint32_t callee = static_cast<uint32_t>(args[-1]);
+#ifdef MYPYTHON_JIT
+                if (jitThreshold && !callFlags && runsNative(callee)) {
+                    size_t base = args - stack.data();
+                    int64_t result = callNative(callee, args);
+                    sp = stack.data() + base - 1;  // The stack may have moved
+                    *sp++ = result;
+                    locals = stack.data() + frames.back().base;
+                    VM_NEXT();
+                }
+#endif
+                const BytecodeFunction* target = &program.functions[callee];
+                if (frames.size() >= frameLimit) growFrames();  // Also where the depth limit is checked
+
+                // Make room for the callee's slots and operands, moving the stack if it has to grow
+                size_t base = args - stack.data();
+                size_t needed = base + target->slotNames.size() + target->maxStack + STACK_SLACK;
+                if (needed > stack.size()) {
+                    growStack(needed);
+                    args = stack.data() + base;
+                }
+
+                frames.push_back(Frame{callee, static_cast<uint32_t>(pc - fn->code.data()), static_cast<uint32_t>(base), callFlags});
+                callFlags = 0;
+                if (stats.enter(frames.size() - 1 + nativeDepth())) stats.stackBytes = (args - stack.data()) * sizeof(int64_t) + frames.size() * sizeof(Frame);
+                fn = target;
+                locals = args;
+                sp = args + VM_ARG;
+                for (size_t i = VM_ARG; i < fn->slotNames.size(); ++i) *sp++ = UNSET_SLOT;
+                pc = fn->code.data();
+                VM_NEXT();
+            }
+            VM_CASE(TailCall) {
+                // Same as Call, but the arguments move down over this frame's slots and the
+                // callee takes the frame over: the frame stack doesn't grow
+                uint32_t count = VM_ARG >> 1;
+                int64_t* args = sp - count;
+                uint32_t callee = static_cast<uint32_t>(args[-1]);
+                const BytecodeFunction* target = &program.functions[callee];
+
+                size_t base = locals - stack.data();
+                size_t needed = base + target->slotNames.size() + target->maxStack + STACK_SLACK;
+                if (needed > stack.size()) {
+                    size_t argsAt = args - stack.data();
+                    growStack(needed);
+                    args = stack.data() + argsAt;
+                    locals = stack.data() + base;
+                }
+
+                Frame& frame = frames.back();
+                frame.function = callee;
+                if (VM_ARG & 1) frame.flags |= DISCARDS_RESULT;
+                stats.tailCalls++;
+                fn = target;
+                std::copy(args, args + count, locals);  // Forward copy: locals is below args
+                sp = locals + count;
+#ifdef MYPYTHON_JIT
+                if (jitThreshold && runsNative(callee)) {
+                    // The compiled callee runs in this frame (and counts itself), then returns from it
+                    int64_t result = callNative(callee, locals, 1);
+                    locals = stack.data() + base;
+                    locals[0] = result;
+                    sp = locals + 1;
+                    goto returnFromFrame;
+                }
+#endif
+                stats.enter(frames.size() - 1 + nativeDepth());
+                for (size_t i = count; i < fn->slotNames.size(); ++i) *sp++ = UNSET_SLOT;
+                pc = fn->code.data();
+                VM_NEXT();
+            }
+            VM_CASE(Return) {
+#ifdef MYPYTHON_JIT
+              returnFromFrame:
+#endif
+                int64_t result = sp[-1];
+                if (frames.back().flags) {
+                    result = finishFrame(result);
+                    if (frames.back().flags & RETURNS_TO_NATIVE) {
+                        frames.pop_back();
+                        return result;
+                    }
+                }
+                sp = locals - 1;  // Drop the frame and the callee index under it
+                *sp++ = result;
+                uint32_t returnPc = frames.back().returnPc;
+                frames.pop_back();
+                fn = &program.functions[frames.back().function];
+                pc = fn->code.data() + returnPc;
+                locals = stack.data() + frames.back().base;
+                VM_NEXT();
+            }
+            VM_CASE(ReturnNone) {
+                int64_t result = 0;  // Falling off the end returns None, which is 0 here
+                if (frames.back().flags) {
+                    result = finishFrame(result);
+                    if (frames.back().flags & RETURNS_TO_NATIVE) {
+                        frames.pop_back();
+                        return result;
+                    }
+                }
+                sp = locals - 1;
+                *sp++ = result;
+                uint32_t returnPc = frames.back().returnPc;
+                frames.pop_back();
+                fn = &program.functions[frames.back().function];
+                pc = fn->code.data() + returnPc;
+                locals = stack.data() + frames.back().base;
+                VM_NEXT();
+            }
+
+            VM_CASE(Pop) --sp; VM_NEXT();
+            VM_CASE(DefineFunction) functions.set(program.functions[VM_ARG].name, VM_ARG); epoch++; VM_NEXT();
+
+            VM_CASE(PrintString) {
+                if (VM_ARG & 1) Output::instance().space();
+                Output::instance().write(program.strings[VM_ARG >> 1]);
+                VM_NEXT();
+            }
+            VM_CASE(PrintValue) {
+                if (VM_ARG) Output::instance().space();
+                Output::instance().integer(static_cast<int>(*--sp));
+                VM_NEXT();
+            }
+            VM_CASE(PrintEnd) Output::instance().endLine(); VM_NEXT();
+
+            VM_CASE(Halt) return 0;
+
+#ifndef MYPYTHON_COMPUTED_GOTO
+                    default:
+                        throw std::runtime_error("Bad opcode");
+                }
+            }
+#endif
+#undef VM_BINARY
+#undef VM_ARG
+#undef VM_NEXT
+#undef VM_CASE
+        }
+
+        static const size_t STACK_SLACK = 8;
+
+        // 16 bytes: offsets instead of pointers. Bases fit in 32 bits because growStack()
+        // never lets the value stack past UINT32_MAX values.
+        struct Frame {
+            uint32_t function;
+            uint32_t returnPc;  // Into the caller's code
+            uint32_t base;      // Index of the frame's first slot in stack
+            uint8_t flags;      // FrameFlags; any set sends the return through finishFrame()
+        };
+
+        enum FrameFlags : uint8_t {
+            DISCARDS_RESULT = 1,  // A tail call made as a statement ran in this frame: return None
+            MEMOIZED = 2,         // Entered through a MemoCall miss: the result goes in the table
+            RETURNS_TO_NATIVE = 4,  // Called from compiled code: returning leaves execute()
+        };
+
+        const BytecodeProgram& program;
+        size_t maxDepth;
+        size_t stackLimit;  // Bytes the value and frame stacks may take together
+        std::vector<int64_t> stack;  // Slots and operands of every active frame, end to end
+        std::vector<Frame> frames;
+        size_t frameLimit = 0;  // Calls at this many frames take the slow path: growFrames()
+        SymbolMap<int> globals;
+        SymbolMap<uint32_t> functions;  // Defined so far, by name
+        std::vector<CallSiteCache<uint32_t>> callCaches;  // Indexed by call site
+        uint32_t epoch = 1;
+        CallStats stats;
+        std::vector<MemoTable*> memoTables;  // Per function; nullptr where not memoized
+        std::vector<int64_t> memoKeys;       // Per MEMOIZED frame: its arguments, then its function
+
+        // Slow path of Return and ReturnNone
+        int64_t finishFrame(int64_t result) {
+            uint8_t flags = frames.back().flags;
+            if (flags & DISCARDS_RESULT) result = 0;
+            if (flags & MEMOIZED) {
+                MemoTable* table = memoTables[static_cast<uint32_t>(memoKeys.back())];
+                memoKeys.pop_back();
+                size_t key = memoKeys.size() - table->arity();
+                table->store(&memoKeys[key], static_cast<int>(result));
+                memoKeys.resize(key);
+            }
+            return result;
+        }
+
+        size_t stackBytes(size_t values, size_t frameCount) const {
+            return values * sizeof(int64_t) + frameCount * sizeof(Frame);
+        }
+
+        void outOfStack() const {
+            throwRecursionError(" (call stack reached the " + std::to_string(stackLimit >> 20) + " MB limit of --max-stack)");
+        }
+
+        // Slow path of Call: the frame vector is full, or the depth limit is near. Capacity is
+        // reserved exactly (doubling, but never past what stackLimit leaves for it).
+        void growFrames() {
+            if (frames.size() + nativeDepth() > maxDepth) throwRecursionError();  // frames[0] is the top level
+            if (frames.size() == frames.capacity()) {
+                size_t budget = stackLimit > stackBytes(stack.capacity(), 0) ? stackLimit - stackBytes(stack.capacity(), 0) : 0;
+                size_t capacity = std::min(std::max<size_t>(frames.capacity() * 2, 64), budget / sizeof(Frame));
+                if (capacity <= frames.size()) outOfStack();
+                frames.reserve(capacity);
+            }
+            size_t room = maxDepth + 1 > nativeDepth() ? maxDepth + 1 - nativeDepth() : 0;
+            frameLimit = maxDepth == UNLIMITED_DEPTH ? frames.capacity() : std::min(frames.capacity(), room);
+        }
+
+        // The value stack has to hold `needed` values; it may move
+        void growStack(size_t needed) {
+            size_t budget = stackLimit > stackBytes(0, frames.capacity()) ? stackLimit - stackBytes(0, frames.capacity()) : 0;
+            size_t size = std::min(std::max(needed, stack.size() * 2), std::min<size_t>(budget / sizeof(int64_t), UINT32_MAX));
+            if (size < needed) outOfStack();
+            stack.reserve(size);
+            stack.resize(size);
+#ifdef MYPYTHON_JIT
+            jit.stackBase = stack.data();
+            jit.stackEnd = stack.data() + stack.size();
+#endif
+        }
+
+        // Slow path of LoadFunction: look the name up and check the arity once per epoch
+        void resolve(uint32_t site) {
+            const CallSite& call = program.callSites[site];
+            const uint32_t* found = functions.find(call.name);
+            if (!found) throw std::runtime_error("Function not defined: " + symbolName(call.name));
+            if (program.functions[*found].params != call.argCount) throw std::runtime_error("Argument size mismatch");
+            callCaches[site].target = *found;
+            callCaches[site].epoch = epoch;
+        }
+
+        int64_t global(SymbolId name) const {
+            if (const int* value = globals.find(name)) return *value;
+            throw std::runtime_error("Variable not defined: " + symbolName(name));
+        }
+
+#ifdef MYPYTHON_JIT
+        static const size_t JIT_C_STACK_RESERVE = 1 << 20;  // Left for the interpreter and helpers
+
+        uint32_t jitThreshold = 0;  // 0: no JIT
+        JitState jit = JitState();
+        std::vector<JitCode> jitCode;      // Per function
+        std::vector<uint32_t> jitCounts;   // Calls so far, per function not yet compiled
+        JitMemory jitMemory;
+        std::exception_ptr jitError;       // What made generated code bail out
+
+        size_t nativeDepth() const {
+            return jit.depth;
+        }
+
+        void startJit() {
+            jitCode.assign(program.functions.size(), nullptr);
+            jitCounts.assign(program.functions.size(), 0);
+
+            // Compiled code nests on the C stack; stop using it a good way before the end
+            size_t cStack = 8 << 20;
+            struct rlimit limit;
+            if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) cStack = limit.rlim_cur;
+            cStack = std::min<size_t>(cStack, 64 << 20);
+            const char* here = static_cast<const char*>(__builtin_frame_address(0));
+            jit.cStackFloor = cStack > 2 * JIT_C_STACK_RESERVE ? here - (cStack - JIT_C_STACK_RESERVE) : here;
+
+            jit.stackBase = stack.data();
+            jit.stackEnd = stack.data() + stack.size();
+            jit.callCaches = callCaches.data();
+            jit.epoch = &epoch;
+            jit.code = jitCode.data();
+            jit.depthLimit = maxDepth;
+            jit.vm = this;
+            jit.call = &jitCall;
+            jit.enter = &jitEnter;
+            jit.global = &jitGlobal;
+            jit.binary = &jitBinary;
+            jit.print = &jitPrint;
+            jit.tooDeep = &jitTooDeep;
+        }
+
+        // Whether function has machine code, compiling it if this call reaches the threshold
+        bool compiled(uint32_t function) {
+            if (jitCode[function]) return true;
+            if (++jitCounts[function] != jitThreshold) return false;
+            std::vector<uint8_t> code = JitCompiler(program, function, STACK_SLACK).compile();
+            void* entry = code.empty() ? nullptr : jitMemory.install(code);
+            jitCode[function] = reinterpret_cast<JitCode>(entry);
+            return entry != nullptr;
+        }
+
+        // Whether a call from the interpreter should go to machine code
+        bool runsNative(uint32_t function) {
+            return compiled(function) && static_cast<const char*>(__builtin_frame_address(0)) > jit.cStackFloor;
+        }
+
+        // From the interpreter into compiled code
+        int64_t callNative(uint32_t function, int64_t* args, size_t replacedFrames = 0) {
+            uint64_t frameDepth = jit.frameDepth;
+            jit.frameDepth = frames.size() - 1 - replacedFrames;
+            int64_t result = static_cast<int>(jitCode[function](args, &jit));
+            jit.frameDepth = frameDepth;
+            if (jit.failed) {
+                jit.failed = 0;
+                std::rethrow_exception(jitError);
+            }
+            if (maxDepth != UNLIMITED_DEPTH) frameLimit = frames.size();  // Limit was counted with compiled frames live
+            return result;
+        }
+
+        // From compiled code into a function that can't run compiled here (not compiled,
+        // or too little C stack left): room on the value stack first, then whichever fits
+        int64_t enterFunction(uint32_t function, int64_t* args) {
+            const BytecodeFunction* target = &program.functions[function];
+            size_t base = args - stack.data();
+            size_t needed = base + target->slotNames.size() + target->maxStack + STACK_SLACK;
+            if (needed > stack.size()) {
+                growStack(needed);
+                args = stack.data() + base;
+            }
+            if (jitCode[function] && static_cast<const char*>(__builtin_frame_address(0)) > jit.cStackFloor) {
+                return jitCode[function](args, &jit);
+            }
+
+            growFrames();  // Checks the depth limit, counting the compiled frames
+            frames.push_back(Frame{function, 0, static_cast<uint32_t>(base), RETURNS_TO_NATIVE});
+            stats.enter(frames.size() - 1 + nativeDepth());
+            int64_t* sp = args + target->params;
+            for (size_t i = target->params; i < target->slotNames.size(); ++i) *sp++ = UNSET_SLOT;
+            int64_t result = execute(target, target->code.data(), args, sp);
+            if (maxDepth != UNLIMITED_DEPTH) frameLimit = frames.size();
+            return result;
+        }
+
+        int64_t jitFailed() {
+            jitError = std::current_exception();
+            jit.failed = 1;
+            return 0;
+        }
+
+        /* Helpers called from generated code; exceptions stop here */
+
+        static int64_t jitCall(JitState* state, uint32_t site, int64_t* args) {
+            VirtualMachine* vm = state->vm;
+            try {
+                if (vm->callCaches[site].epoch != vm->epoch) vm->resolve(site);
+                uint32_t callee = vm->callCaches[site].target;
+                vm->compiled(callee);
+                return vm->enterFunction(callee, args);
+            } catch (...) {
+                return vm->jitFailed();
+            }
+        }
+
+        static int64_t jitEnter(int64_t* locals, JitState* state, uint32_t function) {
+            try {
+                return state->vm->enterFunction(function, locals);
+            } catch (...) {
+                return state->vm->jitFailed();
+            }
+        }
+
+        static int64_t jitGlobal(JitState* state, uint32_t symbol) {
+            try {
+                return state->vm->global(symbol);
+            } catch (...) {
+                return state->vm->jitFailed();
+            }
+        }
+
+        static int64_t jitBinary(JitState* state, uint32_t op, int32_t left, int32_t right) {
+            try {
+                return evaluateBinaryOperation(static_cast<char>(op), left, right);
+            } catch (...) {
+                return state->vm->jitFailed();
+            }
+        }
+
+        static void jitPrint(JitState* state, uint32_t op, uint32_t arg, int32_t value) {
+            switch (static_cast<Op>(op)) {
+                case Op::PrintString:
+                    if (arg & 1) Output::instance().space();
+                    Output::instance().write(state->vm->program.strings[arg >> 1]);
+                    break;
+                case Op::PrintValue:
+                    if (arg) Output::instance().space();
+                    Output::instance().integer(value);
+                    break;
+                default:
+                    Output::instance().endLine();
+                    break;
+            }
+        }
+
+        static void jitTooDeep(JitState* state) {
+            try {
+                throwRecursionError();
+            } catch (...) {
+                state->vm->jitFailed();
+            }
+        }
+#else
+        size_t nativeDepth() const {
+            return 0;
+        }
+#endif
+};
+
+/* ----------- CLOSURE COMPILER ----------- */
+// --engine=closure: every FlatAst node is turned, once, into a C++ closure that already
+// knows its operator, its operand kinds, its slots and its children. Running the program
+// is then just calling closures: no kind switch, no operator switch, no bytecode. Same
+// semantics and same Resolver frame slots as the VM.
+
+#if defined(__GNUC__)
+#define MYPYTHON_ALWAYS_INLINE __attribute__((always_inline)) inline  // For helpers of the hot call closures
+#else
+#define MYPYTHON_ALWAYS_INLINE inline
+#endif
+
+struct ClosureFunction;
+
+struct ClosureFrame {
+    int64_t* slots;
+    const ClosureFunction* function;  // nullptr for top-level code
+    int result;
+};
+
+typedef std::function<int(ClosureFrame&)> ClosureExpr;
+typedef std::function<bool(ClosureFrame&)> ClosureStmt;  // true while a return unwinds
+
+struct ClosureFunction {
+    SymbolId name;
+    uint32_t params = 0;
+    std::vector<SymbolId> slotNames;  // From the Resolver's FrameLayout
+    ClosureStmt body;
+    MemoTable* memo = nullptr;        // Set when memoizing and the function is pure
+};
+
+class ClosureCompiler {
+    public:
+        ClosureCompiler(const FlatAst& ast, const Resolution& names, size_t maxDepth = DEFAULT_MAX_DEPTH, MemoCache* memo = nullptr)
+            : ast(ast), names(names), maxDepth(maxDepth), memo(memo) {}
+
+        void run() {
+            std::vector<ClosureStmt> program;
+            for (FlatIndex stmt : ast.list(ast.root)) program.push_back(statement(stmt));
+
+            ClosureFrame module{nullptr, nullptr, 0};
+            for (const ClosureStmt& stmt : program) {
+                stmt(module);  // A top-level return only ends its own statement
+            }
+        }
+
+        const CallStats& getStats() const {
+            return stats;
+        }
+
+    private:
+        const FlatAst& ast;
+        const Resolution& names;
+        size_t maxDepth;
+        MemoCache* memo;   // nullptr unless memoizing
+        size_t depth = 0;  // Calls in progress
+        std::vector<std::unique_ptr<ClosureFunction>> compiled;
+        SymbolMap<const ClosureFunction*> functions;  // Defined so far, by name
+        std::deque<CallSiteCache<const ClosureFunction*>> callCaches;  // One per call closure; never moves
+        uint32_t epoch = 1;
+        SymbolMap<int> globals;
+        bool inFunction = false;  // Compiling a function body, where returns can tail call
+
+        // A tail call for the enclosing call closure to run in place, as in Interpreter.
+        // Its arguments wait in tailArgs from tailMark; nested calls stage above them.
+        const ClosureFunction* tailCallee = nullptr;
+        std::vector<int64_t> tailArgs;
+        size_t tailMark = 0;
+        bool tailDiscards = false;
+        CallStats stats;
+
+        /* --- Operands and operators the binary closures are specialized on --- */
+        struct ConstOperand {
+            int value;
+            int operator()(ClosureFrame&) const { return value; }
+        };
+
+        struct LocalOperand {
+            ClosureCompiler* self;
+            uint32_t slot;
+            int operator()(ClosureFrame& frame) const {
+                int64_t value = frame.slots[slot];
+                return value != UNSET_SLOT ? static_cast<int>(value) : self->global(frame.function->slotNames[slot]);
+            }
+        };
+
+        struct ExprOperand {
+            ClosureExpr expr;
+            int operator()(ClosureFrame& frame) const { return expr(frame); }
+        };
+
+#define MYPYTHON_CLOSURE_OP(name, expr) \
+        struct name { int operator()(int left, int right) const { return (expr); } };
+        MYPYTHON_CLOSURE_OP(AddOp, left + right)
+        MYPYTHON_CLOSURE_OP(SubtractOp, left - right)
+        MYPYTHON_CLOSURE_OP(MultiplyOp, left * right)
+        MYPYTHON_CLOSURE_OP(LessOp, left < right)
+        MYPYTHON_CLOSURE_OP(LessEqualOp, left <= right)
+        MYPYTHON_CLOSURE_OP(GreaterOp, left > right)
+        MYPYTHON_CLOSURE_OP(GreaterEqualOp, left >= right)
+        MYPYTHON_CLOSURE_OP(EqualOp, left == right)
+        MYPYTHON_CLOSURE_OP(NotEqualOp, left != right)
+#undef MYPYTHON_CLOSURE_OP
+
+        struct GenericOp { // The rarer operators: / // % ** keep their checks in one place
+            char op;
+            int operator()(int left, int right) const { return evaluateBinaryOperation(op, left, right); }
+        };
+
+        template <typename Op, typename L, typename R>
+        static ClosureExpr binary(Op op, L left, R right) {
+            return [=](ClosureFrame& frame) {
+                int l = left(frame);
+                return op(l, right(frame));
+            };
+        }
+
+        template <typename Op, typename L>
+        ClosureExpr binaryRight(Op op, L left, FlatIndex right) {
+            if (ast.kind(right) == ASTNodeType::Int) return binary(op, left, ConstOperand{ast.intValue(right)});
+            if (isLocal(right)) return binary(op, left, LocalOperand{this, names.slot(right)});
+            return binary(op, left, ExprOperand{expression(right)});
+        }
+
+        template <typename Op>
+        ClosureExpr binaryLeft(Op op, FlatIndex left, FlatIndex right) {
+            if (ast.kind(left) == ASTNodeType::Int) return binaryRight(op, ConstOperand{ast.intValue(left)}, right);
+            if (isLocal(left)) return binaryRight(op, LocalOperand{this, names.slot(left)}, right);
+            return binaryRight(op, ExprOperand{expression(left)}, right);
+        }
+
+        bool isLocal(FlatIndex node) const {
+            return ast.kind(node) == ASTNodeType::Identifier && names.slot(node) != GLOBAL_NAME;
+        }
+
+        /* --- Expressions --- */
+        ClosureExpr expression(FlatIndex node) {
+            switch (ast.kind(node)) {
+                case ASTNodeType::Int: {
+                    int value = ast.intValue(node);
+                    return [value](ClosureFrame&) { return value; };
+                }
+
+                case ASTNodeType::String:
+                    return [](ClosureFrame&) { return 0; };  // Strings are only printable
+
+                case ASTNodeType::Identifier: {
+                    if (isLocal(node)) return LocalOperand{this, names.slot(node)};
+                    SymbolId name = ast.symbol(node);
+                    return [this, name](ClosureFrame&) { return global(name); };
+                }
+
+                case ASTNodeType::BinaryOp: {
+                    FlatIndex left = ast.first(node), right = ast.second(node);
+                    switch (ast.op(node)) {
+                        case '+': return binaryLeft(AddOp(), left, right);
+                        case '-': return binaryLeft(SubtractOp(), left, right);
+                        case '*': return binaryLeft(MultiplyOp(), left, right);
+                        case '<': return binaryLeft(LessOp(), left, right);
+                        case 'L': return binaryLeft(LessEqualOp(), left, right);
+                        case '>': return binaryLeft(GreaterOp(), left, right);
+                        case 'G': return binaryLeft(GreaterEqualOp(), left, right);
+                        case 'E': return binaryLeft(EqualOp(), left, right);
+                        case 'N': return binaryLeft(NotEqualOp(), left, right);
+                        case '&': {
+                            ClosureExpr l = expression(left), r = expression(right);
+                            return [l, r](ClosureFrame& frame) { int value = l(frame); return value ? r(frame) : value; };
+                        }
+                        case '|': {
+                            ClosureExpr l = expression(left), r = expression(right);
+                            return [l, r](ClosureFrame& frame) { int value = l(frame); return value ? value : r(frame); };
+                        }
+                        default:
+                            return binaryLeft(GenericOp{ast.op(node)}, left, right);
+                    }
+                }
+
+                case ASTNodeType::UnaryOp: {
+                    ClosureExpr operand = expression(ast.first(node));
+                    if (ast.op(node) == '-') return [operand](ClosureFrame& frame) { return -operand(frame); };
+                    return [operand](ClosureFrame& frame) { return static_cast<int>(!operand(frame)); };
+                }
+
+                case ASTNodeType::FunctionCall:
+                    return call(node);
+
+                default: {
+                    ClosureStmt stmt = statement(node);  // Statements have no value
+                    return [stmt](ClosureFrame& frame) { stmt(frame); return 0; };
+                }
+            }
+        }
+
+        ClosureExpr call(FlatIndex node) {
+            SymbolId name = ast.symbol(node);
+            std::vector<ClosureExpr> args;
+            for (FlatIndex arg : ast.list(node)) args.push_back(expression(arg));
+
+            callCaches.emplace_back();
+            CallSiteCache<const ClosureFunction*>* cache = &callCaches.back();
+
+            if (memo && memo->memoizes(name)) {
+                return [this, name, args, cache](ClosureFrame& frame) {
+                    const ClosureFunction* callee = resolve(name, args.size(), *cache);
+                    int64_t inlineSlots[8];
+                    std::vector<int64_t> heapSlots;
+                    int64_t* slots = frameSlots(callee, inlineSlots, heapSlots);
+                    for (size_t i = 0; i < args.size(); ++i) slots[i] = args[i](frame);
+
+                    MemoTable* table = callee->memo;
+                    int result;
+                    if (table && table->find(slots, result)) return result;
+                    int64_t key[MEMO_MAX_ARITY];
+                    if (table) std::copy(slots, slots + args.size(), key);  // The body may reassign its parameters
+                    result = invoke(callee, slots, inlineSlots, heapSlots);
+                    if (table) table->store(key, result);
+                    return result;
+                };
+            }
+
+            return [this, name, args, cache](ClosureFrame& frame) {
+                const ClosureFunction* callee = resolve(name, args.size(), *cache);
+
+                // Small frames live on the C++ stack; bigger ones on the heap
+                int64_t inlineSlots[8];
+                std::vector<int64_t> heapSlots;
+                int64_t* slots = frameSlots(callee, inlineSlots, heapSlots);
+
+                for (size_t i = 0; i < args.size(); ++i) slots[i] = args[i](frame);  // In the caller
+                return invoke(callee, slots, inlineSlots, heapSlots);
+            };
+        }
+
+        // Runs a call whose arguments are in place. The slots buffers belong to the caller's
+        // closure; tail calls switch to the heap one if the next callee needs more room.
+        MYPYTHON_ALWAYS_INLINE int invoke(const ClosureFunction* callee, int64_t* slots, int64_t* inlineSlots, std::vector<int64_t>& heapSlots) {
+            for (size_t i = callee->params; i < callee->slotNames.size(); ++i) slots[i] = UNSET_SLOT;
+
+            if (depth >= maxDepth) throwRecursionError();
+            ClosureFrame calleeFrame{slots, callee, 0};
+            depth++;
+            stats.enter(depth);
+
+            // Tail calls come back here and run in the same frame, one after another
+            bool discard = false;
+            bool returned;
+            for (;;) {
+                returned = callee->body(calleeFrame);
+                if (!tailCallee) break;
+
+                callee = tailCallee;
+                tailCallee = nullptr;
+                discard = discard || tailDiscards;
+                slots = frameSlots(callee, inlineSlots, heapSlots);
+                std::copy(tailArgs.begin() + tailMark, tailArgs.end(), slots);
+                for (size_t i = callee->params; i < callee->slotNames.size(); ++i) slots[i] = UNSET_SLOT;
+                tailArgs.resize(tailMark);
+                calleeFrame = ClosureFrame{slots, callee, 0};
+                stats.enter(depth);
+                stats.tailCalls++;
+            }
+            depth--;
+            return returned && !discard ? calleeFrame.result : 0;
+        }
+
+        // A call in tail position: stage the arguments and unwind like a return
+        ClosureStmt tailCall(FlatIndex node, bool discard) {
+            SymbolId name = ast.symbol(node);
+            std::vector<ClosureExpr> args;
+            for (FlatIndex arg : ast.list(node)) args.push_back(expression(arg));
+
+            callCaches.emplace_back();
+            CallSiteCache<const ClosureFunction*>* cache = &callCaches.back();
+
+            return [this, name, args, cache, discard](ClosureFrame& frame) {
+                const ClosureFunction* callee = resolve(name, args.size(), *cache);
+                size_t mark = tailArgs.size();
+                for (const ClosureExpr& arg : args) tailArgs.push_back(arg(frame));
+                tailCallee = callee;
+                tailMark = mark;
+                tailDiscards = discard;
+                return true;
+            };
+        }
+
+        const ClosureFunction* resolve(SymbolId name, size_t argCount, CallSiteCache<const ClosureFunction*>& cache) {
+            if (cache.epoch != epoch) {
+                const ClosureFunction* const* found = functions.find(name);
+                if (!found) throw std::runtime_error("Function not defined: " + symbolName(name));
+                if ((*found)->params != argCount) throw std::runtime_error("Argument size mismatch");
+                cache.target = *found;
+                cache.epoch = epoch;
+            }
+            return cache.target;
+        }
+
+        static int64_t* frameSlots(const ClosureFunction* callee, int64_t* inlineSlots, std::vector<int64_t>& heapSlots) {
+            size_t slotCount = callee->slotNames.size();
+            if (slotCount <= 8) return inlineSlots;
+            if (heapSlots.size() < slotCount) heapSlots.resize(slotCount);
+            return heapSlots.data();
+        }
+
+        /* --- Statements --- */
+        // `tail`: the statement is the last thing its function runs, so a call there is a tail call
+        ClosureStmt statement(FlatIndex node, bool tail = false) {
+            switch (ast.kind(node)) {
+                case ASTNodeType::Assign: {
+                    ClosureExpr value = expression(ast.second(node));
+                    if (names.slot(node) != GLOBAL_NAME) {
+                        uint32_t slot = names.slot(node);
+                        return [value, slot](ClosureFrame& frame) { frame.slots[slot] = value(frame); return false; };
+                    }
+                    SymbolId name = ast.symbol(node);
+                    return [this, value, name](ClosureFrame& frame) { globals.set(name, value(frame)); return false; };
+                }
+
+                case ASTNodeType::Print: {
+                    struct Item {
+                        std::string text;  // Printed as is when there is no expression
+                        ClosureExpr expr;
+                    };
+                    std::vector<Item> items;
+                    for (FlatIndex expr : ast.list(node)) {
+                        if (ast.kind(expr) == ASTNodeType::String) {
+                            items.push_back(Item{ast.stringValue(expr).str(), nullptr});
+                        } else {
+                            items.push_back(Item{std::string(), expression(expr)});
+                        }
+                    }
+                    return [items](ClosureFrame& frame) {
+                        Output& out = Output::instance();
+                        bool separate = false;
+                        for (const Item& item : items) {
+                            if (item.expr) {
+                                if (separate) out.space();
+                                out.integer(item.expr(frame));
+                            } else {
+                                if (separate) out.space();
+                                out.write(item.text);
+                            }
+                            separate = true;
+                        }
+                        out.endLine();
+                        return false;
+                    };
+                }
+
+                case ASTNodeType::If: {
+                    ClosureExpr condition = expression(ast.first(node));
+                    ClosureStmt thenBranch = statement(ast.thenBranch(node), tail);
+                    if (ast.elseBranch(node) == NO_NODE) {
+                        return [condition, thenBranch](ClosureFrame& frame) {
+                            return condition(frame) ? thenBranch(frame) : false;
+                        };
+                    }
+                    ClosureStmt elseBranch = statement(ast.elseBranch(node), tail);
+                    return [condition, thenBranch, elseBranch](ClosureFrame& frame) {
+                        return condition(frame) ? thenBranch(frame) : elseBranch(frame);
+                    };
+                }
+
+                case ASTNodeType::Block: {
+                    std::vector<ClosureStmt> statements;
+                    FlatSpan list = ast.list(node);
+                    for (size_t i = 0; i < list.size(); ++i) statements.push_back(statement(list[i], tail && i + 1 == list.size()));
+                    return [statements](ClosureFrame& frame) {
+                        for (const ClosureStmt& stmt : statements) {
+                            if (stmt(frame)) return true;
+                        }
+                        return false;
+                    };
+                }
+
+                case ASTNodeType::Function: {
+                    const ClosureFunction* fn = function(node);
+                    return [this, fn](ClosureFrame&) { functions.set(fn->name, fn); epoch++; return false; };
+                }
+
+                case ASTNodeType::Return: {
+                    if (inFunction && ast.kind(ast.first(node)) == ASTNodeType::FunctionCall) return tailCall(ast.first(node), false);
+                    ClosureExpr value = expression(ast.first(node));
+                    return [value](ClosureFrame& frame) { frame.result = value(frame); return true; };
+                }
+
+                case ASTNodeType::Identifier: {
+                    SymbolId name = ast.symbol(node);
+                    uint32_t slot = names.slot(node);
+                    return [this, name, slot](ClosureFrame& frame) {
+                        try {
+                            if (slot == GLOBAL_NAME || frame.slots[slot] == UNSET_SLOT) global(name);
+                        } catch (const std::runtime_error& e) {
+                            Output::instance().flush();  // Keep it after what was printed before
+                            std::cerr << "Runtime Error: " << e.what() << std::endl;
+                        }
+                        return false;
+                    };
+                }
+
+                case ASTNodeType::Int:
+                case ASTNodeType::String:
+                    return [](ClosureFrame&) { return false; };
+
+                case ASTNodeType::FunctionCall:
+                    if (tail) return tailCall(node, true);  // The caller returns None, not the callee's result
+                    // Fallthrough
+                default: {
+                    ClosureExpr expr = expression(node);  // Expression statement
+                    return [expr](ClosureFrame& frame) { expr(frame); return false; };
+                }
+            }
+        }
+
+        const ClosureFunction* function(FlatIndex node) {
+            compiled.emplace_back(new ClosureFunction());
+            ClosureFunction* fn = compiled.back().get();
+            fn->name = ast.symbol(node);
+            fn->params = names.layout(node).params;
+            fn->slotNames = names.layout(node).slotNames;
+            fn->memo = memo ? memo->table(node) : nullptr;
+            bool outer = inFunction;
+            inFunction = true;
+            fn->body = statement(ast.body(node), true);
+            inFunction = outer;
+            return fn;
+        }
+
+        int global(SymbolId name) const {
+            if (const int* value = globals.find(name)) return *value;
+            throw std::runtime_error("Variable not defined: " + symbolName(name));
+        }
+};
+
+/* ----------- C++ BACKEND ----------- */
+// --emit-cpp: the (optimized) pointer AST written out as one self-contained C++ file, for
+// scripts that run often enough to be worth a trip through g++ -O2. Semantics are the
+// tree engine's, limits the vm's: every def becomes a C++ function, registered in a
+// table by name when its def runs, so calls still bind at run time; variables are
+// fixed slots; each expression is split into temporaries in evaluation order; tail
+// calls to the function itself loop, other tail calls return to a trampoline in
+// call(); prints go to one big buffer written with write(2). The file builds either
+// into a program or, with -shared -fPIC, into a module for --native.
+
+/* --- Runtime --- */
+// Copied verbatim to the top of every emitted file. MYPYTHON_MAX_ARGS,
+// MYPYTHON_MAX_DEPTH and MYPYTHON_MAX_STACK are defined just before it.
+const char* const CPP_RUNTIME = R"RUNTIME(
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <pthread.h>
+#include <unistd.h>
+
+namespace {
+
+typedef int (*Code)(const int* args);
+
+struct Variable {
+    int value;
+    bool set;
+};
+
+struct Function {
+    Code code;  // nullptr until its def runs
+    unsigned arity;
+};
+
+struct TailCall {
+    Code code;  // Set by a function returning through a tail call
+    bool discard;
+    int args[MYPYTHON_MAX_ARGS + 1];
+};
+
+extern Variable globals[];
+extern const char* const globalNames[];
+extern Function functions[];
+extern const char* const functionNames[];
+void program();
+
+TailCall tail;
+size_t depth = 0;
+size_t stackLimit = MYPYTHON_MAX_STACK;
+const char* stackFloor = nullptr;
+
+/* Output */
+
+char outBuffer[1 << 16];
+size_t outUsed = 0;
+bool outTty = false;
+
+inline void writeAll(const char* text, size_t size) {
+    for (size_t done = 0; done < size; ) {
+        ssize_t n = ::write(1, text + done, size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += static_cast<size_t>(n);
+    }
+}
+
+inline void flushOut() {
+    writeAll(outBuffer, outUsed);
+    outUsed = 0;
+}
+
+inline void writeOut(const char* text, size_t size) {
+    if (outUsed + size > sizeof outBuffer) {
+        flushOut();
+        if (size > sizeof outBuffer) {
+            writeAll(text, size);
+            return;
+        }
+    }
+    std::memcpy(outBuffer + outUsed, text, size);
+    outUsed += size;
+}
+
+inline void printString(bool space, const char* text, size_t size) {
+    if (space) writeOut(" ", 1);
+    writeOut(text, size);
+}
+
+inline void printInt(bool space, int value) {
+    char digits[16];
+    char* end = digits + sizeof digits;
+    char* p = end;
+    unsigned magnitude = value < 0 ? 0u - static_cast<unsigned>(value) : static_cast<unsigned>(value);
+    do {
+        *--p = static_cast<char>('0' + magnitude % 10);
+    } while (magnitude /= 10);
+    if (value < 0) *--p = '-';
+    if (space) *--p = ' ';
+    writeOut(p, static_cast<size_t>(end - p));
+}
+
+inline void printEnd() {
+    writeOut("\n", 1);
+    if (outTty) flushOut();
+}
+
+/* Errors */
+
+[[noreturn]] inline void fail(const std::string& message) {
+    throw std::runtime_error(message);
+}
+
+[[noreturn]] inline void recursionError(const std::string& detail) {
+    fail("RecursionError: maximum recursion depth exceeded" + detail);
+}
+
+inline int read(size_t global) {
+    if (!globals[global].set) fail(std::string("Variable not defined: ") + globalNames[global]);
+    return globals[global].value;
+}
+
+// A bare name as a statement: complain, but carry on
+inline void checkName(size_t global) {
+    if (globals[global].set) return;
+    flushOut();
+    std::fprintf(stderr, "Runtime Error: Variable not defined: %s\n", globalNames[global]);
+}
+
+/* Operators */
+
+inline int add(int left, int right) { return static_cast<int>(static_cast<unsigned>(left) + static_cast<unsigned>(right)); }
+inline int subtract(int left, int right) { return static_cast<int>(static_cast<unsigned>(left) - static_cast<unsigned>(right)); }
+inline int multiply(int left, int right) { return static_cast<int>(static_cast<unsigned>(left) * static_cast<unsigned>(right)); }
+inline int negate(int operand) { return static_cast<int>(0u - static_cast<unsigned>(operand)); }
+inline int modulo(int left, int right) { return left % right; }  // Traps on 0 and INT_MIN % -1, as the interpreter does
+
+inline int divide(int left, int right) {
+    if (right == 0) fail("Division by zero.");
+    return left / right;
+}
+
+inline int floorDivide(int left, int right) {
+    if (right == 0) fail("Division by zero.");
+    int quotient = left / right;
+    return (left % right != 0 && ((left < 0) != (right < 0))) ? quotient - 1 : quotient;
+}
+
+inline int power(int base, int exponent) {
+    if (exponent < 0) fail("Negative exponents are not supported for integers.");
+    int result = 1;
+    for (; exponent > 0; exponent >>= 1, base = multiply(base, base)) {
+        if (exponent & 1) result = multiply(result, base);
+    }
+    return result;
+}
+
+/* Calls */
+
+inline Code resolve(size_t function, unsigned arity) {
+    if (!functions[function].code) fail(std::string("Function not defined: ") + functionNames[function]);
+    if (functions[function].arity != arity) fail("Argument size mismatch");
+    return functions[function].code;
+}
+
+// A call that isn't a tail call. Tail calls made by the callee come back here and run
+// one after another, so they don't nest.
+inline int call(Code code, const int* args) {
+    if (depth >= MYPYTHON_MAX_DEPTH) recursionError("");
+    if (static_cast<const char*>(__builtin_frame_address(0)) < stackFloor) {
+        recursionError(" (call stack reached the " + std::to_string(stackLimit >> 20) + " MB limit of --max-stack)");
+    }
+    ++depth;
+    int result = code(args);
+    bool discard = false;
+    while (tail.code) {
+        Code next = tail.code;
+        tail.code = nullptr;
+        discard = discard || tail.discard;
+        int moved[MYPYTHON_MAX_ARGS + 1];
+        std::memcpy(moved, tail.args, sizeof moved);
+        result = next(moved);
+    }
+    --depth;
+    return discard ? 0 : result;
+}
 
-            int conditionResult = evaluate(node->getCondition().get()); // Are you a 0 or a 1?
-            std::cout << "Condition result: " << conditionResult << std::endl;
+/* Entry */
 
-            // If the condition is true, execute the thenBranch
-            if (conditionResult == 1) {
+const size_t STACK_RESERVE = 1 << 20;  // For the runtime and the C library below the limit
 
-                BlockNode* thenBlock = node->getThenBranch().get();  
+void* run(void* status) {
+    stackFloor = static_cast<const char*>(__builtin_frame_address(0)) - stackLimit;
+    try {
+        program();
+        flushOut();
+    } catch (const std::exception& e) {
+        flushOut();
+        std::fprintf(stderr, "Error: %s\n", e.what());
+        *static_cast<int*>(status) = 1;
+    }
+    return nullptr;
+}
 
-                if (thenBlock) {
-                    std::cout << "Executing thenBranch of IfNode." << std::endl;
-                    for (const auto& stmt : thenBlock->getStatements()) {  // Access the statements inside BlockNode
-                        stmt->accept(this);  // Visit each statement in the block
-                    }
+}  // namespace
+
+// Runs the script on a thread whose stack is big enough for --max-stack; the exit status
+extern "C" int mypython_main() {
+    outTty = isatty(1);
+    int status = 0;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, MYPYTHON_MAX_STACK + 2 * STACK_RESERVE);
+    pthread_t thread;
+    if (pthread_create(&thread, &attributes, run, &status) != 0) {
+        stackLimit = 4 << 20;  // Stay on this thread, with what's likely left of its stack
+        run(&status);
+    } else {
+        pthread_join(thread, nullptr);
+    }
+    pthread_attr_destroy(&attributes);
+    return status;
+}
 
-                }
+int main() {
+    return mypython_main();
+}
+)RUNTIME";
 
-            } else if (conditionResult == 0) {
+/* --- Emitter --- */
+class CppEmitter {
+    public:
+        // The limits are baked in: maxDepth as given to the vm (UNLIMITED_DEPTH for none)
+        CppEmitter(size_t maxDepth, size_t maxStackBytes) : maxDepth(maxDepth), maxStackBytes(maxStackBytes) {}
+
+        void emit(const NodeList& program, std::ostream& out) {
+            Scope top;
+            scope = &top;
+            for (size_t i = 0; i < program.size(); ++i) topLevel(program[i], i);
+            scope = nullptr;
+
+            out << "// Generated by mypython --emit-cpp. Build with: g++ -std=c++14 -O2 -pthread FILE.cpp\n"
+                << "// (or -shared -fPIC for a module to load with mypython --native=FILE.so)\n\n";
+            out << "#define MYPYTHON_MAX_ARGS " << maxArgs << "\n";
+            out << "#define MYPYTHON_MAX_DEPTH ";
+            if (maxDepth == UNLIMITED_DEPTH) out << "SIZE_MAX\n"; else out << maxDepth << "u\n";
+            out << "#define MYPYTHON_MAX_STACK static_cast<size_t>(" << maxStackBytes << "ull)\n";
+            out << CPP_RUNTIME << "\nnamespace {\n\n";
+
+            out << "Variable globals[" << std::max<size_t>(globalNames.size(), 1) << "];\n";
+            out << "const char* const globalNames[] = {";
+            for (const std::string& name : globalNames) out << "\n    " << quote(name) << ",";
+            out << (globalNames.empty() ? "nullptr};\n" : "\n};\n");
+            out << "Function functions[" << std::max<size_t>(functionNames.size(), 1) << "];\n";
+            out << "const char* const functionNames[] = {";
+            for (const std::string& name : functionNames) out << "\n    " << quote(name) << ",";
+            out << (functionNames.empty() ? "nullptr};\n" : "\n};\n");
+
+            for (size_t i = 0; i < functionBodies.size(); ++i) out << "\nint f" << i << "(const int* args);";
+            out << "\n";
+            for (const std::string& body : functionBodies) out << "\n" << body;
+            out << "\nvoid program() {\n" << top.code.str() << "}\n\n}  // namespace\n";
+        }
 
-                BlockNode* elseBlock = node->getElseBranch().get(); // Check if there is an elseBranch and execute it
+    private:
+        // Where code is going: top-level code, or the body of one def
+        struct Scope {
+            std::ostringstream code;
+            FunctionNode* function = nullptr;  // nullptr at top level
+            size_t index = 0;                  // Of the C++ function
+            std::unordered_map<SymbolId, std::string> params;  // Name -> C++ variable
+            std::unordered_map<SymbolId, std::string> locals;
+            unsigned temps = 0;
+            unsigned indent = 1;
+            bool loops = false;      // Has a tail call to itself
+            bool discards = false;   // Has tail calls made as statements, and returns: may have to return None
+            std::string endOfStatement;  // Top level: where a return goes
+        };
+
+        size_t maxDepth;
+        size_t maxStackBytes;
+        Scope* scope = nullptr;
+        size_t maxArgs = 0;
+        std::unordered_map<SymbolId, size_t> globalSlots, functionSlots;
+        std::vector<std::string> globalNames, functionNames;
+        std::vector<std::string> functionBodies;
+
+        std::ostream& line() {
+            return scope->code << std::string(scope->indent * 4, ' ');
+        }
 
-                if (elseBlock) {
-                    std::cout << "Executing elseBranch of IfNode." << std::endl;
-                    for (const auto& stmt : elseBlock->getStatements()) {
-                        stmt->accept(this);  // Visit each statement in the else block
-                    }
-                } else {
-                    std::cout << "No elseBranch to execute." << std::endl;
-                }
+        std::string temp() {
+            return "t" + std::to_string(scope->temps++);
+        }
 
-            }
+        size_t globalSlot(SymbolId name) {
+            auto found = globalSlots.find(name);
+            if (found != globalSlots.end()) return found->second;
+            globalNames.push_back(symbolName(name));
+            return globalSlots[name] = globalNames.size() - 1;
+        }
 
+        size_t functionSlot(SymbolId name) {
+            auto found = functionSlots.find(name);
+            if (found != functionSlots.end()) return found->second;
+            functionNames.push_back(symbolName(name));
+            return functionSlots[name] = functionNames.size() - 1;
         }
 
-        void visit(BlockNode* node) override {
-            // Check if the BlockNode is not null and has statements
-            if (node) {
-                // Iterate over each statement in the block and accept the visitor
-                for (const auto& stmt : node->getStatements()) {
-                    stmt->accept(this);
+        static std::string quote(const std::string& text) {
+            std::string quoted = "\"";
+            for (unsigned char c : text) {
+                if (c == '"' || c == '\\' || c == '?') {
+                    quoted += '\\';
+                    quoted += static_cast<char>(c);
+                } else if (c < 0x20 || c >= 0x7f) {
+                    char escape[8];
+                    std::snprintf(escape, sizeof escape, "\\%03o", c);  // Octal stops after 3 digits
+                    quoted += escape;
+                } else {
+                    quoted += static_cast<char>(c);
                 }
             }
-        }
-        
-        void visit(FunctionNode* node) override {
-            std::cout << "Executing function: " << node->getName() << std::endl;
-            functions[node->getName()] = node;
+            return quoted + "\"";
         }
 
-        void visit(FunctionCallNode* node) override {
-            std::cout << "Function call: " << node->getName() << std::endl;
+        static std::string literal(int value) {
+            return value == INT_MIN ? "(-2147483647 - 1)" : std::to_string(value);
+        }
 
-    // Retrieve the function definition from the stored functions
-            FunctionNode* funcDef = functions[node->getName()];
-            if (funcDef == nullptr) {
-                throw std::runtime_error("Function not defined: " + node->getName());
-    }
+        /* Statements */
 
-    // Check if argument sizes match
-            if (funcDef->getParameters().size() != node->getArguments().size()) {
-                throw std::runtime_error("Argument size mismatch");
-    }
+        void topLevel(ASTNode* stmt, size_t index) {
+            if (!containsReturn(stmt)) {
+                statement(stmt, false);
+                return;
+            }
+            // A top-level return only ends its own statement
+            scope->endOfStatement = "s" + std::to_string(index);
+            line() << "{\n";
+            scope->indent++;
+            statement(stmt, false);
+            scope->indent--;
+            line() << "}\n";
+            line() << scope->endOfStatement << ":;\n";
+        }
 
-    // Create a new scope for the function call
-            auto newScope = std::make_shared<Scope>(currentScope);
+        // `tail`: the last thing its function runs, so a call here can reuse the frame
+        void statement(ASTNode* stmt, bool tail) {
+            switch (stmt->getType()) {
+                case ASTNodeType::Assign: {
+                    AssignNode* assign = dynamic_cast<AssignNode*>(stmt);
+                    std::string value = expression(assign->getValue());
+                    SymbolId name = assign->getIdentifier();
+                    if (scope->params.count(name)) {
+                        if (!scope->params[name].empty()) line() << scope->params[name] << " = " << value << ";\n";
+                    } else if (scope->locals.count(name)) {
+                        line() << scope->locals[name] << " = Variable{" << value << ", true};\n";
+                    } else {
+                        line() << "globals[" << globalSlot(name) << "] = Variable{" << value << ", true};\n";
+                    }
+                    break;
+                }
+                case ASTNodeType::Print:
+                    print(dynamic_cast<PrintNode*>(stmt));
+                    break;
+                case ASTNodeType::If: {
+                    IfNode* ifNode = dynamic_cast<IfNode*>(stmt);
+                    std::string condition = expression(ifNode->getCondition());
+                    line() << "if (" << condition << ") {\n";
+                    block(ifNode->getThenBranch(), tail);
+                    if (ifNode->getElseBranch()) {
+                        line() << "} else {\n";
+                        block(ifNode->getElseBranch(), tail);
+                    }
+                    line() << "}\n";
+                    break;
+                }
+                case ASTNodeType::Block:
+                    line() << "{\n";
+                    block(dynamic_cast<BlockNode*>(stmt), tail);
+                    line() << "}\n";
+                    break;
+                case ASTNodeType::Function:
+                    define(dynamic_cast<FunctionNode*>(stmt));
+                    break;
+                case ASTNodeType::Return: {
+                    ASTNode* value = dynamic_cast<ReturnNode*>(stmt)->getValue();
+                    if (!scope->function) {
+                        expression(value);
+                        line() << "goto " << scope->endOfStatement << ";\n";
+                    } else if (value->getType() == ASTNodeType::FunctionCall) {
+                        tailCall(dynamic_cast<FunctionCallNode*>(value), false);
+                    } else {
+                        std::string result = expression(value);
+                        line() << "return " << (scope->discards ? "discard ? 0 : " : "") << result << ";\n";
+                    }
+                    break;
+                }
+                case ASTNodeType::FunctionCall: {
+                    FunctionCallNode* call = dynamic_cast<FunctionCallNode*>(stmt);
+                    if (tail && scope->function) {
+                        tailCall(call, true);
+                        break;
+                    }
+                    std::string code = resolve(call);
+                    std::string args = arguments(call);
+                    line() << "call(" << code << ", " << args << ");\n";
+                    break;
+                }
+                case ASTNodeType::Identifier: {
+                    SymbolId name = dynamic_cast<IdentifierNode*>(stmt)->getIdentifier();
+                    if (scope->params.count(name)) break;
+                    if (scope->locals.count(name)) {
+                        line() << "if (!" << scope->locals[name] << ".set) checkName(" << globalSlot(name) << ");\n";
+                    } else {
+                        line() << "checkName(" << globalSlot(name) << ");\n";
+                    }
+                    break;
+                }
+                case ASTNodeType::Int:
+                case ASTNodeType::String:
+                    break;
+                default: {
+                    std::string value = expression(stmt);
+                    if (value[0] == 't') line() << "(void)" << value << ";\n";
+                    break;
+                }
+            }
+        }
 
-    // Evaluate each argument and set it in the new scope
-            for (size_t i = 0; i < node->getArguments().size(); ++i) {
-                int argValue = evaluate(node->getArguments()[i].get());
-                newScope->setVariable(funcDef->getParameters()[i], argValue);
-    }
+        void block(BlockNode* block, bool tail) {
+            scope->indent++;
+            const NodeList& statements = block->getStatements();
+            for (size_t i = 0; i < statements.size(); ++i) statement(statements[i], tail && i + 1 == statements.size());
+            scope->indent--;
+        }
 
-    // Save the current scope to restore later
-            auto previousScope = currentScope;
-    // Switch to the new scope for the duration of the function call
-            currentScope = newScope;
+        void print(PrintNode* node) {
+            bool space = false;
+            for (ASTNode* expr : node->getExpressions()) {
+                if (expr->getType() == ASTNodeType::String) {
+                    StringRef text = dynamic_cast<StringNode*>(expr)->getValue();
+                    std::string value(text.data, text.size);
+                    line() << "printString(" << space << ", " << quote(value) << ", " << value.size() << ");\n";
+                } else {
+                    std::string value = expression(expr);
+                    line() << "printInt(" << space << ", " << value << ");\n";
+                }
+                space = true;
+            }
+            line() << "printEnd();\n";
+        }
 
-    // Execute the function body
-            funcDef->getBody()->accept(this);
+        // Registers the def, and emits its body as a C++ function of its own
+        void define(FunctionNode* node) {
+            size_t index = functionBodies.size();
+            functionBodies.emplace_back();
+            maxArgs = std::max(maxArgs, node->getParameters().size());
+            line() << "functions[" << functionSlot(node->getName()) << "] = Function{f" << index << ", "
+                   << node->getParameters().size() << "};\n";
+
+            Scope body;
+            body.function = node;
+            body.index = index;
+            // Parameters it never reads needn't exist
+            std::unordered_set<SymbolId> reads;
+            collectReads(node->getBody(), reads);
+            for (size_t i = 0; i < node->getParameters().size(); ++i) {
+                SymbolId param = node->getParameters()[i];
+                body.params[param] = reads.count(param) ? "p" + std::to_string(i) : "";
+            }
+            collectLocals(node->getBody(), body);
+            body.discards = endsInCall(node->getBody()) && containsReturn(node->getBody());
+
+            // The body decides whether it needs the loop label and the discard flag, so
+            // it goes first and the prologue is put in front of it
+            Scope* outer = scope;
+            scope = &body;
+            block(node->getBody(), true);
+            scope = outer;
+
+            std::ostringstream function;
+            function << "// def " << symbolName(node->getName()) << "(";
+            for (size_t i = 0; i < node->getParameters().size(); ++i) {
+                function << (i ? ", " : "") << symbolName(node->getParameters()[i]);
+            }
+            std::vector<std::pair<size_t, std::string>> params = sortedParams(body);
+            function << ")\nint f" << index << (params.empty() ? "(const int*) {\n" : "(const int* args) {\n");  // -Wunused-parameter
+            for (const auto& param : params) function << "    int " << param.second << " = args[" << param.first << "];\n";
+            for (const auto& local : sortedLocals(body)) function << "    Variable " << local << ";\n";
+            if (body.discards) function << "    bool discard = false;\n";
+            if (body.loops) function << "  top:\n";
+            for (const auto& local : sortedLocals(body)) function << "    " << local << ".set = false;\n";
+            function << body.code.str() << "    return 0;\n}\n";
+            functionBodies[index] = function.str();
+        }
 
-    // Retrieve the return value from the new scope
-            int returnValue = currentScope->getReturnValue();
+        // A name the function assigns is its local (params aside), however deeply nested
+        static void collectLocals(ASTNode* node, Scope& body) {
+            if (node->getType() == ASTNodeType::Function) return;  // Its own scope
+            if (node->getType() == ASTNodeType::Assign) {
+                SymbolId name = dynamic_cast<AssignNode*>(node)->getIdentifier();
+                if (!body.params.count(name) && !body.locals.count(name)) {
+                    body.locals[name] = "l" + std::to_string(body.locals.size());
+                }
+            }
+            forEachChild(node, [&](ASTNode* child) { collectLocals(child, body); });
+        }
 
-    // Restore the previous scope after the function call
-            currentScope = previousScope;
+        static void collectReads(ASTNode* node, std::unordered_set<SymbolId>& reads) {
+            if (node->getType() == ASTNodeType::Function) return;
+            if (node->getType() == ASTNodeType::Identifier) reads.insert(dynamic_cast<IdentifierNode*>(node)->getIdentifier());
+            forEachChild(node, [&](ASTNode* child) { collectReads(child, reads); });
+        }
 
-    // Set the return value in the current scope
-            currentScope->setReturnValue(returnValue);
+        // (position, C++ name) of the parameters it reads
+        static std::vector<std::pair<size_t, std::string>> sortedParams(const Scope& body) {
+            std::vector<std::pair<size_t, std::string>> params;
+            for (const auto& param : body.params) {
+                if (!param.second.empty()) params.emplace_back(std::stoul(param.second.substr(1)), param.second);
+            }
+            std::sort(params.begin(), params.end());
+            return params;
+        }
 
-    // No need to return a value here since the return type is void
-    // The return value is stored in the current scope's returnValue variable
-}
+        static std::vector<std::string> sortedLocals(const Scope& body) {
+            std::vector<std::string> names(body.locals.size());
+            for (const auto& local : body.locals) names[std::stoul(local.second.substr(1))] = local.second;
+            return names;
+        }
 
-            
-            
-            
-        
-        // Implement other visit methods...
-  
-    private:
-        int evaluate(ASTNode* node) {
+        // Whether some path through the block ends in a call statement: a tail call whose
+        // result is thrown away
+        static bool endsInCall(ASTNode* node) {
             switch (node->getType()) {
-                case ASTNodeType::Int:
-                    return dynamic_cast<IntNode*>(node)->getValue();
-
-                case ASTNodeType::Identifier:
-                    return currentScope->getVariable(dynamic_cast<IdentifierNode*>(node)->getIdentifier());
-
-                case ASTNodeType::BinaryOp: {
-        
-                    BinaryOpNode* binNode = dynamic_cast<BinaryOpNode*>(node);
-                    
-                    int left = evaluate(binNode->getLeft().get()); // Use .get() to retrieve raw pointers from unique_ptr for recursive calls
-                    int right = evaluate(binNode->getRight().get());
-
-                    return evaluateBinaryOperation(binNode->getOp(), left, right);
-                    
+                case ASTNodeType::FunctionCall:
+                    return true;
+                case ASTNodeType::If: {
+                    IfNode* ifNode = dynamic_cast<IfNode*>(node);
+                    return endsInCall(ifNode->getThenBranch()) || (ifNode->getElseBranch() && endsInCall(ifNode->getElseBranch()));
                 }
-                case ASTNodeType::Return: {
-                    ReturnNode* returnNode = dynamic_cast<ReturnNode*>(node);
-                    return evaluate(returnNode->getValue());
+                case ASTNodeType::Block: {
+                    const NodeList& statements = dynamic_cast<BlockNode*>(node)->getStatements();
+                    return !statements.empty() && endsInCall(statements[statements.size() - 1]);
                 }
-                case ASTNodeType::FunctionCall: {
-                    FunctionCallNode* funcCallNode = dynamic_cast<FunctionCallNode*>(node);
-                    FunctionNode* funcDef = functions[funcCallNode->getName()];
-                    if (!funcDef) {
-                        throw std::runtime_error("Function not defined: " + funcCallNode->getName());
-    }
-    
-    // Create a new scope for the function call
-                    auto newScope = std::make_shared<Scope>(currentScope);
-    // ... Push currentScope on the stack or switch to newScope
-
-    // Evaluate each argument and set it in the new scope
-                    const auto& params = funcDef->getParameters();
-                    const auto& args = funcCallNode->getArguments();
-                    for (size_t i = 0; i < args.size(); ++i) {
-                        int argValue = evaluate(args[i].get());
-                        newScope->setVariable(params[i], argValue);
-                    }
-
-                    // Switch to the new scope and execute the function body
-                    currentScope = newScope;
-                    funcDef->getBody()->accept(this);
+                default:
+                    return false;
+            }
+        }
 
-                    // Handle the return value from the function
-                    int returnValue = currentScope->getReturnValue(); // This would come from your mechanism for return values
+        static bool containsReturn(ASTNode* node) {
+            if (node->getType() == ASTNodeType::Return) return true;
+            if (node->getType() == ASTNodeType::Function) return false;
+            bool found = false;
+            forEachChild(node, [&](ASTNode* child) { found = found || containsReturn(child); });
+            return found;
+        }
 
-                    // Restore the old scope
-                    currentScope = currentScope->getParent();
+        // Leaves the function: into itself by looping, into anything else through call()
+        void tailCall(FunctionCallNode* node, bool statement) {
+            std::string code = resolve(node);
+            std::string args = arguments(node);
+            size_t count = node->getArguments().size();
+            std::string discard = statement ? "true" : scope->discards ? "discard" : "false";
+
+            line() << "if (" << code << " == f" << scope->index << ") {\n";
+            for (const auto& param : sortedParams(*scope)) line() << "    " << param.second << " = " << args << "[" << param.first << "];\n";
+            if (statement && scope->discards) line() << "    discard = true;\n";
+            line() << "    goto top;\n";
+            line() << "}\n";
+            scope->loops = true;
+            line() << "tail.code = " << code << ";\n";
+            line() << "tail.discard = " << discard << ";\n";
+            for (size_t i = 0; i < count; ++i) line() << "tail.args[" << i << "] = " << args << "[" << i << "];\n";
+            line() << "return 0;\n";
+        }
 
-                    return returnValue;
-}
+        /* Expressions */
 
-                case ASTNodeType::Print: {
-                    PrintNode* printNode = dynamic_cast<PrintNode*>(node);
-                    for (const auto& expr : printNode->getExpressions()) {
-                        if (expr->getType() == ASTNodeType::Identifier) {
-                            IdentifierNode* idNode = dynamic_cast<IdentifierNode*>(expr.get());
-                            std::cout << currentScope->getVariable(idNode->getIdentifier()) << " ";
-                        } else if (expr->getType() == ASTNodeType::String) {
-                            StringNode* strNode = dynamic_cast<StringNode*>(expr.get());
-                            std::cout << strNode->getValue() << " ";
-                        }
-                    }
-                    std::cout << std::endl;
-                    return 0;
-                }
-                case ASTNodeType::If: {
-                    IfNode* ifNode = dynamic_cast<IfNode*>(node);
-                    int condition = evaluate(ifNode->getCondition().get());
-                    if (condition) {
-                        ifNode->getThenBranch()->accept(this);
+        // Emits whatever evaluating node takes and returns a C++ expression for its value
+        // that has no side effects and can't throw: a literal, a parameter or a temporary.
+        // Everything else goes through temporaries, which keeps Python's left-to-right order.
+        std::string expression(ASTNode* node) {
+            switch (node->getType()) {
+                case ASTNodeType::Int:
+                    return literal(dynamic_cast<IntNode*>(node)->getValue());
+                case ASTNodeType::String:
+                    return "0";
+                case ASTNodeType::Identifier: {
+                    SymbolId name = dynamic_cast<IdentifierNode*>(node)->getIdentifier();
+                    if (scope->params.count(name)) return scope->params[name];
+                    std::string value = temp();
+                    if (scope->locals.count(name)) {
+                        const std::string& local = scope->locals[name];
+                        line() << "int " << value << " = " << local << ".set ? " << local << ".value : read(" << globalSlot(name) << ");\n";
                     } else {
-                        if (ifNode->getElseBranch()) {
-                            ifNode->getElseBranch()->accept(this);
-                        }
+                        line() << "int " << value << " = read(" << globalSlot(name) << ");\n";
                     }
-                    return 0;
+                    return value;
                 }
-                case ASTNodeType::Block: {
-                    BlockNode* blockNode = dynamic_cast<BlockNode*>(node);
-                    for (const auto& stmt : blockNode->getStatements()) {
-                        stmt->accept(this);
+                case ASTNodeType::BinaryOp:
+                    return binary(dynamic_cast<BinaryOpNode*>(node));
+                case ASTNodeType::UnaryOp: {
+                    UnaryOpNode* unary = dynamic_cast<UnaryOpNode*>(node);
+                    std::string operand = expression(unary->getOperand());
+                    std::string value = temp();
+                    if (unary->getOp() == '-') {
+                        line() << "int " << value << " = negate(" << operand << ");\n";
+                    } else {
+                        line() << "int " << value << " = !" << operand << ";\n";
                     }
-                    return 0;
-                }
-                case ASTNodeType::Assign: {
-                    AssignNode* assignNode = dynamic_cast<AssignNode*>(node);
-                    int value = evaluate(assignNode->getValue());
-                    currentScope->setVariable(assignNode->getIdentifier(), value);
-                    return 0;
+                    return value;
                 }
-                case ASTNodeType::Function: {
-                    FunctionNode* funcNode = dynamic_cast<FunctionNode*>(node);
-                    std::cout << "Function definition: " << funcNode->getName() << std::endl;
-                    return 0;
+                case ASTNodeType::FunctionCall: {
+                    FunctionCallNode* call = dynamic_cast<FunctionCallNode*>(node);
+                    std::string code = resolve(call);
+                    std::string args = arguments(call);
+                    std::string value = temp();
+                    line() << "int " << value << " = call(" << code << ", " << args << ");\n";
+                    return value;
                 }
-                case ASTNodeType::String:
-                    return 0;
-                
-
+                case ASTNodeType::Print:
+                    print(dynamic_cast<PrintNode*>(node));
+                    return "0";
                 default:
-                    throw std::runtime_error("Evaluation error: Unknown node type or unsupported node type in evaluate.");
+                    throw std::runtime_error("--emit-cpp: can't emit " + ASTNode::nodeTypeToString(node->getType()) + " as an expression");
             }
-
-            // This return should never be reached because all cases should be handled above.
-            throw std::runtime_error("Unexpected error in evaluate function.");
         }
 
-        int evaluateBinaryOperation(char op, int left, int right) {
+        std::string binary(BinaryOpNode* node) {
+            char op = node->getOp();
+            std::string left = expression(node->getLeft());
+            std::string value = temp();
+
+            // 'and' / 'or' short-circuit and yield the deciding operand
+            if (op == '&' || op == '|') {
+                line() << "int " << value << " = " << left << ";\n";
+                line() << "if (" << (op == '&' ? "" : "!") << value << ") {\n";
+                scope->indent++;
+                std::string right = expression(node->getRight());
+                line() << value << " = " << right << ";\n";
+                scope->indent--;
+                line() << "}\n";
+                return value;
+            }
+
+            std::string right = expression(node->getRight());
+            line() << "int " << value << " = ";
             switch (op) {
-                case '+': return left + right;
-                case '-': return left - right;
-                case '*': return left * right;
-                case '/': 
-                    if (right == 0) throw std::runtime_error("Division by zero.");
-                    return left / right;
-                case 'E':  // '=='
-                    return left == right;
-                case 'N':  // '!='
-                    return left != right;
-                case 'L':  // '<='
-                    return left <= right;
-                case 'G':  // '>='
-                    return left >= right;
-                case '<':
-                    return left < right;
-                case '>':
-                    return left > right;
-                case '%':
-                    return left % right;
-                case '^':
-                    return std::pow(left, right);
-                case '&':
-                    return left && right;
-                case '|':
-                    return left || right;
-                case '~':
-                    return ~left;
-                case '!':
-                    return !left;
-                case 'A':
-                    return left & right;
-                case 'O':
-                    return left | right;
-                default:
-                    throw std::runtime_error("Unsupported operator for binary operation.");
-            }     
+                case '+': scope->code << "add(" << left << ", " << right << ")"; break;
+                case '-': scope->code << "subtract(" << left << ", " << right << ")"; break;
+                case '*': scope->code << "multiply(" << left << ", " << right << ")"; break;
+                case '/': scope->code << "divide(" << left << ", " << right << ")"; break;
+                case 'F': scope->code << "floorDivide(" << left << ", " << right << ")"; break;
+                case '^': scope->code << "power(" << left << ", " << right << ")"; break;
+                case '%': scope->code << "modulo(" << left << ", " << right << ")"; break;  // Not `%`: literals would warn
+                case 'E': scope->code << left << " == " << right; break;
+                case 'N': scope->code << left << " != " << right; break;
+                case 'L': scope->code << left << " <= " << right; break;
+                case 'G': scope->code << left << " >= " << right; break;
+                case '<': scope->code << left << " < " << right; break;
+                case '>': scope->code << left << " > " << right; break;
+                case 'A': scope->code << left << " & " << right; break;
+                case 'O': scope->code << left << " | " << right; break;
+                case '~': scope->code << "~" << left; break;
+                case '!': scope->code << "!" << left; break;
+                default: throw std::runtime_error("--emit-cpp: unsupported operator");
+            }
+            scope->code << ";\n";
+            return value;
         }
-        
-        // Debugging
-        std::string conditionToString(ASTNode* node) {
-            if (!node) return "null";
-            switch (node->getType()) {
-                case ASTNodeType::BinaryOp: {
-                    BinaryOpNode* binNode = dynamic_cast<BinaryOpNode*>(node);
-                    char op = binNode->getOp();  // Assuming getOp() returns a char
-                    return conditionToString(binNode->getLeft().get()) + 
-                        " " + std::string(1, op) + " " + 
-                        conditionToString(binNode->getRight().get());
-                }
-                case ASTNodeType::Int: {
-                    IntNode* intNode = dynamic_cast<IntNode*>(node);
-                    return std::to_string(intNode->getValue());
+
+        // Looked up before the arguments are evaluated, like every engine does
+        std::string resolve(FunctionCallNode* node) {
+            std::string code = temp();
+            line() << "Code " << code << " = resolve(" << functionSlot(node->getName()) << ", "
+                   << node->getArguments().size() << ");\n";
+            return code;
+        }
+
+        std::string arguments(FunctionCallNode* node) {
+            std::vector<std::string> values;
+            for (ASTNode* arg : node->getArguments()) values.push_back(expression(arg));
+            std::string args = temp();
+            line() << "const int " << args << "[] = {";
+            for (size_t i = 0; i < values.size(); ++i) scope->code << (i ? ", " : "") << values[i];
+            scope->code << (values.empty() ? "0};\n" : "};\n");
+            return args;
+        }
+};
+
+/* --- Native modules --- */
+// --native=FILE.so runs a script that was emitted with --emit-cpp and built with
+// -shared -fPIC: no parsing, no interpreter, just the module's entry point
+#ifdef MYPYTHON_HAVE_MMAP
+int runNativeModule(const std::string& path) {
+    void* module = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!module) throw std::runtime_error(std::string("Can't load native module: ") + dlerror());
+    typedef int (*Entry)();
+    Entry entry = reinterpret_cast<Entry>(dlsym(module, "mypython_main"));
+    if (!entry) throw std::runtime_error("Not a mypython module (no mypython_main): " + path);
+    Output::instance().flush();
+    std::cout.flush();
+    return entry();  // Left loaded: its output buffer and thread are gone, but no need to risk it
+}
+#endif
+
+/* ----------- PROGRAM CACHE ----------- */
+// Compiled-program cache, like Python's .pyc files. The flat AST of a script is written to
+// <cache dir>/<key>.fast, where the key hashes the script's bytes together with the
+// interpreter build. A later run of the same script maps that image and skips the lexer
+// and the parser. A stale, truncated or corrupt image counts as a miss and gets rewritten.
+class ProgramCache {
+    public:
+        explicit ProgramCache(std::string directory) : directory(std::move(directory)) {}
+
+        // $MYPYTHON_CACHE_DIR, else $XDG_CACHE_HOME/mypython, else ~/.cache/mypython.
+        // Empty when none of them is set: no caching.
+        static std::string defaultDirectory() {
+            if (const char* dir = std::getenv("MYPYTHON_CACHE_DIR")) return dir;
+            if (const char* xdg = std::getenv("XDG_CACHE_HOME")) return std::string(xdg) + "/mypython";
+            if (const char* home = std::getenv("HOME")) return std::string(home) + "/.cache/mypython";
+            return "";
+        }
+
+        bool load(const SourceBuffer& script, FlatAst& program) const {
+            std::string path = imagePath(script);
+            try {
+                SourceBuffer image(path);  // Same mmap path as scripts
+                const char* bytes = image.data();
+                Header header;
+                if (image.size() < sizeof(header)) return false;
+                std::memcpy(&header, bytes, sizeof(header));
+
+                if (std::memcmp(header.magic, MAGIC, sizeof(header.magic)) != 0
+                    || std::strncmp(header.version, VERSION, sizeof(header.version)) != 0
+                    || header.sourceSize != script.size()
+                    || header.sourceHash != hashBytes(script.data(), script.size())
+                    || header.payloadSize != image.size() - sizeof(header)
+                    || header.payloadHash != hashBytes(bytes + sizeof(header), header.payloadSize)) {
+                    return false;
                 }
-                case ASTNodeType::Identifier: {
-                    IdentifierNode* idNode = dynamic_cast<IdentifierNode*>(node);
-                    return idNode->getIdentifier();
+
+                program = FlatAst::deserialize(bytes + sizeof(header), header.payloadSize);
+                return true;
+            } catch (const std::runtime_error&) {
+                return false;  // Missing or unreadable image, or deserialize() rejected it
+            }
+        }
+
+        // Best effort: a cache we can't write just means the next run parses again
+        void store(const SourceBuffer& script, const FlatAst& program) const {
+#ifdef MYPYTHON_HAVE_MMAP
+            std::string payload;
+            program.serialize(payload);
+
+            Header header;
+            std::memset(&header, 0, sizeof(header));
+            std::memcpy(header.magic, MAGIC, sizeof(header.magic));
+            std::strncpy(header.version, VERSION, sizeof(header.version) - 1);
+            header.sourceSize = script.size();
+            header.sourceHash = hashBytes(script.data(), script.size());
+            header.payloadSize = payload.size();
+            header.payloadHash = hashBytes(payload.data(), payload.size());
+
+            makeDirectories(directory);
+
+            // Write a private temp file and rename it into place, so a concurrent run
+            // sees either no image or a complete one
+            std::string path = imagePath(script);
+            std::string temp = path + ".tmp." + std::to_string(getpid());
+            {
+                std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+                if (!out) return;
+                out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+                out.write(payload.data(), payload.size());
+                if (!out.flush()) {
+                    out.close();
+                    std::remove(temp.c_str());
+                    return;
                 }
-                default:
-                    return "Unsupported node type";
             }
+            if (std::rename(temp.c_str(), path.c_str()) != 0) std::remove(temp.c_str());
+#else
+            (void)script;
+            (void)program;
+#endif
+        }
 
+    private:
+        // Bumped whenever the image layout or the FlatAst encoding changes. The build time
+        // is folded in as well, so a rebuilt interpreter never trusts an older image.
+        static constexpr const char* VERSION = "fast-1 " __DATE__ " " __TIME__;
+        static constexpr const char* MAGIC = "MYPYC\x1a\r\n";
+
+        struct Header {
+            char magic[8];
+            char version[40];
+            uint64_t sourceSize;
+            uint64_t sourceHash;
+            uint64_t payloadSize;
+            uint64_t payloadHash;
+        };
+
+        std::string directory;
+
+        std::string imagePath(const SourceBuffer& script) const {
+            uint64_t key = hashBytes(VERSION, std::strlen(VERSION), hashBytes(script.data(), script.size()));
+            char name[32];
+            std::snprintf(name, sizeof(name), "%016llx.fast", static_cast<unsigned long long>(key));
+            return directory + "/" + name;
+        }
+
+        static uint64_t hashBytes(const char* data, size_t size, uint64_t hash = 14695981039346656037ull) { // FNV-1a
+            for (size_t i = 0; i < size; ++i) {
+                hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+            }
+            return hash;
         }
 
+#ifdef MYPYTHON_HAVE_MMAP
+        static void makeDirectories(const std::string& path) { // mkdir -p; errors surface at write time
+            for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+                mkdir(path.substr(0, slash).c_str(), 0755);
+                if (slash == std::string::npos) break;
+            }
+        }
+#endif
 };
 
+/* ----------- BENCHMARKS ----------- */
 
+// Seconds per full lexing pass over the script
+double timeLexer(const SourceBuffer& script, bool vectorScan, size_t& tokenCount) {
+    typedef std::chrono::steady_clock Clock;
+    size_t passes = 0;
+    Clock::time_point begin = Clock::now();
+    double elapsed = 0;
 
-// Utility Function: Read file, turn into string
-std::string fileToString(const std::string& path) {
-    std::ifstream file(path);
-    if (!file) {
-        throw std::runtime_error("Could not open file: " + path);
+    do { // At least half a second worth of passes so small scripts still give a stable figure
+        Lexer lexer(script.data(), script.size(), vectorScan);
+        tokenCount = 0;
+        while (lexer.next().type != TokenType::END_OF_FILE) tokenCount++;
+        passes++;
+        elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+    } while (elapsed < 0.5);
+
+    return elapsed / passes;
+}
+
+// --bench-lex: lexing throughput with the scalar scanners vs. the SSE2/AVX2 ones
+int benchLexer(const SourceBuffer& script) {
+    size_t scalarTokens = 0, vectorTokens = 0;
+    double scalar = timeLexer(script, false, scalarTokens);
+    double vector = timeLexer(script, true, vectorTokens);
+
+    double megabytes = script.size() / (1024.0 * 1024.0);
+    std::cout << "bytes: " << script.size() << ", tokens: " << vectorTokens << std::endl;
+#ifdef MYPYTHON_SIMD_WIDTH
+    std::cout << "vector width: " << MYPYTHON_SIMD_WIDTH << " bytes" << std::endl;
+#else
+    std::cout << "vector width: none (scalar fallback)" << std::endl;
+#endif
+    std::cout << "scalar: " << megabytes / scalar << " MB/s" << std::endl;
+    std::cout << "vector: " << megabytes / vector << " MB/s" << std::endl;
+    std::cout << "speedup: " << scalar / vector << "x" << std::endl;
+
+    if (scalarTokens != vectorTokens) {
+        std::cerr << "Token count mismatch between scanners: " << scalarTokens << " vs " << vectorTokens << std::endl;
+        return 1;
     }
-    return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return 0;
+}
+
+// Seconds per run of the script, with its output thrown away
+template <typename Run>
+double timeEngine(Run run) {
+    typedef std::chrono::steady_clock Clock;
+    Output::instance().setDiscarding(true);  // Timings include formatting but not the terminal
+    size_t runs = 0;
+    Clock::time_point begin = Clock::now();
+    double elapsed = 0;
+
+    try {
+        do {
+            run();
+            runs++;
+            elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+        } while (elapsed < 0.5);
+    } catch (...) {
+        Output::instance().setDiscarding(false);
+        throw;
+    }
+
+    Output::instance().setDiscarding(false);
+    return elapsed / runs;
+}
+
+// --bench-engines: the same script on every engine, relative to the tree walker.
+// Each run starts from a fresh interpreter (compilation included).
+int benchEngines(const NodeList& astNodes, const FlatAst& program) {
+    double tree = timeEngine([&]() {
+        Interpreter interpreter;
+        for (ASTNode* root : astNodes) interpreter.interpret(root);
+    });
+    double flat = timeEngine([&]() { FlatInterpreter(program).run(); });
+    double closure = timeEngine([&]() { ClosureCompiler(program, Resolver::resolve(program)).run(); });
+    double vm = timeEngine([&]() { VirtualMachine(BytecodeCompiler(program, Resolver::resolve(program)).compile()).run(); });
+
+    const char* names[] = {"tree", "flat", "closure", "vm"};
+    double times[] = {tree, flat, closure, vm};
+    for (size_t i = 0; i < 4; ++i) {
+        std::cout << names[i] << ": " << times[i] * 1e3 << " ms/run, " << tree / times[i] << "x" << std::endl;
+    }
+    return 0;
 }
 
 
 /* ----------- MAIN ----------- */
 int main(int argc, char* argv[]) {
+    bool traceDump = false;
+    bool profile = false;
+    std::string profileStacks;
+    std::unique_ptr<Profiler> profiler;  // Once a profiled run has started
     
     try {
 
-        if (argc < 2) {
-            std::cerr << "Usage: " << argv[0] << " <script file>" << std::endl;
+        bool dumpTokens = false;
+        bool benchLex = false;
+        bool benchEngine = false;
+        std::string engine = "vm";
+        bool engineGiven = false;
+        bool dumpBytecode = false;
+        bool astStats = false;
+        bool callStats = false;
+        bool optimize = true;
+        bool dumpOptimized = false;
+        unsigned jobs = std::thread::hardware_concurrency();
+        size_t maxDepth = 0;  // 0: the engine's default
+        size_t maxStackMB = DEFAULT_VM_STACK_MB;
+        size_t memoEntries = 0;  // 0: no memoizing
+        uint32_t jitThreshold = 0;  // 0: no JIT
+        bool emitCpp = false;
+        std::string emitPath;  // Empty: stdout
+        std::string nativeModule;
+        std::string cacheDir = ProgramCache::defaultDirectory();
+        const char* scriptPath = nullptr;
+
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--dump-tokens") {
+                dumpTokens = true;
+            } else if (arg == "--bench-lex") {
+                benchLex = true;
+            } else if (arg == "--bench-engines") {
+                benchEngine = true;
+            } else if (arg.compare(0, 9, "--engine=") == 0) {
+                engine = arg.substr(9);
+                engineGiven = true;
+                if (engine != "vm" && engine != "tree" && engine != "flat" && engine != "closure") {
+                    throw std::runtime_error("Unknown engine: " + engine + " (expected vm, tree, flat or closure)");
+                }
+            } else if (arg == "--dump-bytecode") {
+                dumpBytecode = true;
+            } else if (arg == "--ast-stats") {
+                astStats = true;
+            } else if (arg == "--no-optimize") {
+                optimize = false;
+            } else if (arg == "--dump-optimized") {
+                dumpOptimized = true;
+            } else if (arg == "--stats") {
+                callStats = true;
+            } else if (arg == "--memoize") {
+                memoEntries = DEFAULT_MEMO_ENTRIES;
+            } else if (arg.compare(0, 10, "--memoize=") == 0) {
+                memoEntries = std::stoul(arg.substr(10));
+            } else if (arg == "--jit" || arg.compare(0, 6, "--jit=") == 0) {
+#ifdef MYPYTHON_JIT
+                jitThreshold = arg.size() > 5 ? static_cast<uint32_t>(std::stoul(arg.substr(6))) : DEFAULT_JIT_THRESHOLD;
+#else
+                std::cerr << "The JIT is not available on this platform (x86-64 Linux with GCC or Clang)" << std::endl;
+#endif
+            } else if (arg == "--emit-cpp" || arg.compare(0, 11, "--emit-cpp=") == 0) {
+                emitCpp = true;
+                if (arg.size() > 10) emitPath = arg.substr(11);
+            } else if (arg.compare(0, 9, "--native=") == 0) {
+                nativeModule = arg.substr(9);
+            } else if (arg == "--profile" || arg.compare(0, 10, "--profile=") == 0) {
+                profile = true;
+                if (arg.size() > 9) profileStacks = arg.substr(10);
+            } else if (arg == "--no-cache") {
+                cacheDir.clear();
+            } else if (arg.compare(0, 12, "--cache-dir=") == 0) {
+                cacheDir = arg.substr(12);
+            } else if (arg.compare(0, 12, "--max-depth=") == 0) {
+                maxDepth = std::stoul(arg.substr(12));
+            } else if (arg.compare(0, 12, "--max-stack=") == 0) {
+                maxStackMB = std::stoul(arg.substr(12));
+            } else if (arg.compare(0, 7, "--jobs=") == 0) {
+                jobs = static_cast<unsigned>(std::stoul(arg.substr(7)));
+            } else if (arg.compare(0, 8, "--trace=") == 0) {
+#ifdef MYPYTHON_TRACE
+                Tracer::instance().configure(arg.substr(8));
+                traceDump = true;
+#else
+                std::cerr << "Tracing is not compiled in (rebuild with -DMYPYTHON_TRACE)" << std::endl;
+#endif
+            } else {
+                scriptPath = argv[i];
+            }
+        }
+
+        if (memoEntries && engine == "tree") {
+            throw std::runtime_error("--memoize needs the vm, flat or closure engine");
+        }
+        if (jitThreshold && engine != "vm") {
+            throw std::runtime_error("--jit needs the vm engine");
+        }
+        if (profile) {
+            // It instruments the tree engine's calls and statements
+            if (engineGiven && engine != "tree") throw std::runtime_error("--profile runs on the tree engine only");
+            engine = "tree";
+        }
+
+        if (!nativeModule.empty()) {
+#ifdef MYPYTHON_HAVE_MMAP
+            return runNativeModule(nativeModule);
+#else
+            throw std::runtime_error("--native needs dlopen, which this platform doesn't have");
+#endif
+        }
+
+        if (!scriptPath) {
+            std::cerr << "Usage: " << argv[0] << " [--dump-tokens] [--dump-bytecode] [--bench-lex] [--bench-engines] [--engine=vm|tree|flat|closure] [--ast-stats] [--stats] [--no-optimize] [--dump-optimized] [--memoize[=N]] [--jit[=N]] [--emit-cpp[=FILE]] [--native=FILE.so] [--profile[=FILE]] [--jobs=N] [--max-depth=N] [--max-stack=MB] [--no-cache] [--cache-dir=DIR] [--trace=<spec>] <script file>" << std::endl;
             return 1;
         }
 
-        // Read the script from the file specified by the first command line argument
-        std::string script = fileToString(argv[1]);
+        // Map the script; tokens point straight into it
+        SourceBuffer script(scriptPath);
+
+        if (benchLex) {
+            return benchLexer(script);
+        }
 
-        Lexer lexer(script);
-        auto tokens = lexer.getTokens();
+        // Debugging: Prints every TokenType & lexeme up front
+        if (dumpTokens) {
+            Lexer dumpLexer(script.data(), script.size());
+            for (const auto& token : dumpLexer.tokenize()) {
+                token.print(script.data());
+            }
 
-        // Debugging: Prints TokenType & lexeme upon generation
-        for (const auto& token : tokens) { 
-            token.print(); 
+            std::cout << std::endl;
         }
-        
-        std::cout << std::endl;
 
-        Parser parser(tokens);
-        auto astNodes = parser.parse();
+        // Warm start: a cached image of this exact script skips lexing and parsing. The
+        // tree engine, --ast-stats, --dump-optimized and --emit-cpp need the pointer AST, and tracing
+        // wants to see the front end, so those go the long way (but still refresh the
+        // cache). Images hold optimized programs, so --no-optimize bypasses the cache.
+        ProgramCache cache(cacheDir);
+        bool caching = !cacheDir.empty() && !traceDump && optimize;
+        FlatAst program;
+        CallStats stats;
+        if (!(caching && engine != "tree" && !astStats && !dumpOptimized && !emitCpp && !benchEngine && cache.load(script, program))) {
+            // Big scripts are split at top-level statements and parsed on several threads.
+            // The trace ring isn't thread-safe, so tracing parses on one.
+            if (traceDump) jobs = 1;
+            AstArena arena;  // Owns the whole AST; freed in one go at the end
+            NodeList astNodes = ParallelParser(script.data(), script.size(), arena, jobs).parse();
+
+            for (ASTNode* node : astNodes) {
+                TRACE(Parser, Info, Statement, node->getType(), 0);
+            }
+
+            Optimizer optimizer(arena);
+            if (optimize) astNodes = optimizer.run(astNodes);
+            if (dumpOptimized) {
+                AstPrinter(std::cerr).print(astNodes);
+                optimizer.printStats(std::cerr);
+            }
+
+            if (emitCpp) {
+                CppEmitter emitter(maxDepth ? maxDepth : UNLIMITED_DEPTH, maxStackMB << 20);
+                if (emitPath.empty()) {
+                    emitter.emit(astNodes, std::cout);
+                } else {
+                    std::ofstream out(emitPath);
+                    emitter.emit(astNodes, out);
+                    if (!out) throw std::runtime_error("Can't write " + emitPath);
+                }
+                return 0;
+            }
+
+            program = FlatAstBuilder::build(astNodes);
+            if (caching) cache.store(script, program);
+            if (astStats) {
+                std::cerr << "nodes: " << program.size() << ", pointer AST: " << arena.bytesUsed()
+                          << " bytes, flat AST: " << program.bytesUsed() << " bytes" << std::endl;
+            }
+
+            if (benchEngine) {
+                return benchEngines(astNodes, program);
+            }
+
+            if (engine == "tree") {  // The reference evaluator
+                Interpreter interpreter(maxDepth ? maxDepth : DEFAULT_MAX_DEPTH);
+                if (profile) profiler.reset(new Profiler());
+                interpreter.setProfiler(profiler.get());
+                for (size_t i = 0; i < astNodes.size(); ++i) {
+                    if (profiler) profiler->enterStatement(i);
+                    interpreter.interpret(astNodes[i]);  // Interpret each AST node
+                    if (profiler) profiler->exitStatement();
+                }
+                stats = interpreter.getStats();
+            }
+        }
 
-        // Debugging: Prints ASTNode type upon generation
-        for (const auto& node : astNodes) {
-            std::cout << "Generated AST Node Type: " << ASTNode::nodeTypeToString(node->getType()) << std::endl;
+        // The other engines share the resolved program, and the memo tables if asked for
+        Resolution names;
+        std::unique_ptr<MemoCache> memo;
+        if (engine != "tree") {
+            names = Resolver::resolve(program);
+            if (memoEntries) memo.reset(new MemoCache(program, PurityAnalyzer::analyze(program, names), memoEntries));
         }
-        
-        std::cout << std::endl;
-       
-        Interpreter interpreter;
-        for (auto& root : astNodes) {
-            interpreter.interpret(root.get());  // Interpret each AST node
+
+        if (engine == "flat") {
+            FlatInterpreter interpreter(program, maxDepth ? maxDepth : DEFAULT_MAX_DEPTH, memo.get());
+            interpreter.run();
+            stats = interpreter.getStats();
+        } else if (engine == "closure") {
+            ClosureCompiler compiler(program, names, maxDepth ? maxDepth : DEFAULT_MAX_DEPTH, memo.get());
+            compiler.run();
+            stats = compiler.getStats();
+        } else if (engine == "vm") {
+            BytecodeProgram bytecode = BytecodeCompiler(program, names, memo.get()).compile();
+            if (dumpBytecode) bytecode.disassemble(std::cerr);
+            VirtualMachine vm(bytecode, maxDepth ? maxDepth : UNLIMITED_DEPTH, maxStackMB << 20, memo.get());
+#ifdef MYPYTHON_JIT
+            if (jitThreshold) vm.enableJit(jitThreshold);
+#endif
+            vm.run();
+            stats = vm.getStats();
+#ifdef MYPYTHON_JIT
+            if (callStats && jitThreshold) vm.printJitStats(std::cerr);
+#endif
+        }
+
+        Output::instance().flush();  // The script's output goes before the reports
+        if (callStats) {
+            stats.print(std::cerr);
+            if (memo) memo->print(std::cerr);
         }
         
     } catch (const std::exception& e) {
+        Output::instance().flush();
         std::cerr << "Error: " << e.what() << std::endl;
+        if (traceDump) Tracer::instance().dump(std::cerr);
+        if (profiler) profiler->report(std::cerr, profileStacks);
         return 1;
     }
 
+    if (traceDump) Tracer::instance().dump(std::cerr);
+    if (profiler && !profiler->report(std::cerr, profileStacks)) return 1;
     return 0;
 
 }
\ No newline at end of file
@@ -0,0 +1,31 @@
+#Operators: power, floor division, unary minus, and/or/not, parentheses
+
+a = 7
+b = 2
+c = -a + 3
+d = 2 ** 3 ** 2
+e = -2 ** 2
+f = a // b
+g = -a // b
+h = (a + b) * (a - b)
+i = a > b and b > 0
+j = a < b or 5
+k = not a == b
+m = 0 and undefined_name
+n = a % b + a * b // 3
+
+def show(x):
+    print("show", x)
+
+show(h - 1)
+print("c =", c)
+print("d =", d)
+print("e =", e)
+print("f =", f)
+print("g =", g)
+print("h =", h)
+print("i =", i)
+print("j =", j)
+print("k =", k)
+print("m =", m)
+print("n =", n, "and", True + True, False, -(-b))
@@ -0,0 +1,49 @@
+#Constant expressions, constant conditions and variables reassigned in branches
+
+day = 60 * 60 * 24
+x = 2
+y = x * 3 + 1
+print("day =", day, "y =", y)
+if y > 5:
+    print("big")
+else:
+    print("small")
+if x:
+    z = 1
+else:
+    z = 2
+print("z =", z)
+w = 0 and undefined_name
+print(w, 1 or 5, 0 or 7, 3 and 4, -x, not x, 7 // -2, 2 ** 10)
+
+def f(n):
+    k = 10
+    if n > 0:
+        k = n
+    return k + x
+
+def g(n):
+    if 1:
+        if n > 2:
+            return 1
+        n = n + 5
+    if 0:
+        return 9
+    return n
+
+print(f(3), f(-1), g(3), g(0))
+if 1:
+    return 5
+    print("unreachable")
+x = f(2)
+print("x =", x + 1)
+if 1:
+    x = 1
+    return 0
+    x = 2
+print("x =", x)
+print("before the def")
+def never():
+    m = -2147483647 - 1
+    return m / -1 + m // -1 + m % -1 + -m
+print("after it")
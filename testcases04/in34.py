@@ -0,0 +1,51 @@
+#Small functions called before/after their def, redefined, reading globals and locals
+g = 100
+def sq(v):
+    return v * v
+def noisy(v):
+    print("noisy", v)
+    return v + 1
+def reads_global(v):
+    w = v + g
+    return w
+def fallback(v):
+    if v > 0:
+        g = v
+    return g
+def outer(a):
+    return sq(a) + 1
+def twice(a):
+    b = sq(a)
+    return sq(b)
+def uses_g(a):
+    g = 5
+    r = reads_global(a)
+    return r
+def fact(n):
+    if n < 2:
+        return 1
+    return n * fact(n - 1)
+def div(a):
+    return 10 / a
+print(sq(7), twice(3), outer(4))
+x = noisy(1)
+print(reads_global(1), uses_g(1), fallback(0), fallback(3), fact(5))
+noisy(9)
+i = 0
+total = 0
+def loop(n, acc):
+    if n == 0:
+        return acc
+    return loop(n - 1, acc + sq(n))
+print(loop(1000, 0))
+def late_caller(v):
+    return later(v)
+def later(v):
+    return v - 1
+print(late_caller(5))
+def redef(v):
+    return 1
+print(redef(0))
+def redef(v):
+    return 2
+print(redef(0))
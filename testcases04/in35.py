@@ -0,0 +1,31 @@
+#Pure functions calling each other, then a callee redefined (same output with --memoize)
+
+def fib(n):
+    if n < 2:
+        return n
+    return fib(n - 1) + fib(n - 2)
+
+def even(n):
+    if n == 0:
+        return 1
+    return odd(n - 1)
+
+def odd(n):
+    if n == 0:
+        return 0
+    return even(n - 1)
+
+print(fib(25), even(10), odd(7))
+
+def g(n):
+    return n * 20
+
+def f(n):
+    if n > 1:
+        return f(n - 1) + 1
+    return g(n) + 1
+
+print(f(2))
+def g(n):
+    return n * 30
+print(f(2))
@@ -0,0 +1,15 @@
+# Redefining a function must reach callers compiled against the old one
+def step(x):
+    return x + 1
+
+def walk(n, acc):
+    if n == 0:
+        return acc
+    return walk(n - 1, step(acc))
+
+print(walk(5, 0))
+
+def step(x):
+    return x * 2
+
+print(walk(5, 1))
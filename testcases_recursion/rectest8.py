@@ -0,0 +1,27 @@
+# Tail calls run in constant stack, so these go far past the default recursion limit
+def total(n, acc):
+    if n == 0:
+        return acc
+    return total(n - 1, acc + n)
+
+print(total(50000, 0))
+
+def ping(n):
+    if n == 0:
+        return 1
+    return pong(n - 1)
+
+def pong(n):
+    if n == 0:
+        return 0
+    return ping(n - 1)
+
+print(ping(40001))
+
+def countdown(n):
+    if n == 0:
+        print("done")
+    else:
+        countdown(n - 1)
+
+print(countdown(30000))